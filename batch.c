@@ -0,0 +1,258 @@
+/**
+ * Batch runner: many small scripts, without paying for process startup
+ * and loading lib.lisp for each of them.
+ *
+ * Workers take the next script from a counter in shared memory. A worker
+ * runs a script with its stdout redirected to a file of its own, then
+ * writes the result record with a single (appending) write, and drops
+ * the script's definitions by going back to the environment it started
+ * out with. (Values changed in place with 'set!' do stay changed.)
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "node.h"
+#include "memory.h"
+#include "parse.h"
+#include "transform.h"
+#include "eval.h"
+#include "print.h"
+#include "gc.h"
+#include "batch.h"
+
+typedef struct Running {
+  int script;     // or -1
+  double started;
+} Running;
+
+typedef struct Shared {
+  int next;       // the next script to run
+  Running running[]; // per worker
+} Shared;
+
+typedef struct Batch {
+  const char * dir;
+  struct dirent ** scripts;
+  int num_scripts;
+  int results;    // fd
+  FILE ** outputs; // per worker
+  Shared * shared;
+} Batch;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int is_script(const struct dirent * entry)
+{
+  size_t len = strlen(entry->d_name);
+  return len > 5 && strcmp(entry->d_name + len - 5, ".lisp") == 0;
+}
+
+static void output_json_string(Output * out, const char * chars, size_t len)
+{
+  output_chars(out, "\"", 1);
+  for (size_t i=0; i<len; i++)
+  {
+    unsigned char ch = chars[i];
+    if (ch == '\"' || ch == '\\')
+    {
+      char escaped[2] = { '\\', ch };
+      output_chars(out, escaped, 2);
+    }
+    else if (ch == '\n') output_chars(out, "\\n", 2);
+    else if (ch < 0x20)
+    {
+      char escaped[8];
+      output_chars(out, escaped, sprintf(escaped, "\\u%04x", ch));
+    }
+    else output_chars(out, chars + i, 1);
+  }
+  output_chars(out, "\"", 1);
+}
+
+// Whatever is in the worker's output file
+static char * read_output(FILE * file, size_t * len)
+{
+  off_t size = lseek(fileno(file), 0, SEEK_END);
+  char * data = malloc(size > 0 ? size : 1);
+  ssize_t n = size > 0 ? pread(fileno(file), data, size, 0) : 0;
+  *len = n > 0 ? n : 0;
+  return data;
+}
+
+static void write_result(Batch * batch, int script, const char * status, double ms, FILE * output)
+{
+  size_t len;
+  char * data = read_output(output, &len);
+
+  Output out = { NULL, 0, 0, NULL };
+  const char * name = batch->scripts[script]->d_name;
+  output_chars(&out, "{\"script\": ", 11);
+  output_json_string(&out, name, strlen(name));
+
+  char fields[128];
+  output_chars(&out, fields, sprintf(fields, ", \"status\": \"%s\", \"ms\": %.3f, \"output\": ", status, ms));
+  output_json_string(&out, data, len);
+  output_chars(&out, "}\n", 2);
+
+  if (write(batch->results, out.data, out.len) != out.len) perror("Batch results");
+  free(out.data);
+  free(data);
+}
+
+static void run_script(FILE * file)
+{
+  set_infile(file);
+
+  Node * node;
+  while ((node = parse()) != NULL)
+  {
+    node = transform(node, &context->environment, context->environment);
+    if (node == NULL) continue;
+    if (!node->special) node = eval(node, context->environment);
+    print(node);
+    collect_garbage();
+  }
+}
+
+static void work(Batch * batch, int worker)
+{
+  FILE * output = batch->outputs[worker];
+  dup2(fileno(output), STDOUT_FILENO);
+  // So that we have the output up to a crash
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  Node * environment = context->environment;
+  Node * macros = context->macros;
+
+  int script;
+  while ((script = __atomic_fetch_add(&batch->shared->next, 1, __ATOMIC_RELAXED)) < batch->num_scripts)
+  {
+    Running * running = &batch->shared->running[worker];
+    running->started = now();
+    running->script = script;
+    ftruncate(STDOUT_FILENO, 0);
+    lseek(STDOUT_FILENO, 0, SEEK_SET);
+
+    char path[strlen(batch->dir) + strlen(batch->scripts[script]->d_name) + 2];
+    sprintf(path, "%s/%s", batch->dir, batch->scripts[script]->d_name);
+    FILE * file = fopen(path, "r");
+
+    if (file != NULL)
+    {
+      run_script(file);
+      fclose(file);
+    }
+    double ms = (now() - running->started) * 1000;
+    fflush(stdout);
+
+    write_result(batch, script, file != NULL ? "ok" : "unreadable", ms, output);
+    running->script = -1;
+
+    context->environment = environment;
+    context->macros = macros;
+    collect_garbage();
+  }
+  _exit(0);
+}
+
+static pid_t spawn(Batch * batch, int worker)
+{
+  pid_t pid = fork();
+  if (pid == 0) work(batch, worker);
+  if (pid < 0) perror("Batch fork");
+  return pid;
+}
+
+int run_batch(const char * dir, int jobs, const char * results)
+{
+  Batch batch = { dir };
+  batch.num_scripts = scandir(dir, &batch.scripts, is_script, alphasort);
+  if (batch.num_scripts < 0)
+  {
+    printf("Cannot read batch directory '%s'\n", dir);
+    return 1;
+  }
+
+  batch.results = open(results, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (batch.results < 0)
+  {
+    printf("Cannot write batch results to '%s'\n", results);
+    return 1;
+  }
+
+  if (jobs < 1) jobs = 1;
+  size_t shared_size = sizeof(Shared) + sizeof(Running) * jobs;
+  batch.shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  batch.outputs = malloc(sizeof(FILE *) * jobs);
+  pid_t pids[jobs];
+
+  // Give the workers a tidy heap to share
+  collect_garbage();
+  fflush(stdout);
+
+  double start = now();
+  int live = 0;
+  for (int i=0; i<jobs; i++)
+  {
+    batch.shared->running[i].script = -1;
+    batch.outputs[i] = tmpfile();
+    pids[i] = spawn(&batch, i);
+    if (pids[i] > 0) live++;
+  }
+
+  int crashed = 0;
+  while (live > 0)
+  {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) break;
+
+    int worker = 0;
+    while (worker < jobs && pids[worker] != pid) worker++;
+    if (worker == jobs) continue;
+
+    // Report the script that the worker was running, if any
+    Running * running = &batch.shared->running[worker];
+    if (running->script >= 0)
+    {
+      char reason[32];
+      if (WIFSIGNALED(status)) sprintf(reason, "signal %d", WTERMSIG(status));
+      else sprintf(reason, "exit %d", WEXITSTATUS(status));
+      write_result(&batch, running->script, reason, (now() - running->started) * 1000, batch.outputs[worker]);
+      running->script = -1;
+      crashed++;
+    }
+
+    if (__atomic_load_n(&batch.shared->next, __ATOMIC_RELAXED) < batch.num_scripts)
+    {
+      pids[worker] = spawn(&batch, worker);
+      if (pids[worker] > 0) continue;
+    }
+    live--;
+  }
+
+  printf("{\"scripts\": %d, \"jobs\": %d, \"crashed\": %d, \"seconds\": %.3f, \"results\": \"%s\"}\n",
+    batch.num_scripts, jobs, crashed, now() - start, results);
+
+  for (int i=0; i<jobs; i++) fclose(batch.outputs[i]);
+  for (int i=0; i<batch.num_scripts; i++) free(batch.scripts[i]);
+  free(batch.scripts);
+  free(batch.outputs);
+  munmap(batch.shared, shared_size);
+  close(batch.results);
+  return crashed == 0 ? 0 : 1;
+}
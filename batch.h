@@ -0,0 +1,18 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/**
+ * Run every '.lisp' script in 'dir', in 'jobs' worker processes forked
+ * from the present (initialized) interpreter, which they share copy-on-
+ * write. Each script starts out from the environment as it is now.
+ *
+ * For each script, a JSON line with its output, status and time in ms
+ * is appended to 'results'; the lines come in order of completion.
+ * A worker that dies halfway a script is replaced, and the script is
+ * reported as crashed.
+ *
+ * Returns the process exit status: 0 if all scripts ran.
+ */
+int run_batch(const char * dir, int jobs, const char * results);
+
+#endif /* BATCH_H */
@@ -0,0 +1,7 @@
+;; Ackermann function: recursion that is both deep and wide
+(define (ack m n)
+  (if (= m 0) (+ n 1)
+    (if (= n 0) (ack (- m 1) 1)
+      (ack (- m 1) (ack m (- n 1))))))
+(ack 2 200)
+(ack 3 5)
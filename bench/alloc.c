@@ -0,0 +1,98 @@
+/**
+ * Node allocation throughput benchmark.
+ *
+ *   unpair-allocbench [nodes]
+ *
+ * Has 1, 2, 4, 8 and 16 threads share one context and allocate 'nodes'
+ * nodes between them (4M by default), both from their own allocation
+ * buffers (as when running 'pmap' or futures) and, for comparison, with
+ * every allocation under the heap lock. Reports millions of nodes per
+ * second as JSON.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../node.h"
+#include "../memory.h"
+
+#define DEFAULT_NODES (4 * 1024 * 1024)
+#define RUNS 3
+
+static const int thread_counts[] = { 1, 2, 4, 8, 16 };
+#define NUM_THREAD_COUNTS (sizeof(thread_counts) / sizeof(thread_counts[0]))
+
+typedef struct Run {
+  Context * context;
+  long nodes;
+  bool locked;
+} Run;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void * allocate(void * arg)
+{
+  Run * run = arg;
+  use_context(run->context);
+
+  // Chain the nodes in pairs, so that the work is not all allocation
+  Node * last = NIL;
+  for (long i=0; i<run->nodes; i++)
+  {
+    if (run->locked) pthread_mutex_lock(&context->heap_lock);
+    Node * node = new_node(TYPE_INT, i);
+    if (run->locked) pthread_mutex_unlock(&context->heap_lock);
+
+    node->next = i % 2 == 0 ? 0 : index(last);
+    last = node;
+  }
+  return NULL;
+}
+
+// Best throughput in millions of nodes per second
+static double measure(int num_threads, long nodes, bool locked)
+{
+  double best = 0;
+  for (int r=0; r<RUNS; r++)
+  {
+    Context * ctx = new_context();
+    ctx->sharing = num_threads;
+    Run run = { ctx, nodes / num_threads, locked };
+
+    pthread_t threads[num_threads];
+    double start = now();
+    for (int i=0; i<num_threads; i++)
+      pthread_create(&threads[i], NULL, allocate, &run);
+    for (int i=0; i<num_threads; i++)
+      pthread_join(threads[i], NULL);
+    double rate = run.nodes * num_threads / (now() - start) / 1e6;
+
+    free_context(ctx);
+    if (rate > best) best = rate;
+  }
+  return best;
+}
+
+int main(int argc, char ** argv)
+{
+  long nodes = argc > 1 ? atol(argv[1]) : DEFAULT_NODES;
+
+  printf("{\"nodes\": %ld, \"runs\": [", nodes);
+  for (int i=0; i<NUM_THREAD_COUNTS; i++)
+  {
+    int num_threads = thread_counts[i];
+    printf("%s{\"threads\": %d, \"buffered_mnodes_per_s\": %.1f, \"locked_mnodes_per_s\": %.1f}",
+      i == 0 ? "" : ", ", num_threads, measure(num_threads, nodes, false), measure(num_threads, nodes, true));
+    fflush(stdout);
+  }
+  printf("]}\n");
+  return 0;
+}
@@ -0,0 +1,9 @@
+;; Building lists with cons and list; (time) reports the nodes allocated
+(define (integers-from n) (stream-cons n (integers-from (+ n 1))))
+(define xs (stream->list (stream-take 100000 (integers-from 0))))
+(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))
+(time (length (build 2000 '())))
+(time (length (map list xs)))
+(time (length (map cons xs xs)))
+(time (length (map (lambda (x) (cons x '())) xs)))
+(time (length (list 1 2 3 4 5 6 7 8 9 10)))
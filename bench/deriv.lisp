@@ -0,0 +1,18 @@
+;; Symbolic differentiation: list building and symbol comparison
+(define (caddr x) (car (cdr (cdr x))))
+
+(define (deriv e)
+  (if (= (length e) 0)
+    (if (= e 'x) 1 0)
+    (if (= (car e) '+)
+      (list '+ (deriv (cadr e)) (deriv (caddr e)))
+      (if (= (car e) '*)
+        (list '+
+          (list '* (cadr e) (deriv (caddr e)))
+          (list '* (deriv (cadr e)) (caddr e)))
+        e))))
+
+(define expr '(+ (* 3 (* x x)) (+ (* a x) (* (* x x) (+ x b)))))
+
+(define (repeat n result) (if (= n 0) result (repeat (- n 1) (deriv expr))))
+(repeat 5000 '())
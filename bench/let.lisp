@@ -0,0 +1,18 @@
+;; Macro-heavy code: nested lets, expanded afresh by every eval
+(define-syntax let*2
+  (lambda (_ a b body)
+    (list 'let (list a) (list 'let (list b) body))))
+
+(define (poly x)
+  (let ((a (* x x)))
+    (let*2 (b (+ a x)) (c (* b 2))
+      (let ((d (- c a)) (e (+ c 1)))
+        (+ a (+ b (+ c (+ d e))))))))
+
+(define (sum-poly n acc) (if (= n 0) acc (sum-poly (- n 1) (+ acc (poly n)))))
+(sum-poly 10000 0)
+
+(define (expand n acc)
+  (if (= n 0) acc
+    (expand (- n 1) (+ acc (eval (list 'let (list (list 'y n)) '(let*2 (z (* y 2)) (w (+ z 1)) (+ y (+ z w)))))))))
+(expand 10000 0)
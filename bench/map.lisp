@@ -0,0 +1,7 @@
+;; map, filter and folds over a list of 200,000 elements
+(define (integers-from n) (stream-cons n (integers-from (+ n 1))))
+(define xs (stream->list (stream-take 200000 (integers-from 0))))
+(length xs)
+(fold-left + 0 (map (lambda (x) (% x 7)) xs))
+(length (filter (lambda (x) (= (% x 3) 0)) xs))
+(fold-right (lambda (x acc) (+ acc 1)) 0 (reverse xs))
@@ -0,0 +1,317 @@
+/**
+ * Allocator, GC, interning and lookup microbenchmarks.
+ *
+ *   unpair-microbench [repetitions] [name]
+ *
+ * Times memory.c and gc.c functions in isolation, without the parser or
+ * the evaluator: new_node, new_array_node, retrofit, copy and mark+sweep
+ * on heaps of 64K, 512K and 4M nodes with 0%, 50% and 90% of them
+ * garbage, unique_string over 1K, 16K and 256K interned strings, and
+ * lookup_internal over environments of 8, 64 and 512 variables.
+ *
+ * The heaps are made of blocks of 1, 2, 4 and 8 nodes in turn, spread
+ * evenly over live and garbage, and swept before timing, so that the
+ * free list holds blocks of all those sizes in between live ones. Each
+ * sample times a batch of operations (up to OPS, or as many as fit in
+ * MAX_BATCH seconds) on a freshly built heap; after WARMUP samples, the
+ * given number of samples (20 by default) are kept. Only benchmarks
+ * whose name contains 'name' are run. Reports nanoseconds per operation
+ * as JSON, with one mark+sweep of the whole heap as one operation.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../node.h"
+#include "../memory.h"
+#include "../gc.h"
+
+#define DEFAULT_REPETITIONS 20
+#define WARMUP 3
+#define OPS 10000
+#define MAX_BATCH 0.05
+
+static const uint32_t heap_sizes[] = { 64 * 1024, 512 * 1024, 4 * 1024 * 1024 };
+static const int garbage_percents[] = { 0, 50, 90 };
+static const uint32_t string_counts[] = { 1024, 16 * 1024, 256 * 1024 };
+static const uint32_t env_sizes[] = { 8, 64, 512 };
+
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+// What the benchmarks work on: the live part of the heap, a list to copy,
+// and names to intern or look up
+static Node * live;
+static Node * list;
+static Node * env;
+static char (* names)[16];
+static uint32_t num_names;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// The same sequence of pseudo-random numbers every time
+static uint32_t next_random(uint32_t * state)
+{
+  *state = *state * 1103515245 + 12345;
+  return *state >> 8;
+}
+
+//
+// Heaps
+//
+
+// Mark what the benchmarks hold on to, and sweep the rest
+static void mark_and_sweep()
+{
+  mark(&memory[0]);
+  mark(&memory[1]);
+  mark(live);
+  mark(list);
+  context->freelist = sweep(0);
+}
+
+/**
+ * Lay out a heap of 'size' nodes in place, in blocks of 1, 2, 4 and 8
+ * nodes, 'garbage_percent' of which are unreachable; then the list to
+ * copy. Sweep the garbage onto the free list.
+ */
+static void build_heap(uint32_t size, int garbage_percent)
+{
+  context->memsize = 2;
+  live = NIL;
+  Node * last = NIL;
+
+  for (uint32_t i=0; context->memsize < 2 + size; i++)
+  {
+    uint32_t n = 1 << (i % 4);
+    if (context->memsize + n > 2 + size) n = 2 + size - context->memsize;
+
+    Node * block = &memory[context->memsize];
+    init_node(block, TYPE_INT, i, false);
+    if (n > 1) init_node(block, TYPE_CHAR, (n - 1) * sizeof(Node), true);
+    context->memsize += n;
+
+    // Bresenham style, so that the garbage is spread evenly
+    bool garbage = (i + 1) * garbage_percent / 100 > i * garbage_percent / 100;
+    if (garbage) continue;
+
+    block->element = false;
+    if (live == NIL) live = block;
+    else last->next = index(block);
+    last = block;
+  }
+
+  list = NIL;
+  for (int i=0; i<8; i++)
+  {
+    Node * node = init_node(&memory[context->memsize++], TYPE_INT, i, false);
+    node->element = false;
+    node->next = index(list);
+    list = node;
+  }
+  list = init_node(&memory[context->memsize++], TYPE_NODE, index(list), false);
+
+  context->freelist = NIL;
+  mark_and_sweep();
+}
+
+//
+// Operations: each does 'n' of them, and returns how many it did in time
+//
+
+typedef long (* Batch)(long n);
+
+// Run 'n' operations in steps, until the batch is out of time
+#define TIMED_LOOP(n, step) \
+  double deadline = now() + MAX_BATCH; \
+  long done = 0; \
+  while (done < (n)) \
+  { \
+    for (int j=0; j<64 && done < (n); j++, done++) { step; } \
+    if (now() > deadline) break; \
+  } \
+  return done;
+
+static long batch_new_node(long n)
+{
+  TIMED_LOOP(n, new_node(TYPE_INT, j))
+}
+
+static long batch_new_array_node(long n)
+{
+  TIMED_LOOP(n, new_array_node(TYPE_CHAR, 3 * sizeof(Node)))
+}
+
+static long batch_retrofit(long n)
+{
+  TIMED_LOOP(n, retrofit(init_node(allocate_nodes(4), TYPE_CHAR, 3 * sizeof(Node), true)))
+}
+
+static long batch_copy(long n)
+{
+  TIMED_LOOP(n, copy(list, -1))
+}
+
+static long batch_mark_sweep(long n)
+{
+  mark_and_sweep();
+  return 1;
+}
+
+static long batch_unique_string(long n)
+{
+  uint32_t state = 1;
+  TIMED_LOOP(n, unique_string(make_char_array_node(names[next_random(&state) % num_names])))
+}
+
+static long batch_lookup(long n)
+{
+  uint32_t state = 1;
+  Node name = { 0 };
+  TIMED_LOOP(n, name.value.u32 = 100 + next_random(&state) % num_names; lookup_internal(env, &name))
+}
+
+//
+// Set-ups for the operations that do not work on heaps
+//
+
+static void intern_strings(uint32_t count)
+{
+  if (names != NULL && context->num_strings == count) return;
+
+  context->memsize = 2;
+  context->freelist = NIL;
+  context->unique_strings = NIL;
+  context->num_strings = 0;
+  free(context->string_index);
+  context->string_index = NULL;
+  context->string_index_size = 0;
+
+  free(names);
+  names = malloc(sizeof(*names) * count);
+  num_names = count;
+  for (uint32_t i=0; i<count; i++)
+  {
+    snprintf(names[i], sizeof(names[i]), "name-%u", i);
+    unique_chars(names[i], strlen(names[i]));
+  }
+}
+
+// An environment of 'size' variables, as 'define' makes them
+static void make_env(uint32_t size)
+{
+  context->memsize = 2;
+  context->freelist = NIL;
+  num_names = size;
+
+  env = NIL;
+  for (uint32_t i=0; i<size; i++)
+  {
+    Node * var = new_node(TYPE_ID, 100 + i);
+    Node * entry = new_node(TYPE_NODE, index(var));
+    entry->next = index(env);
+    env = entry;
+  }
+}
+
+//
+// Measuring and reporting
+//
+
+static int repetitions = DEFAULT_REPETITIONS;
+static const char * filter = NULL;
+static bool first_result = true;
+
+typedef void (* Setup)(uint32_t size, int garbage_percent);
+
+static void setup_heap(uint32_t size, int garbage_percent) { build_heap(size, garbage_percent); }
+static void setup_strings(uint32_t size, int garbage_percent) { intern_strings(size); }
+static void setup_env(uint32_t size, int garbage_percent) { make_env(size); }
+
+static double percentile(double * sorted, int n, int p)
+{
+  return sorted[(n - 1) * p / 100];
+}
+
+static void measure(const char * name, const char * size_name, uint32_t size, int garbage_percent,
+  Setup setup, Batch batch, long ops)
+{
+  if (filter != NULL && strstr(name, filter) == NULL) return;
+
+  double samples[repetitions];
+  long done = 0;
+  for (int r=-WARMUP; r<repetitions; r++)
+  {
+    setup(size, garbage_percent);
+    double start = now();
+    done = batch(ops);
+    double ns = (now() - start) * 1e9 / done;
+    if (r >= 0) samples[r] = ns;
+  }
+
+  double sum = 0;
+  for (int r=0; r<repetitions; r++) sum += samples[r];
+  qsort(samples, repetitions, sizeof(double), compare_doubles);
+
+  printf("%s\n  {\"bench\": \"%s\", \"%s\": %u, ", first_result ? "" : ",", name, size_name, size);
+  if (garbage_percent >= 0) printf("\"garbage_percent\": %d, ", garbage_percent);
+  printf("\"ops\": %ld, \"ns_per_op\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"mean\": %.1f}}",
+    done, samples[0], percentile(samples, repetitions, 50), percentile(samples, repetitions, 90),
+    percentile(samples, repetitions, 99), sum / repetitions);
+  fflush(stdout);
+  first_result = false;
+}
+
+int main(int argc, char ** argv)
+{
+  if (argc > 1)
+  {
+    char * end;
+    long n = strtol(argv[1], &end, 10);
+    if (end == argv[1] || *end != '\0' || n < 1 || n > INT_MAX)
+    {
+      printf("Usage: %s [repetitions] [name]\n", argv[0]);
+      return 1;
+    }
+    repetitions = n;
+  }
+  if (argc > 2) filter = argv[2];
+
+  use_context(new_context());
+
+  printf("{\"warmup\": %d, \"repetitions\": %d, \"results\": [", WARMUP, repetitions);
+  for (int h=0; h<COUNT(heap_sizes); h++)
+    for (int g=0; g<COUNT(garbage_percents); g++)
+    {
+      uint32_t size = heap_sizes[h];
+      int garbage = garbage_percents[g];
+      measure("new_node", "heap", size, garbage, setup_heap, batch_new_node, OPS);
+      measure("new_array_node", "heap", size, garbage, setup_heap, batch_new_array_node, OPS);
+      measure("retrofit", "heap", size, garbage, setup_heap, batch_retrofit, OPS);
+      measure("copy", "heap", size, garbage, setup_heap, batch_copy, OPS);
+      measure("mark_sweep", "heap", size, garbage, setup_heap, batch_mark_sweep, 1);
+    }
+
+  for (int s=0; s<COUNT(string_counts); s++)
+    measure("unique_string", "strings", string_counts[s], -1, setup_strings, batch_unique_string, OPS);
+
+  for (int e=0; e<COUNT(env_sizes); e++)
+    measure("lookup_internal", "env_size", env_sizes[e], -1, setup_env, batch_lookup, OPS);
+
+  printf("\n]}\n");
+  return 0;
+}
@@ -0,0 +1,18 @@
+;; Count the solutions to the 8 queens problem, building lists on the way
+(define (iota n) (if (= n 0) '() (append (iota (- n 1)) (list n))))
+
+(define (safe? col placed dist)
+  (if (= placed '()) 1
+    (if (= (car placed) col) 0
+      (if (= (car placed) (+ col dist)) 0
+        (if (= (car placed) (- col dist)) 0
+          (safe? col (cdr placed) (+ dist 1)))))))
+
+(define (queens board n rows)
+  (if (= rows 0) 1
+    (fold-left + 0
+      (map (lambda (col)
+             (if (= (safe? col board 1) 1) (queens (cons col board) n (- rows 1)) 0))
+           (iota n)))))
+
+(queens '() 8 8)
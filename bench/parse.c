@@ -0,0 +1,90 @@
+/**
+ * Reader throughput benchmark.
+ *
+ *   unpair-parsebench [file.lisp]
+ *
+ * Parses all forms in the given file (or in a generated S-expression data
+ * file of some 32MB) a few times, and reports the best throughput in MB/s.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../node.h"
+#include "../memory.h"
+#include "../parse.h"
+#include "../gc.h"
+
+#define RUNS 5
+#define GENERATED_SIZE (32 * 1024 * 1024)
+#define FORMS_PER_GC 1000
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void generate(const char * path)
+{
+  static const char * tags[] = { "alpha", "beta", "gamma", "delta", "epsilon" };
+
+  FILE * out = fopen(path, "w");
+  long size = 0;
+  for (int i=0; size < GENERATED_SIZE; i++)
+  {
+    size += fprintf(out, "(record %d \"name-%d\" (tags %s %s) (point %d %d) (nested (1 2 (3 4 (5)))) . %d)\n",
+      i, i % 1000, tags[i % 5], tags[(i / 5) % 5], i * 7 - 1000000, -i, i % 13);
+    if (i % 100 == 0) size += fprintf(out, "; comment line %d\n", i);
+  }
+  fclose(out);
+}
+
+int main(int argc, char ** argv)
+{
+  const char * path = argc > 1 ? argv[1] : "/tmp/unpair-parsebench.lisp";
+  if (argc <= 1) generate(path);
+
+  struct stat st;
+  if (stat(path, &st) != 0)
+  {
+    printf("Cannot open %s\n", path);
+    return 1;
+  }
+
+  use_context(new_context());
+
+  double best = 0;
+  long forms = 0;
+  for (int run=0; run<RUNS; run++)
+  {
+    FILE * file = fopen(path, "r");
+    set_infile(file);
+
+    double elapsed = 0;
+    double start = now();
+    forms = 0;
+    while (parse() != NULL)
+    {
+      if (++forms % FORMS_PER_GC == 0)
+      {
+        elapsed += now() - start;
+        collect_garbage();
+        start = now();
+      }
+    }
+    elapsed += now() - start;
+    collect_garbage();
+    fclose(file);
+
+    double mbs = st.st_size / elapsed / (1024 * 1024);
+    if (mbs > best) best = mbs;
+  }
+
+  printf("{\"file\": \"%s\", \"bytes\": %ld, \"forms\": %ld, \"best_mb_per_s\": %.1f}\n", path, (long) st.st_size, forms, best);
+  return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * pmap scaling benchmark.
+ *
+ *   unpair-pmapbench [items] [n]
+ *
+ * Times (map fib xs) and (pmap fib xs) for 'items' times (fib n), with
+ * 1, 2, 4 and 8 threads taking part, checks that the results agree, and
+ * reports the times and speedups over 'map' as JSON.
+ * The pool has 8 threads unless UNPAIR_THREADS says otherwise.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../node.h"
+#include "../memory.h"
+#include "../parse.h"
+#include "../transform.h"
+#include "../eval.h"
+#include "../print.h"
+#include "../gc.h"
+#include "../primitive.h"
+#include "../load.h"
+#include "../pmap.h"
+
+#define DEFAULT_ITEMS 64
+#define DEFAULT_N 18
+#define RUNS 3
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+#define NUM_THREAD_COUNTS (sizeof(thread_counts) / sizeof(thread_counts[0]))
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Evaluate all forms in 'code'; returns the printed result of the last one
+static char * run(const char * code)
+{
+  Output out = { NULL, 0, 0, NULL };
+  set_instring(code, strlen(code));
+
+  Node * node;
+  while ((node = parse()) != NULL)
+  {
+    node = transform(node, &context->environment, context->environment);
+    if (node == NULL) continue;
+    if (!node->special) node = eval(node, context->environment);
+
+    out.len = 0;
+    write_node(&out, node);
+  }
+  output_chars(&out, "", 1);
+
+  collect_garbage();
+  return out.data;
+}
+
+// Best time of a few runs of 'code'; its result goes into 'result'
+static double best_time(const char * code, char ** result)
+{
+  double best = 0;
+  for (int run_nr=0; run_nr<RUNS; run_nr++)
+  {
+    double start = now();
+    char * out = run(code);
+    double elapsed = now() - start;
+
+    if (run_nr == 0) *result = out;
+    else free(out);
+    if (run_nr == 0 || elapsed < best) best = elapsed;
+  }
+  return best;
+}
+
+int main(int argc, char ** argv)
+{
+  int items = argc > 1 ? atoi(argv[1]) : DEFAULT_ITEMS;
+  int n = argc > 2 ? atoi(argv[2]) : DEFAULT_N;
+
+  setenv("UNPAIR_THREADS", "8", 0);
+
+  use_context(new_context());
+  init_primitives();
+  load_file("lib.lisp");
+
+  char setup[256];
+  snprintf(setup, sizeof(setup),
+    "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))\n"
+    "(define (iota n acc) (if (= n 0) acc (iota (- n 1) (cons %d acc))))\n"
+    "(define xs (iota %d '()))\n", n, items);
+  free(run(setup));
+
+  char * expected;
+  double map_time = best_time("(map fib xs)", &expected);
+
+  printf("{\"items\": %d, \"n\": %d, \"workers\": %d, \"map_seconds\": %.3f, \"pmap\": [",
+    items, n, pmap_workers(), map_time);
+
+  bool ok = true;
+  for (int i=0; i<NUM_THREAD_COUNTS; i++)
+  {
+    pmap_set_threads(thread_counts[i]);
+
+    char * result;
+    double time = best_time("(pmap fib xs)", &result);
+    if (strcmp(result, expected) != 0) ok = false;
+    free(result);
+
+    printf("%s{\"threads\": %d, \"seconds\": %.3f, \"speedup\": %.2f}",
+      i == 0 ? "" : ", ", thread_counts[i], time, map_time / time);
+  }
+  printf("], \"ok\": %s}\n", ok ? "true" : "false");
+
+  free(expected);
+  return ok ? 0 : 1;
+}
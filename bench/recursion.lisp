@@ -0,0 +1,6 @@
+;; Deep, non-tail recursion, 20000 calls deep
+(define (count-up n) (if (= n 0) 0 (+ 1 (count-up (- n 1)))))
+(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))
+(define (repeat k f result) (if (= k 0) result (repeat (- k 1) f (f))))
+(repeat 20 (lambda () (count-up 20000)) 0)
+(repeat 20 (lambda () (length (build 20000))) 0)
@@ -0,0 +1,184 @@
+/**
+ * REPL server latency benchmark.
+ *
+ *   unpair-servebench [requests]
+ *
+ * Starts './unpair --serve' and times round trips of a small request
+ * (200 by default): over one connection, over a new connection each,
+ * and through a './unpair --connect' client process each. For
+ * comparison, it times cold runs of './unpair' that get the same
+ * request on stdin. Reports milliseconds as JSON.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define DEFAULT_REQUESTS 200
+#define COLD_RUNS 20
+#define SOCKET_PATH "/tmp/unpair-servebench.sock"
+
+static const char request[] = "(define square (lambda (x) (* x x))) (square 12)";
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double mean(double * ms, int n)
+{
+  double sum = 0;
+  for (int i=0; i<n; i++) sum += ms[i];
+  return sum / n;
+}
+
+static int connect_server()
+{
+  struct sockaddr_un address = { AF_UNIX, SOCKET_PATH };
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) return fd;
+  close(fd);
+  return -1;
+}
+
+static bool round_trip(int fd)
+{
+  char frame[4 + sizeof(request)];
+  uint32_t len = htonl(sizeof(request) - 1);
+  memcpy(frame, &len, 4);
+  memcpy(frame + 4, request, sizeof(request) - 1);
+  if (write(fd, frame, 4 + sizeof(request) - 1) != 4 + sizeof(request) - 1) return false;
+
+  if (read(fd, &len, 4) != 4) return false;
+  len = ntohl(len);
+  char response[len + 1];
+  for (uint32_t got = 0; got < len; )
+  {
+    ssize_t n = read(fd, response + got, len - got);
+    if (n <= 0) return false;
+    got += n;
+  }
+  response[len] = 0;
+  return strstr(response, "144") != NULL;
+}
+
+// Run './unpair' with the given args on the request, and wait for it
+static bool run_process(char * const args[])
+{
+  int in[2];
+  if (pipe(in) != 0) return false;
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    dup2(in[0], STDIN_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(in[0]);
+    close(in[1]);
+    execv("./unpair", args);
+    _exit(127);
+  }
+  close(in[0]);
+  bool ok = write(in[1], request, sizeof(request) - 1) == sizeof(request) - 1;
+  close(in[1]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char ** argv)
+{
+  int requests = argc > 1 ? atoi(argv[1]) : DEFAULT_REQUESTS;
+  if (requests < 1) requests = 1;
+
+  pid_t server = fork();
+  if (server == 0)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    execl("./unpair", "unpair", "--serve", SOCKET_PATH, (char *) NULL);
+    _exit(127);
+  }
+
+  int fd = -1;
+  for (int i=0; i<500 && fd < 0; i++)
+  {
+    usleep(10000);
+    fd = connect_server();
+  }
+  if (fd < 0)
+  {
+    printf("Cannot connect to './unpair --serve'\n");
+    kill(server, SIGTERM);
+    return 1;
+  }
+
+  double warm[requests];
+  int failures = 0;
+  for (int i=0; i<requests; i++)
+  {
+    double start = now();
+    if (!round_trip(fd)) failures++;
+    warm[i] = (now() - start) * 1000;
+  }
+  close(fd);
+
+  double connecting[requests];
+  for (int i=0; i<requests; i++)
+  {
+    double start = now();
+    fd = connect_server();
+    if (fd < 0 || !round_trip(fd)) failures++;
+    close(fd);
+    connecting[i] = (now() - start) * 1000;
+  }
+
+  char * client_args[] = { "unpair", "--connect", SOCKET_PATH, NULL };
+  double client[requests];
+  for (int i=0; i<requests; i++)
+  {
+    double start = now();
+    if (!run_process(client_args)) failures++;
+    client[i] = (now() - start) * 1000;
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  unlink(SOCKET_PATH);
+
+  char * cold_args[] = { "unpair", NULL };
+  double cold[COLD_RUNS];
+  for (int i=0; i<COLD_RUNS; i++)
+  {
+    double start = now();
+    if (!run_process(cold_args)) failures++;
+    cold[i] = (now() - start) * 1000;
+  }
+
+  qsort(warm, requests, sizeof(double), compare_doubles);
+  printf("{\"requests\": %d, \"warm_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f}, ",
+    requests, mean(warm, requests), warm[requests / 2], warm[requests * 99 / 100]);
+  printf("\"connect_ms\": %.3f, \"client_process_ms\": %.3f, \"cold_runs\": %d, \"cold_ms\": %.3f, ",
+    mean(connecting, requests), mean(client, requests), COLD_RUNS, mean(cold, COLD_RUNS));
+  printf("\"speedup\": %.1f, \"failures\": %d}\n", mean(cold, COLD_RUNS) / mean(warm, requests), failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+/**
+ * Interpreter context stress test.
+ *
+ *   unpair-stress [threads] [rounds]
+ *
+ * Runs a mixed workload in many independent interpreters at once, each
+ * thread making a fresh context for every round, and checks that every
+ * round gives the same results as a single interpreter did up front.
+ * Exits non-zero on any difference.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../node.h"
+#include "../memory.h"
+#include "../parse.h"
+#include "../transform.h"
+#include "../eval.h"
+#include "../print.h"
+#include "../gc.h"
+#include "../primitive.h"
+#include "../load.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_ROUNDS 20
+
+static const char * script =
+  "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))\n"
+  "(fib 15)\n"
+  "(touch (future (fib 12)))\n"
+  "(define (iota n acc) (if (= n 0) acc (iota (- n 1) (cons n acc))))\n"
+  "(define xs (iota 500 '()))\n"
+  "(fold-left + 0 (map (lambda (x) (* x x)) xs))\n"
+  "(sort (list 5 3 9 1 7 \"x\") <)\n"
+  "(define h (make-hash-table))\n"
+  "(for-each (lambda (x) (hash-set! h x (* x 2))) xs)\n"
+  "(hash-ref h 250)\n"
+  "(hash-count h)\n"
+  "(deserialize (serialize (list \"a\" 'b (list 1 2) (cons 3 4))))\n"
+  "(write-to-string (reverse xs))\n";
+
+static char * expected;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run the script in a fresh context; returns its results, one per line
+static char * run_script()
+{
+  Context * ctx = new_context();
+  use_context(ctx);
+  init_primitives();
+  load_file("lib.lisp");
+
+  Output out = { NULL, 0, 0, NULL };
+  set_instring(script, strlen(script));
+
+  Node * node;
+  while ((node = parse()) != NULL)
+  {
+    node = transform(node, &context->environment, context->environment);
+    if (node == NULL) continue;
+    if (!node->special) node = eval(node, context->environment);
+
+    write_node(&out, node);
+    output_chars(&out, "\n", 1);
+    collect_garbage();
+  }
+  output_chars(&out, "", 1);
+
+  free_context(ctx);
+  return out.data;
+}
+
+static void * worker(void * arg)
+{
+  int rounds = *(int *) arg;
+  intptr_t failures = 0;
+  for (int i=0; i<rounds; i++)
+  {
+    char * result = run_script();
+    if (strcmp(result, expected) != 0) failures++;
+    free(result);
+  }
+  return (void *) failures;
+}
+
+int main(int argc, char ** argv)
+{
+  int num_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+
+  expected = run_script();
+
+  pthread_t threads[num_threads];
+  double start = now();
+  for (int i=0; i<num_threads; i++)
+    pthread_create(&threads[i], NULL, worker, &rounds);
+
+  intptr_t failures = 0;
+  for (int i=0; i<num_threads; i++)
+  {
+    void * result;
+    pthread_join(threads[i], &result);
+    failures += (intptr_t) result;
+  }
+  double elapsed = now() - start;
+
+  printf("{\"threads\": %d, \"rounds\": %d, \"failures\": %ld, \"seconds\": %.3f}\n",
+    num_threads, rounds, (long) failures, elapsed);
+  if (failures != 0 || getenv("UNPAIR_STRESS_VERBOSE") != NULL) printf("Expected:\n%s", expected);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+;; String interning: many distinct and many repeated strings
+(define (integers-from n) (stream-cons n (integers-from (+ n 1))))
+(define xs (stream->list (stream-take 10000 (integers-from 0))))
+(length (map write-to-string xs))
+(length (map (lambda (x) (write-to-string (% x 100))) xs))
+(define h (make-hash-table))
+(for-each (lambda (x) (hash-set! h (write-to-string (list 'key (% x 5000))) x)) xs)
+(hash-count h)
+(hash-ref h (write-to-string (list 'key 42)))
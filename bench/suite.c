@@ -0,0 +1,195 @@
+/**
+ * Lisp benchmark suite.
+ *
+ *   unpair-benchsuite [--runs N] [--out FILE] file.lisp...
+ *
+ * Runs every file N times (5 by default), each time in a fresh context
+ * with lib.lisp loaded, evaluating its forms as the REPL does: with a
+ * garbage collection after each one. Reports, per file, the wall time
+ * of the runs, and from the last run the nodes allocated, the peak heap
+ * size in nodes, the number of full and young collections, and the
+ * start of the last result. The JSON goes to stdout, and to FILE too.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../node.h"
+#include "../memory.h"
+#include "../parse.h"
+#include "../transform.h"
+#include "../eval.h"
+#include "../print.h"
+#include "../gc.h"
+#include "../primitive.h"
+#include "../load.h"
+
+#define DEFAULT_RUNS 5
+#define MAX_RESULT 60
+
+typedef struct Result {
+  uint64_t nodes_allocated;
+  uintptr_t peak_memsize;
+  uint64_t collections;
+  uint64_t young_collections;
+  Output last; // the last result, printed
+} Result;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Run the file in a fresh context; returns the seconds taken, or -1
+static double run_file(const char * path, Result * result)
+{
+  FILE * file = fopen(path, "r");
+  if (file == NULL) return -1;
+
+  Context * ctx = new_context();
+  use_context(ctx);
+  init_primitives();
+  load_file("lib.lisp");
+  collect_garbage();
+
+  context->nodes_allocated = 0;
+  context->peak_memsize = context->memsize;
+  context->collections = context->young_collections = 0;
+
+  Node * node;
+  double seconds = 0;
+  set_infile(file);
+  double start = now();
+  while ((node = parse()) != NULL)
+  {
+    node = transform(node, &context->environment, context->environment);
+    if (node == NULL) continue;
+    if (!node->special) node = eval(node, context->environment);
+
+    // Print the result before the GC, as the REPL does, but off the clock
+    seconds += now() - start;
+    result->last.len = 0;
+    write_node(&result->last, node);
+    start = now();
+
+    collect_garbage();
+  }
+  seconds += now() - start;
+  fclose(file);
+
+  result->nodes_allocated = context->nodes_allocated;
+  result->peak_memsize = context->peak_memsize;
+  result->collections = context->collections;
+  result->young_collections = context->young_collections;
+
+  free_context(ctx);
+  return seconds;
+}
+
+// The file name, without directory and extension
+static void output_name(Output * out, const char * path)
+{
+  const char * name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+  const char * end = strrchr(name, '.');
+  output_chars(out, name, end != NULL ? end - name : strlen(name));
+}
+
+static void output_json_string(Output * out, const char * chars, size_t len)
+{
+  output_chars(out, "\"", 1);
+  for (size_t i=0; i<len; i++)
+  {
+    char ch = chars[i];
+    if (ch == '"' || ch == '\\') output_chars(out, "\\", 1);
+    if ((unsigned char) ch < ' ') ch = ' ';
+    output_chars(out, &ch, 1);
+  }
+  output_chars(out, "\"", 1);
+}
+
+static void output_format(Output * out, const char * format, double value)
+{
+  char buffer[64];
+  output_chars(out, buffer, snprintf(buffer, sizeof(buffer), format, value));
+}
+
+int main(int argc, char ** argv)
+{
+  int runs = DEFAULT_RUNS;
+  const char * out_path = NULL;
+  int first = 1;
+  for (; first < argc - 1 && argv[first][0] == '-'; first += 2)
+  {
+    if (strcmp(argv[first], "--runs") == 0) runs = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "--out") == 0) out_path = argv[first + 1];
+    else break;
+  }
+  if (runs < 1) runs = 1;
+  if (first >= argc)
+  {
+    printf("Usage: %s [--runs N] [--out FILE] file.lisp...\n", argv[0]);
+    return 1;
+  }
+
+  Output json = { NULL, 0, 0, NULL };
+  output_format(&json, "{\"runs\": %.0f, \"benchmarks\": [", runs);
+
+  bool ok = true;
+  for (int i=first; i<argc; i++)
+  {
+    Result result = { 0 };
+    double seconds[runs];
+    for (int run=0; run<runs && ok; run++)
+      if ((seconds[run] = run_file(argv[i], &result)) < 0)
+      {
+        fprintf(stderr, "Cannot open %s\n", argv[i]);
+        ok = false;
+      }
+    if (!ok) break;
+
+    double sum = 0;
+    for (int run=0; run<runs; run++) sum += seconds[run];
+    qsort(seconds, runs, sizeof(double), compare_doubles);
+
+    output_chars(&json, i > first ? ",\n  " : "\n  ", i > first ? 4 : 3);
+    output_chars(&json, "{\"name\": \"", 10);
+    output_name(&json, argv[i]);
+    output_format(&json, "\", \"seconds\": {\"min\": %.4f, ", seconds[0]);
+    output_format(&json, "\"median\": %.4f, ", seconds[runs / 2]);
+    output_format(&json, "\"mean\": %.4f}, ", sum / runs);
+    output_format(&json, "\"nodes_allocated\": %.0f, ", result.nodes_allocated);
+    output_format(&json, "\"peak_memsize\": %.0f, ", result.peak_memsize);
+    output_format(&json, "\"collections\": %.0f, ", result.collections);
+    output_format(&json, "\"young_collections\": %.0f, \"result\": ", result.young_collections);
+    output_json_string(&json, result.last.data, result.last.len < MAX_RESULT ? result.last.len : MAX_RESULT);
+    output_chars(&json, "}", 1);
+    free(result.last.data);
+  }
+  output_chars(&json, "\n]}\n", 4);
+
+  fwrite(json.data, 1, json.len, stdout);
+  if (out_path != NULL)
+  {
+    FILE * out = fopen(out_path, "w");
+    if (out == NULL || fwrite(json.data, 1, json.len, out) != json.len)
+    {
+      fprintf(stderr, "Cannot write %s\n", out_path);
+      ok = false;
+    }
+    if (out != NULL) fclose(out);
+  }
+  free(json.data);
+  return ok ? 0 : 1;
+}
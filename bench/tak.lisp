@@ -0,0 +1,6 @@
+;; Takeuchi function: deep call trees over three arguments
+(define (tak x y z)
+  (if (< y x)
+    (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))
+    z))
+(tak 21 14 7)
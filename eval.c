@@ -10,12 +10,22 @@
 #include "primitive.h"
 #include "print.h"
 #include "transform.h"
+#include "stats.h"
+#include "profile.h"
+#include "region.h"
 
 Node * eval_and_chain(Node * args, Node * env)
 {
   if (args == NIL) return NIL;
   // Here we make the exception to not automatically eval a block argument
-  Node * result = args->special ? copy(args, 0) : eval(args, env);
+  Node * result;
+  if (args->special)
+  {
+    begin_alloc_site(SITE_EVAL_AND_CHAIN);
+    result = copy(args, 0);
+    end_alloc_site();
+  }
+  else result = eval(args, env);
   result->element = false;
   result->next = index(eval_and_chain(&memory[args->next], env));
   return result;
@@ -24,6 +34,7 @@ Node * eval_and_chain(Node * args, Node * env)
 Node * instantiate_template(Node * template_env, Node * closure_env)
 {
   if (template_env == NIL) return closure_env;
+  begin_alloc_site(SITE_TEMPLATE);
 
   Node * instance = copy(template_env, -1); // recursive copy
   Node * iter = instance;
@@ -40,15 +51,34 @@ Node * instantiate_template(Node * template_env, Node * closure_env)
 //print(instance);
 //print(closure_env);
 
+  end_alloc_site();
   return instance;
 }
 
+static inline void count_call(uint64_t * calls)
+{
+  if (__atomic_load_n(&context->sharing, __ATOMIC_ACQUIRE) != 0) __atomic_fetch_add(calls, 1, __ATOMIC_RELAXED);
+  else (*calls)++;
+}
+
 // lambda = ((env_template) (existing_env) (arglist) (body))
 Node * run_lambda(Node * caller_env, Node * expr, Node * args, bool eval_args)
 {
   Node * lambda = pointer(expr->value.u32);
   Node * env_node = pointer(lambda->next);
 
+  // A local lambda makes its env and all else past the region mark,
+  // once its args are evaluated in the caller's env
+  Region region;
+  bool local = false;
+  if (lambda->special)
+  {
+    if (eval_args) args = eval_and_chain(args, caller_env);
+    eval_args = false;
+    local = open_region(&region);
+  }
+  else if (open_regions > 0) escape_regions();
+
   Node * lambda_env = instantiate_template(pointer(lambda->value.u32), pointer(env_node->value.u32));
   //print(lambda_env);
 
@@ -78,21 +108,59 @@ Node * run_lambda(Node * caller_env, Node * expr, Node * args, bool eval_args)
 
     // TODO this has gone a bit ugly with 'special' added
     if (eval_args) var->next = index(args_as_list ? new_node(TYPE_NODE, index(eval_and_chain(args, caller_env))) : (args->special ? copy(args, 0) : eval(args, caller_env)));
+    else if (local && args->element)
+    {
+      // Not an arg node of our own, but e.g. a pair's tail passed on by 'apply'
+      Node * value = copy(args, 0);
+      value->next = 0;
+      var->next = index(value);
+    }
     else var->next = index(args_as_list ? new_node(TYPE_NODE, index(args)) : element(args));
     argnames = pointer(argnames->next);
     args = pointer(args->next);
   }
 
-  return eval(body, lambda_env);
+  count_call(&context->lambda_calls);
+  if (call_counting) count_lambda_call(index(body));
+  uint32_t caller = alloc_function;
+  alloc_function = index(body);
+  uint32_t depth = profiling ? push_frame(index(body)) : 0;
+  Node * result = eval(body, lambda_env);
+  if (profiling) pop_frame(depth);
+  alloc_function = caller;
+  if (local) result = close_region(&region, result);
+  return result;
 }
 
-Node * run_primitive(Node * env, Node * prim, Node * args)
+// Call a primitive on its (evaluated) args
+static Node * call_primitive(uint32_t num, Node * args, Node * env)
+{
+  Primitive * prim = &primitives[num];
+  if (prim->arity >= 0 && length(args) != prim->arity)
+  {
+    printf("Runtime error: '%s' expects %d args; got %d.\n", prim->name, prim->arity, length(args));
+    return pointer_to(NIL);
+  }
+  count_call(&context->primitive_calls);
+  if (call_counting) count_primitive_call(num);
+  if (open_regions > 0 && !local_primitives[num]) escape_regions();
+  begin_alloc_site(SITE_PRIMITIVE);
+  uint32_t depth = profiling ? push_frame(PRIMITIVE_FRAME(num)) : 0;
+  Node * result = prim->cb(args, &env);
+  if (profiling) pop_frame(depth);
+  end_alloc_site();
+  return result;
+}
+
+Node * run_primitive(Node * env, Node * prim, Node * code)
 {
   // We do not presently add to the env from within primitives,
   // nor is this a particularly good idea - so then perhaps
   // we should not suggest it by passing the env as a double
   // pointer, as we still do here.
-  return jmptable[prim->value.u32](eval_and_chain(args, env), &env);
+  Node * args = eval_and_chain(pointer(code->next), env);
+  if (call_counting) primitive_site = index(code);
+  return call_primitive(prim->value.u32, args, env);
 }
 
 Node * run_integer(Node * env, Node * func, Node * args)
@@ -137,13 +205,38 @@ Node * apply(Node * funcexpr, Node * env)
     case TYPE_FUNC:
       return run_lambda(env, func, args, true);
     case TYPE_PRIMITIVE:
-      return run_primitive(env, func, args);
+      return run_primitive(env, func, funcexpr);
     default:
       printf("Runtime error: can't execute type '%s'.\n", types[func->type]);
       return funcexpr;
   }
 }
 
+// Apply a function value to args that are already evaluated
+Node * apply_values(Node * func, Node * args, Node * env)
+{
+  // Same double step as in 'apply', for the lambda-calculus style booleans
+  if (func->type == TYPE_NODE) func = pointer(func->value.u32);
+
+  switch(func->type)
+  {
+    case TYPE_INT:
+    {
+      Node * list = pointer(args->value.u32);
+      for (int i=1; i<func->value.i32; i++)
+        list = pointer(list->next);
+      return element(list);
+    }
+    case TYPE_FUNC:
+      return run_lambda(env, func, args, false);
+    case TYPE_PRIMITIVE:
+      return call_primitive(func->value.u32, args, env);
+    default:
+      printf("Runtime error: can't execute type '%s'.\n", types[func->type]);
+      return pointer_to(NIL);
+  }
+}
+
 // Evaluate a single node, ignoring that it may be inside a list -
 // but always returning the result as an element
 Node * eval(Node * expr, Node * env)
@@ -14,3 +14,9 @@ Node * apply(Node * funcexpr, Node * env);
 
 Node * run_lambda(Node * env, Node * expr, Node * args, bool eval_args);
 
+/**
+ * Apply an already evaluated function value to a chain of already
+ * evaluated args, e.g. from within a primitive such as 'map'.
+ */
+Node * apply_values(Node * func, Node * args, Node * env);
+
@@ -0,0 +1,355 @@
+/**
+ * Futures, run by a work-stealing scheduler.
+ *
+ * Every worker thread has its own deque of tasks. A worker pushes the
+ * futures it spawns onto the bottom of its own deque and takes its next
+ * task from there as well (so that divide and conquer code runs depth
+ * first), while idle threads steal from the top of the other deques.
+ * Threads outside the pool push onto a deque of their own that all
+ * workers steal from.
+ *
+ * A task may sit in a deque after it has already been run by a thread
+ * touching it; whoever takes it from the deque then just drops it. The
+ * state is what decides, not the deque. The GC only frees tasks that
+ * have left the deques; once a context's futures are freed, those still
+ * in a deque are freed by whoever takes them from there.
+ *
+ * Futures run in the context that spawned them, which is shared, as for
+ * 'pmap', while any of its futures are outstanding.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "node.h"
+#include "memory.h"
+#include "eval.h"
+#include "gc.h"
+#include "pmap.h"
+#include "future.h"
+
+typedef enum State { QUEUED, RUNNING, DONE } State;
+
+typedef struct Task {
+  Context * context;
+  Node * expr;
+  Node * env;
+  Node * result;
+  State state;
+  int holders;  // the futures table, and the deque while in it
+  bool reached; // by the GC
+} Task;
+
+// A context's futures; future nodes hold an index into 'tasks'
+typedef struct Futures {
+  pthread_mutex_t lock;
+  Task ** tasks;
+  uint32_t num_tasks;
+  uint32_t size;
+  uint32_t * free_ids;
+  uint32_t num_free;
+  int pending; // tasks not yet done
+} Futures;
+
+typedef struct Deque {
+  pthread_mutex_t lock;
+  Task ** tasks;
+  uint32_t top;    // where thieves take from
+  uint32_t bottom; // where the owner pushes and takes
+  uint32_t size;   // a power of two
+} Deque;
+
+#define INITIAL_DEQUE_SIZE 64
+
+// deques[0] is for threads outside the pool
+static Deque * deques;
+static int num_deques;
+static __thread Deque * own_deque;
+static __thread int steal_from;
+
+static pthread_once_t pool_started = PTHREAD_ONCE_INIT;
+
+// Tasks in all deques, including ones that were already run
+static int queued;
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static int sleepers;
+
+static void push(Deque * deque, Task * task)
+{
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom - deque->top == deque->size)
+  {
+    Task ** tasks = malloc(sizeof(Task *) * deque->size * 2);
+    for (uint32_t i=deque->top; i!=deque->bottom; i++)
+      tasks[i & (deque->size * 2 - 1)] = deque->tasks[i & (deque->size - 1)];
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->size *= 2;
+  }
+  deque->tasks[deque->bottom++ & (deque->size - 1)] = task;
+  pthread_mutex_unlock(&deque->lock);
+
+  __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0)
+  {
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&work_available);
+    pthread_mutex_unlock(&idle_lock);
+  }
+}
+
+static bool claim(Task * task)
+{
+  State expected = QUEUED;
+  return __atomic_compare_exchange_n(&task->state, &expected, RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take a task to run from the bottom (the owner's end) or the top
+ * (a thief's end) of the deque, dropping tasks that already ran.
+ */
+static Task * take(Deque * deque, bool bottom)
+{
+  Task * task = NULL;
+  pthread_mutex_lock(&deque->lock);
+  while (task == NULL && deque->bottom != deque->top)
+  {
+    if (bottom) task = deque->tasks[--deque->bottom & (deque->size - 1)];
+    else task = deque->tasks[deque->top++ & (deque->size - 1)];
+    __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+
+    bool claimed = claim(task);
+    // From here on, a task that we did not claim may be freed
+    bool last = __atomic_sub_fetch(&task->holders, 1, __ATOMIC_ACQ_REL) == 0;
+    if (!claimed)
+    {
+      // Its futures were freed while it sat here
+      if (last) free(task);
+      task = NULL;
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+// Find a task to run: from our own deque first, else steal one
+static Task * find_task()
+{
+  Task * task;
+  if (own_deque != NULL && (task = take(own_deque, true)) != NULL) return task;
+
+  for (int i=0; i<num_deques && __atomic_load_n(&queued, __ATOMIC_SEQ_CST) > 0; i++)
+  {
+    Deque * victim = &deques[steal_from];
+    steal_from = (steal_from + 1) % num_deques;
+    if (victim != own_deque && (task = take(victim, false)) != NULL) return task;
+  }
+  return NULL;
+}
+
+static void run_task(Task * task)
+{
+  Context * own = context;
+  Context * ctx = task->context;
+  use_context(ctx);
+
+  // Keep the value to ourselves, as touching it takes a copy
+  Node * result = copy(eval(task->expr, task->env), 0);
+  result->element = false;
+  task->result = result;
+  __atomic_store_n(&task->state, DONE, __ATOMIC_RELEASE);
+
+  // Done with the context; it may be collected or freed from here on
+  __atomic_sub_fetch(&ctx->sharing, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&ctx->futures->pending, 1, __ATOMIC_SEQ_CST);
+
+  if (own != NULL) use_context(own);
+}
+
+// Run other tasks until the awaited one is done,
+// or without one, until all of the context's futures are
+static void help(Task * awaited, Futures * futures)
+{
+  while (awaited != NULL ? __atomic_load_n(&awaited->state, __ATOMIC_ACQUIRE) != DONE
+                         : __atomic_load_n(&futures->pending, __ATOMIC_ACQUIRE) > 0)
+  {
+    Task * task = find_task();
+    if (task != NULL) run_task(task);
+    else sched_yield();
+  }
+}
+
+static void * worker(void * deque)
+{
+  own_deque = deque;
+  steal_from = own_deque - deques;
+
+  while (true)
+  {
+    Task * task = find_task();
+    if (task != NULL)
+    {
+      run_task(task);
+      continue;
+    }
+
+    pthread_mutex_lock(&idle_lock);
+    __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0)
+      pthread_cond_wait(&work_available, &idle_lock);
+    __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_lock);
+  }
+  return NULL;
+}
+
+static void start_pool()
+{
+  num_deques = configured_threads();
+  deques = calloc(num_deques, sizeof(Deque));
+  for (int i=0; i<num_deques; i++)
+  {
+    pthread_mutex_init(&deques[i].lock, NULL);
+    deques[i].size = INITIAL_DEQUE_SIZE;
+    deques[i].tasks = malloc(sizeof(Task *) * INITIAL_DEQUE_SIZE);
+  }
+
+  // The threads outside the pool take the place of one worker
+  for (int i=1; i<num_deques; i++)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker, &deques[i]) != 0) break;
+    pthread_detach(thread);
+  }
+}
+
+static Futures * futures_of(Context * ctx)
+{
+  Futures * futures = __atomic_load_n(&ctx->futures, __ATOMIC_ACQUIRE);
+  if (futures != NULL) return futures;
+
+  futures = calloc(1, sizeof(Futures));
+  pthread_mutex_init(&futures->lock, NULL);
+
+  Futures * expected = NULL;
+  if (__atomic_compare_exchange_n(&ctx->futures, &expected, futures, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return futures;
+
+  // Another thread got there first
+  pthread_mutex_destroy(&futures->lock);
+  free(futures);
+  return expected;
+}
+
+static uint32_t add_task(Futures * futures, Task * task)
+{
+  pthread_mutex_lock(&futures->lock);
+  uint32_t id;
+  if (futures->num_free > 0) id = futures->free_ids[--futures->num_free];
+  else
+  {
+    if (futures->num_tasks == futures->size)
+    {
+      futures->size = futures->size == 0 ? 64 : futures->size * 2;
+      futures->tasks = realloc(futures->tasks, sizeof(Task *) * futures->size);
+      futures->free_ids = realloc(futures->free_ids, sizeof(uint32_t) * futures->size);
+    }
+    id = futures->num_tasks++;
+  }
+  futures->tasks[id] = task;
+  pthread_mutex_unlock(&futures->lock);
+  return id;
+}
+
+static Task * get_task(Futures * futures, Node * future)
+{
+  pthread_mutex_lock(&futures->lock);
+  Task * task = futures->tasks[future->value.u32];
+  pthread_mutex_unlock(&futures->lock);
+  return task;
+}
+
+Node * future(Node * args, Node ** env)
+{
+  pthread_once(&pool_started, start_pool);
+  Futures * futures = futures_of(context);
+
+  Task * task = malloc(sizeof(Task));
+  *task = (Task) { context, args, *env, NULL, QUEUED, 2, false };
+
+  __atomic_add_fetch(&futures->pending, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&context->sharing, 1, __ATOMIC_SEQ_CST);
+
+  Node * result = new_node(TYPE_FUTURE, add_task(futures, task));
+  push(own_deque != NULL ? own_deque : &deques[0], task);
+  return result;
+}
+
+Node * touch(Node * args, Node ** env)
+{
+  if (args->type != TYPE_FUTURE) return element(args);
+
+  Task * task = get_task(context->futures, args);
+  if (claim(task)) run_task(task);
+  else help(task, NULL);
+
+  return element(task->result);
+}
+
+void finish_futures(Context * ctx)
+{
+  if (ctx->futures == NULL) return;
+  help(NULL, ctx->futures);
+
+  // Clear out what already ran, so that the GC may free it
+  Task * task;
+  while ((task = find_task()) != NULL) run_task(task);
+}
+
+int mark_future(Node * future)
+{
+  Task * task = context->futures->tasks[future->value.u32];
+  if (!only_counting()) task->reached = true;
+  return mark(task->result);
+}
+
+void release_futures(Context * ctx)
+{
+  Futures * futures = ctx->futures;
+  if (futures == NULL) return;
+
+  for (uint32_t id=0; id<futures->num_tasks; id++)
+  {
+    Task * task = futures->tasks[id];
+    if (task == NULL) continue;
+
+    if (task->reached) task->reached = false;
+    else if (__atomic_load_n(&task->holders, __ATOMIC_ACQUIRE) == 1)
+    {
+      free(task);
+      futures->tasks[id] = NULL;
+      futures->free_ids[futures->num_free++] = id;
+    }
+  }
+}
+
+void free_futures(Context * ctx)
+{
+  Futures * futures = ctx->futures;
+  if (futures == NULL) return;
+
+  finish_futures(ctx);
+  // Tasks still in a deque are freed by whoever takes them there
+  for (uint32_t id=0; id<futures->num_tasks; id++)
+    if (futures->tasks[id] != NULL && __atomic_sub_fetch(&futures->tasks[id]->holders, 1, __ATOMIC_ACQ_REL) == 0)
+      free(futures->tasks[id]);
+  free(futures->tasks);
+  free(futures->free_ids);
+  pthread_mutex_destroy(&futures->lock);
+  free(futures);
+}
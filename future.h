@@ -0,0 +1,34 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include "node.h"
+#include "memory.h"
+
+/**
+ * (future expr) returns a future, and has expr evaluated by the
+ * scheduler's worker threads, in the present context.
+ * (touch f) returns the future's value once it is there; meanwhile,
+ * the touching thread runs other futures instead of blocking.
+ * Touching anything other than a future just returns it.
+ *
+ * As with 'pmap', expr should be free of side effects. GC waits for
+ * all outstanding futures, so none of them run across top-level forms.
+ */
+Node * future(Node * args, Node ** env);
+Node * touch(Node * args, Node ** env);
+
+/**
+ * Run all of the context's outstanding futures to completion.
+ */
+void finish_futures(Context * ctx);
+
+/**
+ * For the GC: mark the value of a (finished) future, and then drop
+ * the futures that were not marked.
+ */
+int mark_future(Node * future);
+void release_futures(Context * ctx);
+
+void free_futures(Context * ctx);
+
+#endif /* FUTURE_H */
@@ -1,43 +1,156 @@
+#include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "memory.h"
 #include "gc.h"
+#include "hash.h"
+#include "future.h"
+#include "stream.h"
+#include "text.h"
 
-int mark(Node * node)
+// Collect young garbage once at least this many nodes were allocated,
+// or half as many as there were to begin with, if that is more
+#define YOUNG_MIN (256 * 1024)
+
+bool is_pointer(Type type)
 {
-  if(node->mark) return 0; // this should also check for NIL in practice
+  return type == TYPE_ID
+    || type == TYPE_STRING
+    || type == TYPE_NODE
+    || type == TYPE_FUNC
+    || type == TYPE_VAR
+    || type == TYPE_HASH
+    || type == TYPE_PROMISE
+    || type == TYPE_GENERATOR;
+}
 
-  node->mark = true;
+// Mark what the in-line key / value nodes of a hash table point to.
+// The slots themselves are part of the table array, and are not marked.
+static int mark_table(Node * table)
+{
+  int marked = 0;
+  for (uint32_t i=0; i<num_slots(table); i++)
+  {
+    Node * s = slot(table, i);
+    if (s->next != SLOT_USED) continue;
+    if (is_pointer(s[0].type)) marked += mark(&memory[s[0].value.u32]);
+    if (is_pointer(s[1].type)) marked += mark(&memory[s[1].value.u32]);
+  }
+  return marked;
+}
 
-  int marked = 1;
-  if (node->array) marked += num_value_nodes(node);
+// Mark what the node's value points to
+static int mark_value(Node * node)
+{
+  if (node->array && node->type == TYPE_HASH)
+  {
+    // Hash header
+    HashHeader * h = hash_header(node);
+    int marked = mark(&memory[h->table]);
+    if (h->old_table != 0) marked += mark(&memory[h->old_table]);
+    return marked;
+  }
+  if (node->array && node->type == TYPE_TABLE) return mark_table(node);
+  if (node->array && node->type == TYPE_PROMISE) return mark_promise(node);
+  if (node->array && node->type == TYPE_GENERATOR) return mark_generator(node);
+  if (node->array && node->type == TYPE_STRING) return mark_string(node);
+  if (node->type == TYPE_FUTURE) return mark_future(node);
+
+  // These are all variants on
+  // value field node pointers.
+  if (is_pointer(node->type)) return mark(&memory[node->value.u32]);
+  return 0;
+}
+
+static int mark_children(Node * node)
+{
+  int marked = mark_value(node);
+  if (node->next != 0) marked += mark(&memory[node->next]);
+  return marked;
+}
 
-  if (node->type == TYPE_ID
-    || node->type == TYPE_STRING
-    || node->type == TYPE_NODE
-    || node->type == TYPE_FUNC
-    || node->type == TYPE_VAR)
+static int mark_list(Node * node)
+{
+  // Follow 'next' by iteration rather than recursion, as lists may be long
+  int marked = 0;
+  while (!node->mark) // this should also check for NIL in practice
+  {
+    node->mark = true;
+
+    marked++;
+    if (node->array) marked += num_value_nodes(node);
+    marked += mark_value(node);
+
+    if (node->next == 0) break;
+    node = &memory[node->next];
+  }
+  return marked;
+}
+
+// Nodes that mark_later left for the outermost mark to do
+static __thread uint32_t * later;
+static __thread size_t num_later;
+static __thread size_t later_size;
+static __thread bool marking;
+
+void mark_later(Node * node)
+{
+  if (node->mark) return;
+  if (num_later == later_size)
   {
-    // These are all variants on
-    // value field node pointers.
-    marked += mark(&memory[node->value.u32]);
+    later_size = later_size == 0 ? 1024 : later_size * 2;
+    later = realloc(later, later_size * sizeof(uint32_t));
   }
+  later[num_later++] = index(node);
+}
 
-  if (node->next != 0)
-    marked += mark(&memory[node->next]);
+int mark(Node * node)
+{
+  if (marking) return mark_list(node);
 
+  marking = true;
+  int marked = mark_list(node);
+  while (num_later > 0)
+    marked += mark_list(&memory[later[--num_later]]);
+  marking = false;
   return marked;
 }
 
-Node * sweep()
+static __thread bool counting;
+
+int mark_to_count(Node * node)
+{
+  counting = true;
+  int marked = mark(node);
+  counting = false;
+  return marked;
+}
+
+bool only_counting()
+{
+  return counting;
+}
+
+// What the last sweep on this thread put on the free list
+static __thread struct {
+  uintptr_t nodes;
+  uintptr_t blocks;
+  uintptr_t largest;
+} swept;
+
+Node * sweep(uintptr_t from)
 {
   Node * freelist = NIL;
-  int index = 0;
+  swept.nodes = swept.blocks = swept.largest = 0;
+  uintptr_t index = from;
 
   recurse:
 
-  if (index >= memsize) return freelist;
+  if (index >= context->memsize) return freelist;
 
   Node * current = &memory[index];
 
@@ -54,18 +167,318 @@ Node * sweep()
   }
   */
 
+  uintptr_t size = node_size(current);
   if(current->mark)
     current->mark = false; // clear mark
+  else if (freelist != NIL && index(freelist) + node_size(freelist) == index)
+  {
+    // Right after the last free block: grow that instead, so that runs
+    // of garbage come out as single free arrays for new_array_node. It
+    // is made an int array, as what it held before is no longer whole.
+    uintptr_t merged = node_size(freelist) + size;
+    freelist->type = TYPE_INT;
+    freelist->array = true;
+    freelist->value.u32 = (merged - 1) * sizeof(Node);
+
+    swept.nodes += size;
+    if (merged > swept.largest) swept.largest = merged;
+  }
   else
   {
     current->next = index(freelist);
     freelist = current;
-  }
 
-  int skip = 1;
-  if (current->array) skip += num_value_nodes(current);
+    swept.nodes += size;
+    swept.blocks++;
+    if (size > swept.largest) swept.largest = size;
+  }
 
-  index += skip;
+  index += size;
 
   goto recurse;
 }
+
+// Where nodes start, from 'starts_from' up to 'starts_to', for mark_words
+static __thread uint8_t * starts;
+static __thread size_t starts_size;
+static __thread uintptr_t starts_from;
+static __thread uintptr_t starts_to;
+
+static void find_starts(uintptr_t from)
+{
+  size_t size = (context->memsize - from) / 8 + 1;
+  if (size > starts_size)
+  {
+    free(starts);
+    starts = malloc(size);
+    starts_size = size;
+  }
+  memset(starts, 0, size);
+
+  for (uintptr_t i=from; i<context->memsize; i += node_size(&memory[i]))
+    starts[(i - from) / 8] |= 1 << ((i - from) % 8);
+  starts_from = from;
+  starts_to = context->memsize;
+}
+
+int mark_words(void ** from, void ** to)
+{
+  int marked = 0;
+  uintptr_t lowest = (uintptr_t) &memory[starts_from];
+  uintptr_t highest = (uintptr_t) &memory[starts_to];
+
+  for (void ** word = from; word < to; word++)
+  {
+    uintptr_t address = (uintptr_t) *word;
+    if (address < lowest || address >= highest || (address - lowest) % sizeof(Node) != 0) continue;
+
+    uintptr_t i = (address - lowest) / sizeof(Node);
+    if (starts[i / 8] & (1 << (i % 8))) marked += mark(&memory[starts_from + i]);
+  }
+  return marked;
+}
+
+static void count_collection(uint64_t * collections)
+{
+  if (context->memsize > context->peak_memsize) context->peak_memsize = context->memsize;
+  (*collections)++;
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uintptr_t free_nodes(Node * freelist)
+{
+  uintptr_t nodes = 0;
+  for (Node * free = freelist; free != NIL; free = pointer(free->next))
+    nodes += node_size(free);
+  return nodes;
+}
+
+// UNPAIR_GC_TRACE=1 traces to stderr; any other value names a file to append to
+static FILE * trace;
+static uint64_t trace_start;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static void open_trace()
+{
+  trace_start = now_ns();
+  const char * path = getenv("UNPAIR_GC_TRACE");
+  if (path == NULL || path[0] == '\0' || strcmp(path, "0") == 0) return;
+
+  if (strcmp(path, "1") == 0) trace = stderr;
+  else if ((trace = fopen(path, "a")) != NULL) setvbuf(trace, NULL, _IOLBF, 0);
+  else fprintf(stderr, "Cannot open GC trace file %s\n", path);
+}
+
+// The time a collection starts at
+static uint64_t begin_collection()
+{
+  pthread_once(&trace_once, open_trace);
+  return now_ns();
+}
+
+// Add the collection to the totals, and trace it
+static void record_collection(Collection * gc, uint64_t started, uint64_t marked, uint64_t ended)
+{
+  gc->mark_ns = marked - started;
+  gc->sweep_ns = ended - marked;
+  gc->memsize = context->memsize;
+
+  uintptr_t free_after = gc->memsize - gc->used_after;
+  uintptr_t largest = swept.largest;
+  gc->fragmentation = free_after == 0 ? 0 : 100 - (uint64_t) largest * 100 / free_after;
+
+  context->mark_ns += gc->mark_ns;
+  context->sweep_ns += gc->sweep_ns;
+  if (ended - started > context->max_pause_ns) context->max_pause_ns = ended - started;
+  context->last_collection = *gc;
+
+  if (trace == NULL) return;
+  fprintf(trace, "gc %lu %s at %.3fs: mark %.3fms (%lu nodes), sweep %.3fms, freed %lu, "
+    "in use %lu -> %lu of %lu, free list %lu nodes in %lu blocks (%u%% fragmented)\n",
+    (unsigned long) (context->collections + context->young_collections), gc->young ? "young" : "full",
+    (started - trace_start) / 1e9, gc->mark_ns / 1e6, (unsigned long) gc->marked, gc->sweep_ns / 1e6,
+    (unsigned long) gc->freed, (unsigned long) gc->used_before, (unsigned long) gc->used_after,
+    (unsigned long) gc->memsize, (unsigned long) free_after, (unsigned long) gc->free_blocks, gc->fragmentation);
+}
+
+void collect_garbage()
+{
+  uint64_t started = begin_collection();
+  count_collection(&context->collections);
+  Collection gc = { .young = false, .used_before = context->memsize - free_nodes(context->freelist) };
+
+  // Futures hold on to nodes that are not otherwise reachable
+  finish_futures(context);
+
+  // So do the stacks of suspended generators
+  bool generators = context->generators != NULL;
+  if (generators) find_starts(0);
+
+  gc.marked += mark(&memory[0]);
+  gc.marked += mark(&memory[1]);
+  gc.marked += mark(context->environment);
+  gc.marked += mark(context->macros);
+  gc.marked += mark(context->unique_strings);
+  if (generators) gc.marked += mark_generator_stacks(false);
+  uint64_t marked = now_ns();
+
+  release_generators(context);
+  context->freelist = sweep(0);
+  retire_buffers(context);
+  release_futures(context);
+  starts_from = starts_to = 0;
+
+  gc.used_after = context->memsize - swept.nodes;
+  gc.freed = gc.used_before - gc.used_after;
+  gc.free_blocks = swept.blocks;
+  record_collection(&gc, started, marked, now_ns());
+}
+
+void begin_young(Young * young)
+{
+  // Other threads may be walking streams in the same context
+  young->active = __atomic_load_n(&context->sharing, __ATOMIC_ACQUIRE) == 0;
+  if (!young->active) return;
+
+  young->start = context->memsize;
+  young->collected = context->memsize;
+  young->reclaimed = 0;
+  young->resumption = current_resumption();
+  young->freelist = context->freelist;
+  context->freelist = NIL;
+}
+
+// An older promise that was forced during the walk, to a newer value
+static bool forced_lately(Node * node, uintptr_t start)
+{
+  if (!node->array || node->type != TYPE_PROMISE) return false;
+  PromiseBox * box = promise_box(node);
+  return box->forced && box->code != 0 && box->value >= start;
+}
+
+/**
+ * Older promises that were forced during the walk hold on to what they
+ * made, which is how a stream walk would keep all of its stream. But
+ * where neither an environment nor the walk's roots can get to such a
+ * promise, only the frames below the walk can, and they are done with
+ * it, as walks only go forward: it may forget its value, as if it had
+ * never been forced. Marking the others forces them for good.
+ */
+static void forget_promises(uintptr_t start, Node ** roots, int num_roots)
+{
+  uintptr_t i = 0;
+  while (i < start && !forced_lately(&memory[i], start)) i += node_size(&memory[i]);
+  if (i == start) return;
+
+  mark(&memory[0]);
+  mark(&memory[1]);
+  mark(context->environment);
+  mark(context->macros);
+  mark(context->unique_strings);
+  for (int r=0; r<num_roots; r++)
+    mark(roots[r]);
+  if (context->generators != NULL)
+  {
+    find_starts(0);
+    mark_generator_stacks(true);
+    starts_from = starts_to = 0;
+    for (Generator * gen = context->generators; gen != NULL; gen = gen->next)
+      gen->scanned = false;
+  }
+
+  for (i=0; i<context->memsize; i += node_size(&memory[i]))
+  {
+    Node * node = &memory[i];
+    if (i < start && !node->mark && forced_lately(node, start))
+    {
+      PromiseBox * box = promise_box(node);
+      box->forced = false;
+      box->value = 0;
+    }
+    node->mark = false;
+  }
+}
+
+void collect_young(Young * young, Node ** roots, int num_roots)
+{
+  if (!young->active || young->resumption != current_resumption()) return;
+
+  uintptr_t start = young->start;
+  uintptr_t due = start / 2 > YOUNG_MIN ? start / 2 : YOUNG_MIN;
+  bool grown = context->memsize >= young->collected + due;
+  bool reused = context->freelist == NIL && young->reclaimed >= due / 2;
+  if (!grown && !reused) return;
+  if (__atomic_load_n(&context->sharing, __ATOMIC_ACQUIRE) != 0) return;
+  uint64_t started = begin_collection();
+  count_collection(&context->young_collections);
+  forget_promises(start, roots, num_roots);
+
+  // The older nodes are all kept. Mark them, so that marking stops
+  // there, and then mark what they point to. Those on the free list
+  // from before are the exception.
+  for (uintptr_t i=0; i<start; i += node_size(&memory[i]))
+    memory[i].mark = true;
+  uintptr_t old_free = 0, old_blocks = 0, old_largest = 0;
+  for (Node * free = young->freelist; free != NIL; free = pointer(free->next))
+  {
+    free->mark = false;
+    old_free += node_size(free);
+    old_blocks++;
+    if (node_size(free) > old_largest) old_largest = node_size(free);
+  }
+  Collection gc = { .young = true, .used_before = context->memsize - old_free - free_nodes(context->freelist) };
+
+  for (uintptr_t i=0; i<start; i += node_size(&memory[i]))
+    if (memory[i].mark) mark_children(&memory[i]);
+
+  for (int i=0; i<num_roots; i++)
+    mark(roots[i]);
+
+  if (context->generators != NULL)
+  {
+    find_starts(start);
+    mark_generator_stacks(true);
+    starts_from = starts_to = 0;
+  }
+
+  uint64_t marked = now_ns();
+
+  release_generators(context);
+  for (uintptr_t i=0; i<start; i += node_size(&memory[i]))
+    memory[i].mark = false;
+
+  uintptr_t live = 0;
+  for (uintptr_t i=start; i<context->memsize; i += node_size(&memory[i]))
+    if (memory[i].mark) live += node_size(&memory[i]);
+  young->reclaimed = context->memsize - start - live;
+
+  context->freelist = sweep(start);
+  young->collected = context->memsize;
+
+  // The older free list counts too, as end_young puts it back
+  if (old_largest > swept.largest) swept.largest = old_largest;
+  gc.marked = live;
+  gc.used_after = context->memsize - old_free - swept.nodes;
+  gc.freed = gc.used_before - gc.used_after;
+  gc.free_blocks = old_blocks + swept.blocks;
+  record_collection(&gc, started, marked, now_ns());
+}
+
+void end_young(Young * young)
+{
+  if (!young->active) return;
+
+  if (context->freelist == NIL) context->freelist = young->freelist;
+  else
+  {
+    Node * tail = context->freelist;
+    while (tail->next != 0) tail = pointer(tail->next);
+    tail->next = index(young->freelist);
+  }
+}
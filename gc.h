@@ -1,9 +1,75 @@
 #ifndef GC_H
 #define GC_H
 
+#include <stdbool.h>
+
 #include "node.h"
 
+// Whether the value of a node of this type is a node index
+bool is_pointer(Type type);
+
 int mark(Node * node);
-Node * sweep();
+
+/**
+ * Have the present mark do the node last, rather than right away: for
+ * chains that may be too long to follow by recursion, such as forced
+ * streams.
+ */
+void mark_later(Node * node);
+
+/**
+ * Mark only to count what is reachable, as for a heap census: unlike
+ * mark, this changes nothing but the marks. Marking forgets the code of
+ * forced promises, for one, unless only_counting().
+ */
+int mark_to_count(Node * node);
+bool only_counting();
+Node * sweep(uintptr_t from);
+
+/**
+ * Collect all garbage in the present context.
+ */
+void collect_garbage();
+
+/**
+ * Collecting garbage halfway a top-level form, as needed to walk a long
+ * stream in constant memory.
+ *
+ * The C stack holds on to nodes that no GC can see. But the frames that
+ * are there when a walk starts only know of nodes that exist by then,
+ * so those nodes are all kept. Of the nodes made later, the ones that
+ * are reachable neither from the older ones nor from the given roots
+ * are collected; for the rest of the walk, the free list only holds
+ * those. Older promises that the walk forced are the exception: where
+ * no environment and none of the roots reach them, they forget their
+ * values. So the roots should not be chained on to the stream's start. A walk inside a generator only collects until the generator
+ * yields: after that, it is resumed from frames that it does not know.
+ */
+typedef struct Young {
+  uintptr_t start;     // memsize when the walk started
+  uintptr_t collected; // memsize after the last collection
+  uintptr_t reclaimed; // by the last collection
+  Node * freelist;     // the free list from before, set aside meanwhile
+  bool active;         // not if the context was shared to begin with
+  uint64_t resumption; // see current_resumption in stream.h
+} Young;
+
+void begin_young(Young * young);
+
+/**
+ * Collect, if enough has been allocated since the last time: either
+ * when memory has grown by a fair amount, or when the nodes that were
+ * reclaimed have all been reused.
+ * Does nothing while other threads share the context.
+ */
+void collect_young(Young * young, Node ** roots, int num_roots);
+
+void end_young(Young * young);
+
+/**
+ * Mark the nodes that words in [from, to) point to, as far as they point
+ * to the start of a node in the part of memory being collected.
+ */
+int mark_words(void ** from, void ** to);
 
 #endif /*GC_H*/
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "node.h"
+#include "memory.h"
+#include "eval.h"
+#include "hash.h"
+#include "text.h"
+
+#define INITIAL_CAPACITY 8
+
+// Number of old slots to migrate per operation while resizing
+#define MIGRATE_STEP 8
+
+/**
+ * Labels are unique, so their char array index identifies them; strings
+ * hash by their chars, and integers by value. Mix the bits so that
+ * consecutive keys spread out.
+ */
+static uint32_t hash(Node * key)
+{
+  uint32_t h = key->value.u32;
+  if (key->type == TYPE_STRING)
+  {
+    uint32_t length;
+    const char * chars = string_data(key, &length);
+    h = hash_chars(chars, length);
+  }
+  h ^= key->type * 0x9e3779b9;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+// Whether slot 's' holds 'key'; equal strings are the same key
+static bool same_key(Node * s, Node * key)
+{
+  if (s->type != key->type) return false;
+  if (s->value.u32 == key->value.u32) return true;
+  return key->type == TYPE_STRING && strings_equal(s, key);
+}
+
+static Node * new_table(uint32_t capacity)
+{
+  Node * table = new_array_node(TYPE_TABLE, capacity * 2 * sizeof(Node));
+  memset(nodearray(table), 0, capacity * 2 * sizeof(Node));
+  return table;
+}
+
+/**
+ * Find the slot for 'key'. Returns the slot holding the key if it is there;
+ * else, if 'for_insert', the first free slot where it may go; else NULL.
+ */
+static Node * probe(Node * table, Node * key, bool for_insert)
+{
+  uint32_t capacity = num_slots(table);
+  uint32_t i = hash(key) & (capacity - 1);
+  Node * deleted = NULL;
+
+  for (uint32_t n=0; n<capacity; n++)
+  {
+    Node * s = slot(table, i);
+    if (s->next == SLOT_EMPTY) return for_insert ? (deleted != NULL ? deleted : s) : NULL;
+    if (s->next == SLOT_DELETED)
+    {
+      if (deleted == NULL) deleted = s;
+    }
+    else if (same_key(s, key)) return s;
+
+    i = (i + 1) & (capacity - 1);
+  }
+  return for_insert ? deleted : NULL;
+}
+
+// Put a key / value pair into a free slot of the present table
+static void put(HashHeader * h, Node * s, Node * key, Node * value)
+{
+  if (s->next == SLOT_EMPTY) h->used++;
+
+  s->type = key->type;
+  s->value.u32 = key->value.u32;
+  s->next = SLOT_USED;
+
+  s[1].type = value->type;
+  s[1].value.u32 = value->value.u32;
+  s[1].next = 0;
+}
+
+static void migrate(HashHeader * h, uint32_t steps)
+{
+  if (h->old_table == 0) return;
+
+  Node * old = pointer(h->old_table);
+  Node * table = pointer(h->table);
+
+  while (steps-- > 0 && h->migrated < h->old_capacity)
+  {
+    Node * s = slot(old, h->migrated++);
+    if (s->next == SLOT_USED) put(h, probe(table, s, true), s, s+1);
+  }
+
+  // Done; leave the old table for GC
+  if (h->migrated == h->old_capacity) h->old_table = 0;
+}
+
+// Start moving over to a fresh slot array; grow if needed
+static void start_resize(HashHeader * h)
+{
+  // Finish any migration still in progress first
+  migrate(h, h->old_capacity);
+
+  uint32_t capacity = h->capacity;
+  if (h->count + 1 > capacity / 2) capacity *= 2; // else, just clean up deleted slots
+
+  h->old_table = h->table;
+  h->old_capacity = h->capacity;
+  h->migrated = 0;
+
+  h->table = index(new_table(capacity));
+  h->capacity = capacity;
+  h->used = 0;
+}
+
+static HashHeader * header(Node * val)
+{
+  if (val == NIL || val->type != TYPE_HASH)
+  {
+    printf("Runtime error: expected hash table; got '%s'.\n", types[val->type]);
+    return NULL;
+  }
+  return hash_header(pointer(val->value.u32));
+}
+
+// Make an element out of an in-line slot value
+static Node * slot_value(Node * s)
+{
+  return new_node(s->type, s->value.u32);
+}
+
+// (make-hash-table [expected-size])
+Node * make_hash_table(Node * args, Node ** env)
+{
+  uint32_t capacity = INITIAL_CAPACITY;
+  if (args != NIL && args->type == TYPE_INT)
+    while (capacity * 3 / 4 < args->value.u32) capacity *= 2;
+
+  Node * head = new_array_node(TYPE_HASH, sizeof(HashHeader));
+  HashHeader * h = hash_header(head);
+  memset(h, 0, sizeof(HashHeader));
+  h->capacity = capacity;
+  h->table = index(new_table(capacity));
+
+  return new_node(TYPE_HASH, index(head));
+}
+
+// (hash-ref table key [default])
+Node * hash_ref(Node * args, Node ** env)
+{
+  HashHeader * h = header(args);
+  if (h == NULL) return pointer_to(NIL);
+
+  Node * key = pointer(args->next);
+  migrate(h, MIGRATE_STEP);
+
+  Node * s = probe(pointer(h->table), key, false);
+  if (s == NULL && h->old_table != 0) s = probe(pointer(h->old_table), key, false);
+  if (s != NULL) return slot_value(s+1);
+
+  Node * dflt = pointer(key->next);
+  if (dflt != NIL) return element(dflt);
+  return pointer_to(NIL);
+}
+
+// (hash-set! table key value)
+Node * hash_set(Node * args, Node ** env)
+{
+  HashHeader * h = header(args);
+  if (h == NULL) return pointer_to(NIL);
+
+  Node * value = pointer(pointer(args->next)->next);
+  if (value == NIL) value = pointer_to(NIL);
+
+  Node * key = pointer(args->next);
+  migrate(h, MIGRATE_STEP);
+
+  Node * s = probe(pointer(h->table), key, false);
+  if (s != NULL)
+  {
+    put(h, s, key, value);
+    return element(value);
+  }
+
+  // Not in the present table; any old entry is superseded
+  if (h->old_table != 0)
+  {
+    s = probe(pointer(h->old_table), key, false);
+    if (s != NULL)
+    {
+      s->next = SLOT_DELETED;
+      h->count--;
+    }
+  }
+
+  if ((h->used + 1) * 4 > h->capacity * 3) start_resize(h);
+
+  put(h, probe(pointer(h->table), key, true), key, value);
+  h->count++;
+  return element(value);
+}
+
+// (hash-remove! table key)
+Node * hash_remove(Node * args, Node ** env)
+{
+  HashHeader * h = header(args);
+  if (h == NULL) return pointer_to(NIL);
+
+  Node * key = pointer(args->next);
+  migrate(h, MIGRATE_STEP);
+
+  bool found = false;
+  Node * s = probe(pointer(h->table), key, false);
+  if (s == NULL && h->old_table != 0) s = probe(pointer(h->old_table), key, false);
+  if (s != NULL)
+  {
+    s->next = SLOT_DELETED;
+    h->count--;
+    found = true;
+  }
+
+  return found ? pointer_to(NIL+1) : pointer_to(NIL);
+}
+
+// (hash-count table)
+Node * hash_count(Node * args, Node ** env)
+{
+  HashHeader * h = header(args);
+  if (h == NULL) return pointer_to(NIL);
+  return new_node(TYPE_INT, h->count);
+}
+
+/**
+ * Visit all live entries: those in the present table, plus
+ * those in the old table that have not been migrated yet.
+ */
+static void for_each_entry(HashHeader * h, void (* cb) (Node * s, void * data), void * data)
+{
+  Node * table = pointer(h->table);
+  for (uint32_t i=0; i<h->capacity; i++)
+    if (slot(table, i)->next == SLOT_USED) cb(slot(table, i), data);
+
+  if (h->old_table == 0) return;
+  Node * old = pointer(h->old_table);
+  for (uint32_t i=h->migrated; i<h->old_capacity; i++)
+    if (slot(old, i)->next == SLOT_USED) cb(slot(old, i), data);
+}
+
+typedef struct CallData {
+  Node * func;
+  Node * env;
+} CallData;
+
+static void call_entry(Node * s, void * data)
+{
+  CallData * call = data;
+  Node * key = slot_value(s);
+  Node * value = slot_value(s+1);
+  key->element = false;
+  value->element = false;
+  key->next = index(value);
+  apply_values(call->func, key, call->env);
+}
+
+// (hash-for-each f table) => (f key value) for every entry
+Node * hash_for_each(Node * args, Node ** env)
+{
+  HashHeader * h = header(pointer(args->next));
+  if (h == NULL) return pointer_to(NIL);
+
+  CallData call = { args, *env };
+  for_each_entry(h, call_entry, &call);
+  return pointer_to(NIL);
+}
+
+typedef struct ListData {
+  Node * head;
+  Node * tail;
+} ListData;
+
+static void collect_entry(Node * s, void * data)
+{
+  ListData * list = data;
+  Node * key = slot_value(s);
+  Node * value = slot_value(s+1);
+  key->element = false;
+  value->element = false;
+  key->next = index(value);
+
+  Node * entry = new_node(TYPE_NODE, index(key));
+  entry->element = false;
+  if (list->head == NIL) list->head = entry;
+  else list->tail->next = index(entry);
+  list->tail = entry;
+}
+
+// (hash->list table) => ((key value) ...)
+Node * hash_to_list(Node * args, Node ** env)
+{
+  HashHeader * h = header(args);
+  if (h == NULL) return pointer_to(NIL);
+
+  ListData list = { NIL, NIL };
+  for_each_entry(h, collect_entry, &list);
+  return pointer_to(list.head);
+}
@@ -0,0 +1,46 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "node.h"
+
+/**
+ * Hash tables are stored in node memory, so that GC handles them like all else:
+ *
+ * - The LISP value is a TYPE_HASH node pointing to the header.
+ *   This node may be copied around freely, as copies all share the header.
+ * - The header is a TYPE_HASH array node holding a HashHeader.
+ * - The slots are held by a TYPE_TABLE array node, two in-line nodes per slot:
+ *   key and value. The key's 'next' field holds the slot state.
+ *
+ * Tables use open addressing with linear probing. When a table fills up, a new
+ * slot array is allocated and the old one is migrated a few slots at a time on
+ * every subsequent operation, so that no single operation pays for a full rehash.
+ */
+typedef struct HashHeader {
+  uint32_t count;        // live entries in both tables
+  uint32_t used;         // used + deleted slots in 'table'
+  uint32_t capacity;     // number of slots in 'table'; always a power of 2
+  uint32_t table;        // node index of the slots array
+  uint32_t old_table;    // node index of the slots array being migrated from, or 0
+  uint32_t old_capacity;
+  uint32_t migrated;     // number of 'old_table' slots migrated so far
+} HashHeader;
+
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+#define SLOT_DELETED 2
+
+#define hash_header(node) ((HashHeader *) ((node) + 1))
+#define num_slots(table) ((table)->value.u32 / (2 * sizeof(Node)))
+#define slot(table, i) (nodearray(table) + 2 * (i))
+
+// Hash table primitives
+Node * make_hash_table(Node * args, Node ** env);
+Node * hash_ref(Node * args, Node ** env);
+Node * hash_set(Node * args, Node ** env);
+Node * hash_remove(Node * args, Node ** env);
+Node * hash_count(Node * args, Node ** env);
+Node * hash_for_each(Node * args, Node ** env);
+Node * hash_to_list(Node * args, Node ** env);
+
+#endif /* HASH_H */
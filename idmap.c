@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "idmap.h"
+
+static uint32_t * map_slot(IdMap * map, uint32_t idx)
+{
+  uint32_t i = (idx * 2654435761u) & (map->size - 1);
+  while (map->keys[i] != 0 && map->keys[i] != idx + 1) i = (i + 1) & (map->size - 1);
+  return &map->keys[i];
+}
+
+int64_t map_find(IdMap * map, uint32_t idx)
+{
+  if (map->size == 0) return -1;
+  uint32_t * key = map_slot(map, idx);
+  if (*key == 0) return -1;
+  return map->ids[key - map->keys];
+}
+
+uint32_t map_add(IdMap * map, uint32_t idx)
+{
+  if ((map->count + 1) * 2 > map->size)
+  {
+    IdMap old = *map;
+    map->size = map->size == 0 ? 256 : map->size * 2;
+    map->keys = calloc(map->size, sizeof(uint32_t));
+    map->ids = malloc(map->size * sizeof(uint32_t));
+    map->order = realloc(map->order, map->size * sizeof(uint32_t));
+    for (uint32_t i=0; i<old.size; i++)
+    {
+      if (old.keys[i] == 0) continue;
+      uint32_t * key = map_slot(map, old.keys[i] - 1);
+      *key = old.keys[i];
+      map->ids[key - map->keys] = old.ids[i];
+    }
+    free(old.keys);
+    free(old.ids);
+  }
+
+  uint32_t * key = map_slot(map, idx);
+  if (*key != 0) return map->ids[key - map->keys];
+
+  *key = idx + 1;
+  map->ids[key - map->keys] = map->count;
+  map->order[map->count] = idx;
+  return map->count++;
+}
+
+void map_free(IdMap * map)
+{
+  free(map->keys);
+  free(map->ids);
+  free(map->order);
+}
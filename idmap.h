@@ -0,0 +1,25 @@
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <stdint.h>
+
+/**
+ * Numbers node indices in order of first appearance.
+ */
+typedef struct IdMap {
+  uint32_t * keys; // node index + 1; 0 = empty slot
+  uint32_t * ids;
+  uint32_t size;
+  uint32_t count;
+  uint32_t * order; // node indices by number
+} IdMap;
+
+// The number of a node index, or -1 if not in the map
+int64_t map_find(IdMap * map, uint32_t idx);
+
+// Add a node index if new; returns its number either way
+uint32_t map_add(IdMap * map, uint32_t idx);
+
+void map_free(IdMap * map);
+
+#endif /* IDMAP_H */
@@ -2,21 +2,20 @@
 ;; This library file is loaded automatically on start-up.
 ;;
 
-(define list (lambda x x))
-
 (define cadr (lambda (x) (car (cdr x))))
 
-(define apply (lambda (fn args) (eval (cons fn args))))
-
-(define map
-  (lambda (func values)
-    (if (= values '())
-      '()
-      (cons (func (car values)) (map func (cdr values)))
-)))
+;; list, map, apply and friends are native; see list.c and primitive.c
 
 (define-syntax let
   (lambda (_ vars body)
     (cons (list 'lambda (map car vars) body) (map cadr vars))
 ))
 
+
+;; Streams are native, save for the constructor; see stream.c
+(define-syntax stream-cons
+  (lambda (_ a b)
+    (list 'cons a (list 'delay b))
+))
+
+(define stream-car car)
@@ -0,0 +1,335 @@
+/**
+ * Native list library.
+ *
+ * These used to be (or would otherwise be) written in LISP in lib.lisp,
+ * where every step of e.g. 'map' evaluates (= values '()), car, cdr and cons,
+ * and builds its result by recursion. Here we walk the lists iteratively,
+ * and only allocate the nodes that end up in the result, plus the argument
+ * nodes needed to call back into a function value.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "node.h"
+#include "memory.h"
+#include "eval.h"
+#include "list.h"
+
+// The first item of the list that a (TYPE_NODE) list value points to
+#define items(val) ((val)->type == TYPE_NODE ? pointer((val)->value.u32) : NIL)
+
+#define is_true(val) ((val) != NIL && (val)->value.u32 != 0)
+
+// Make a chainable copy of a single value, for use as function argument
+static Node * arg(Node * value, Node * next)
+{
+  Node * result = copy(value, 0);
+  result->element = false;
+  result->next = index(next);
+  return result;
+}
+
+// Chain a value in at the end of the list under construction
+static void collect(Node ** head, Node ** tail, Node * value)
+{
+  if (value == NIL) value = pointer_to(NIL);
+  value->element = false;
+  value->next = 0;
+
+  if (*head == NIL) *head = value;
+  else (*tail)->next = index(value);
+  *tail = value;
+}
+
+// Compare atoms the same way as '=' does; strings and labels are unique
+static bool same(Node * a, Node * b)
+{
+  return a->type == b->type && a->value.u32 == b->value.u32;
+}
+
+static Node * map_internal(Node * args, Node * env, bool collect_results)
+{
+  Node * func = args;
+
+  int num_lists = length(pointer(func->next));
+  if (num_lists == 0) return pointer_to(NIL);
+
+  Node * cursors[num_lists];
+  Node * list = pointer(func->next);
+  for (int i=0; i<num_lists; i++)
+  {
+    cursors[i] = items(list);
+    list = pointer(list->next);
+  }
+
+  Node * head = NIL;
+  Node * tail = NIL;
+
+  while (true)
+  {
+    // Stop at the end of the shortest list
+    for (int i=0; i<num_lists; i++) if (cursors[i] == NIL) goto done;
+
+    Node * call_args = NIL;
+    for (int i=num_lists-1; i>=0; i--)
+    {
+      call_args = arg(cursors[i], call_args);
+      cursors[i] = pointer(cursors[i]->next);
+    }
+
+    Node * result = apply_values(func, call_args, env);
+    if (collect_results) collect(&head, &tail, result);
+  }
+
+  done:
+  return pointer_to(head);
+}
+
+// (map f l1 l2 ...)
+Node * list_map(Node * args, Node ** env)
+{
+  return map_internal(args, *env, true);
+}
+
+// (for-each f l1 l2 ...)
+Node * list_for_each(Node * args, Node ** env)
+{
+  return map_internal(args, *env, false);
+}
+
+// (filter pred l)
+Node * list_filter(Node * args, Node ** env)
+{
+  Node * pred = args;
+  Node * item = items(pointer(pred->next));
+
+  Node * head = NIL;
+  Node * tail = NIL;
+
+  while (item != NIL)
+  {
+    if (is_true(apply_values(pred, arg(item, NIL), *env)))
+      collect(&head, &tail, copy(item, 0));
+    item = pointer(item->next);
+  }
+
+  return pointer_to(head);
+}
+
+// (fold-left f init l) => (f (f (f init x1) x2) x3)
+Node * list_fold_left(Node * args, Node ** env)
+{
+  Node * func = args;
+  Node * acc = pointer(func->next);
+  Node * item = items(pointer(acc->next));
+
+  while (item != NIL)
+  {
+    acc = apply_values(func, arg(acc, arg(item, NIL)), *env);
+    item = pointer(item->next);
+  }
+
+  return element(acc);
+}
+
+// (fold-right f init l) => (f x1 (f x2 (f x3 init)))
+Node * list_fold_right(Node * args, Node ** env)
+{
+  Node * func = args;
+  Node * acc = pointer(func->next);
+  Node * list = items(pointer(acc->next));
+
+  // Our lists only link forward, so remember the way back
+  int n = length(list);
+  Node ** stack = malloc(sizeof(Node *) * n);
+  for (int i=0; i<n; i++)
+  {
+    stack[i] = list;
+    list = pointer(list->next);
+  }
+
+  for (int i=n-1; i>=0; i--)
+    acc = apply_values(func, arg(stack[i], arg(acc, NIL)), *env);
+
+  free(stack);
+  return element(acc);
+}
+
+// (reverse l)
+Node * list_reverse(Node * args, Node ** env)
+{
+  Node * result = NIL;
+  Node * item = items(args);
+
+  while (item != NIL)
+  {
+    result = arg(item, result);
+    item = pointer(item->next);
+  }
+
+  return pointer_to(result);
+}
+
+// (append l1 l2 ... ln); like 'cons', the last list is shared, not copied
+Node * list_append(Node * args, Node ** env)
+{
+  if (args == NIL) return pointer_to(NIL);
+
+  Node * head = NIL;
+  Node * tail = NIL;
+
+  while (args->next != 0)
+  {
+    Node * item = items(args);
+    while (item != NIL)
+    {
+      collect(&head, &tail, copy(item, 0));
+      item = pointer(item->next);
+    }
+    args = pointer(args->next);
+  }
+
+  if (head == NIL) return element(args);
+
+  if (args->type == TYPE_NODE) tail->next = args->value.u32;
+  else tail->next = index(element(copy(args, 0))); // make a pair
+
+  return pointer_to(head);
+}
+
+// (length l)
+Node * list_length(Node * args, Node ** env)
+{
+  int32_t n = 0;
+  for (Node * item = items(args); item != NIL; item = pointer(item->next)) n++;
+  return new_node(TYPE_INT, n);
+}
+
+// (list-ref l k), counting from zero
+Node * list_ref(Node * args, Node ** env)
+{
+  Node * item = items(args);
+  int32_t k = pointer(args->next)->value.i32;
+
+  for (int32_t i=0; i<k && item != NIL; i++)
+    item = pointer(item->next);
+
+  if (item == NIL) return pointer_to(NIL);
+  return element(item);
+}
+
+// (assoc key alist)
+Node * list_assoc(Node * args, Node ** env)
+{
+  Node * key = args;
+
+  for (Node * entry = items(pointer(key->next)); entry != NIL; entry = pointer(entry->next))
+  {
+    if (entry->type != TYPE_NODE || entry->value.u32 == 0) continue;
+    if (same(pointer(entry->value.u32), key)) return element(entry);
+  }
+
+  return pointer_to(NIL);
+}
+
+/**
+ * Stable bottom-up merge sort, done in-place by relinking 'next' indices.
+ * It only compares list items; no intermediate lists are created.
+ */
+static Node * merge_sort(Node * list, Node * less, Node * env)
+{
+  if (list == NIL) return list;
+
+  for (int insize = 1; ; insize *= 2)
+  {
+    Node * p = list;
+    Node * tail = NIL;
+    int merges = 0;
+    list = NIL;
+
+    while (p != NIL)
+    {
+      merges++;
+
+      Node * q = p;
+      int psize = 0;
+      while (psize < insize && q != NIL)
+      {
+        psize++;
+        q = pointer(q->next);
+      }
+      int qsize = insize;
+
+      while (psize > 0 || (qsize > 0 && q != NIL))
+      {
+        Node * e;
+        // Only take from the right run if strictly less, to remain stable
+        if (psize > 0 && (qsize == 0 || q == NIL || !is_true(apply_values(less, arg(q, arg(p, NIL)), env))))
+        {
+          e = p;
+          p = pointer(p->next);
+          psize--;
+        }
+        else
+        {
+          e = q;
+          q = pointer(q->next);
+          qsize--;
+        }
+
+        if (tail == NIL) list = e;
+        else tail->next = index(e);
+        tail = e;
+      }
+
+      p = q;
+    }
+
+    tail->next = 0;
+    if (merges <= 1) return list;
+  }
+}
+
+// (sort l less?); sorts a copy of the list's spine, sharing the values
+Node * list_sort(Node * args, Node ** env)
+{
+  Node * head = NIL;
+  Node * tail = NIL;
+
+  for (Node * item = items(args); item != NIL; item = pointer(item->next))
+    collect(&head, &tail, copy(item, 0));
+
+  return pointer_to(merge_sort(head, pointer(args->next), *env));
+}
+
+// (apply f a b ... l) => (f a b ... l1 l2 ...)
+Node * list_apply(Node * args, Node ** env)
+{
+  Node * func = args;
+  args = pointer(func->next);
+  if (args == NIL) return apply_values(func, NIL, *env);
+
+  Node * head = NIL;
+  Node * tail = NIL;
+
+  while (args->next != 0)
+  {
+    collect(&head, &tail, copy(args, 0));
+    args = pointer(args->next);
+  }
+
+  // The final list's items already form a chain; pass them as-is, but
+  // for the first arg, as cons chains that into its result
+  Node * rest = items(args);
+  if (head == NIL && rest != NIL)
+  {
+    collect(&head, &tail, copy(rest, 0));
+    rest = pointer(rest->next);
+  }
+  if (head == NIL) return apply_values(func, rest, *env);
+
+  tail->next = index(rest);
+  return apply_values(func, head, *env);
+}
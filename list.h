@@ -0,0 +1,20 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include "node.h"
+
+// Native list library primitives
+Node * list_map(Node * args, Node ** env);
+Node * list_for_each(Node * args, Node ** env);
+Node * list_filter(Node * args, Node ** env);
+Node * list_fold_left(Node * args, Node ** env);
+Node * list_fold_right(Node * args, Node ** env);
+Node * list_reverse(Node * args, Node ** env);
+Node * list_append(Node * args, Node ** env);
+Node * list_length(Node * args, Node ** env);
+Node * list_ref(Node * args, Node ** env);
+Node * list_assoc(Node * args, Node ** env);
+Node * list_sort(Node * args, Node ** env);
+Node * list_apply(Node * args, Node ** env);
+
+#endif /* LIST_H */
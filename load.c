@@ -0,0 +1,578 @@
+/**
+ * Loading source files, with a cache of their transformed forms.
+ *
+ * Each top-level form is serialized right after 'transform', before it is
+ * evaluated. Definitions of lambdas and constants are instead serialized
+ * after evaluation, closure and all, as evaluating them has no side effects
+ * other than the definition itself; this saves transforming lambda bodies.
+ *
+ * A form's nodes are numbered in the cache, so that on load they may be
+ * relocated to wherever new_node puts them. Other references are by name:
+ * labels, strings and primitive names through a string table, and variables
+ * defined outside of the file through a lookup by name when loaded.
+ * nil and true (memory[0] and [1]) are always at the same place, and closures
+ * refer to the global environment as it is when they are loaded.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "node.h"
+#include "memory.h"
+#include "parse.h"
+#include "text.h"
+#include "transform.h"
+#include "eval.h"
+#include "primitive.h"
+#include "load.h"
+#include "idmap.h"
+
+#define CACHE_MAGIC "UNPC"
+#define CACHE_FORMAT 2 // 2: closures are flagged as local; see region.h
+
+// References to nodes below this index are not relocated
+#define FIXED_REFS 2
+// Reference to the environment at the point of the form
+#define ENV_REF 2
+// Reference to the first node in the form
+#define FIRST_REF 3
+
+// Cached node flags
+#define CACHED_ELEMENT 1
+#define CACHED_SPECIAL 2
+#define CACHED_EXTERNAL 4 // TYPE_ARG or TYPE_VAR by name, for variables not defined in the file
+
+typedef struct CacheHeader {
+  char magic[4];
+  uint32_t format;
+  char version[8];
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint32_t path_len;
+  uint32_t num_strings;
+  uint32_t num_forms;
+} CacheHeader;
+
+typedef enum FormKind {
+  FORM_EVAL,    // root is the transformed form, to be evaluated
+  FORM_DEFINED  // no root; the defined names already hold their values
+} FormKind;
+
+typedef struct FormHeader {
+  uint32_t kind;
+  uint32_t num_nodes;
+  uint32_t num_env_defs;   // nodes 0..num_env_defs-1 are 'define'd names
+  uint32_t num_macro_defs; // the next ones are 'define-syntax'ed names
+  uint32_t root;
+} FormHeader;
+
+typedef struct CachedNode {
+  uint8_t type;
+  uint8_t flags;
+  uint32_t next;
+  uint32_t value;
+} __attribute__((__packed__)) CachedNode;
+
+typedef struct Buffer {
+  uint8_t * data;
+  size_t len;
+  size_t size;
+} Buffer;
+
+static void put(Buffer * buf, const void * data, size_t len)
+{
+  if (buf->len + len > buf->size)
+  {
+    buf->size = (buf->len + len) * 2;
+    buf->data = realloc(buf->data, buf->size);
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+typedef struct Cache {
+  Buffer forms;
+  IdMap strings;   // by char array node index
+  IdMap env_nodes; // the global environment and macros chains
+  uint32_t num_forms;
+  bool ok;
+} Cache;
+
+// Add the env chain nodes up to the first one we already know of
+static void add_env_nodes(Cache * cache, Node * env)
+{
+  for (; env != NIL && map_find(&cache->env_nodes, index(env)) < 0; env = pointer(env->next))
+    map_add(&cache->env_nodes, index(env));
+}
+
+// Find the env entry that 'define' or 'define-syntax' made for a (name) node
+static bool resolves_to(Node * env, Node * name, uint32_t target)
+{
+  Node * entry = lookup_internal(env, name);
+  return entry != NIL && entry->value.u32 == target;
+}
+
+static uint32_t ref(IdMap * nodes, uint32_t idx)
+{
+  if (idx < FIXED_REFS) return idx;
+  if (idx == index(context->environment)) return ENV_REF;
+  return map_find(nodes, idx) + FIRST_REF;
+}
+
+/**
+ * Add a referenced node to those in the form. Returns false for references
+ * into the global environment, other than to the environment as a whole.
+ */
+static bool follow(Cache * cache, IdMap * nodes, uint32_t idx)
+{
+  if (idx < FIXED_REFS || idx == index(context->environment)) return true;
+  if (map_find(&cache->env_nodes, idx) >= 0) return false;
+  map_add(nodes, idx);
+  return true;
+}
+
+/**
+ * Append a form to the cache: either a transformed form (FORM_EVAL) or the
+ * values of the names it has defined (FORM_DEFINED). Returns false if it
+ * holds anything that can't be cached, such as arrays or hash tables.
+ */
+static bool cache_form(Cache * cache, FormKind kind, Node * root, Node * env_before, Node * macros_before)
+{
+  IdMap nodes = {0};
+  bool ok = true;
+
+  add_env_nodes(cache, context->environment);
+  add_env_nodes(cache, context->macros);
+
+  // The names defined by this form come first,
+  // so that references to them are relocated.
+  FormHeader form = { kind, 0, 0, 0, 0 };
+  for (Node * entry = context->environment; entry != env_before; entry = pointer(entry->next), form.num_env_defs++)
+    map_add(&nodes, entry->value.u32);
+  for (Node * entry = context->macros; entry != macros_before; entry = pointer(entry->next), form.num_macro_defs++)
+    map_add(&nodes, entry->value.u32);
+
+  if (kind == FORM_EVAL) ok = follow(cache, &nodes, index(root));
+
+  // Find all nodes in the form
+  for (uint32_t i=0; ok && i<nodes.count; i++)
+  {
+    Node * node = pointer(nodes.order[i]);
+    if (node->array) ok = false;
+
+    switch (node->type)
+    {
+      case TYPE_INT:
+      case TYPE_CHAR:
+        break;
+      case TYPE_STRING:
+        // Literals are char arrays; slices and ropes are made at run time
+        if (pointer(node->value.u32)->type != TYPE_CHAR) ok = false;
+        // Fall through
+      case TYPE_ID:
+        map_add(&cache->strings, node->value.u32);
+        break;
+      case TYPE_PRIMITIVE:
+      {
+        const char * name = primitives[node->value.u32].name;
+        map_add(&cache->strings, index(unique_chars(name, strlen(name))));
+        break;
+      }
+      case TYPE_NODE:
+      case TYPE_FUNC:
+        if (!follow(cache, &nodes, node->value.u32)) ok = false;
+        break;
+      case TYPE_ARG:
+      case TYPE_VAR:
+        if (node->value.u32 < FIXED_REFS || map_find(&nodes, node->value.u32) >= 0) break;
+        // Defined outside of this form; make sure we can find it again by name
+        Node * name = pointer(node->value.u32);
+        if (resolves_to(context->environment, name, node->value.u32) || resolves_to(context->macros, name, node->value.u32))
+          map_add(&cache->strings, name->value.u32);
+        else ok = false;
+        break;
+      default:
+        ok = false;
+    }
+
+    if (!follow(cache, &nodes, node->next)) ok = false;
+  }
+
+  if (ok)
+  {
+    form.num_nodes = nodes.count;
+    form.root = ref(&nodes, index(root));
+    put(&cache->forms, &form, sizeof(form));
+
+    for (uint32_t i=0; i<nodes.count; i++)
+    {
+      Node * node = pointer(nodes.order[i]);
+      CachedNode cached = { node->type, 0, ref(&nodes, node->next), node->value.u32 };
+      if (node->element) cached.flags |= CACHED_ELEMENT;
+      if (node->special) cached.flags |= CACHED_SPECIAL;
+
+      switch (node->type)
+      {
+        case TYPE_ID:
+        case TYPE_STRING:
+          cached.value = map_find(&cache->strings, node->value.u32);
+          break;
+        case TYPE_PRIMITIVE:
+        {
+          const char * name = primitives[node->value.u32].name;
+          cached.value = map_find(&cache->strings, index(unique_chars(name, strlen(name))));
+          break;
+        }
+        case TYPE_NODE:
+        case TYPE_FUNC:
+          cached.value = ref(&nodes, node->value.u32);
+          break;
+        case TYPE_ARG:
+        case TYPE_VAR:
+          if (node->value.u32 >= FIXED_REFS && map_find(&nodes, node->value.u32) < 0)
+          {
+            cached.flags |= CACHED_EXTERNAL;
+            cached.value = map_find(&cache->strings, pointer(node->value.u32)->value.u32);
+          }
+          else cached.value = ref(&nodes, node->value.u32);
+          break;
+        default:
+          break;
+      }
+      put(&cache->forms, &cached, sizeof(cached));
+    }
+    cache->num_forms++;
+  }
+
+  map_free(&nodes);
+  return ok;
+}
+
+static void write_cache(Cache * cache, const char * path, const char * cache_path, struct stat * st)
+{
+  CacheHeader header = { CACHE_MAGIC, CACHE_FORMAT, UNPAIR_VERSION,
+    st->st_mtim.tv_sec, st->st_mtim.tv_nsec, st->st_size,
+    strlen(path), cache->strings.count, cache->num_forms };
+
+  Buffer buf = {0};
+  put(&buf, &header, sizeof(header));
+  put(&buf, path, header.path_len);
+  for (uint32_t i=0; i<cache->strings.count; i++)
+  {
+    Node * chars = pointer(cache->strings.order[i]);
+    uint32_t len = chars->value.u32 - 1;
+    put(&buf, &len, sizeof(len));
+    put(&buf, strval(chars), len);
+  }
+  put(&buf, cache->forms.data, cache->forms.len);
+
+  // Write and rename, so that readers never see half a cache file;
+  // the temporary file is unique to us, as other interpreters may be
+  // writing the same cache. Failing to write (e.g. in a read-only
+  // directory) is not an error.
+  char tmp_path[strlen(cache_path) + 8];
+  sprintf(tmp_path, "%s.XXXXXX", cache_path);
+  int fd = mkstemp(tmp_path);
+  FILE * out = fd < 0 ? NULL : fdopen(fd, "wb");
+  if (out != NULL)
+  {
+    bool written = fwrite(buf.data, 1, buf.len, out) == buf.len;
+    if (fclose(out) == 0 && written) rename(tmp_path, cache_path);
+    else remove(tmp_path);
+  }
+  free(buf.data);
+}
+
+/**
+ * Whether a transformed form is a 'define' or 'define-syntax' of a lambda or
+ * constant, whose evaluation has no side effects besides the definition.
+ */
+static bool is_pure_definition(Node * root)
+{
+  if (root->type != TYPE_NODE || root->special) return false;
+  Node * prim = pointer(root->value.u32);
+  if (prim->type != TYPE_PRIMITIVE) return false;
+  const char * name = primitives[prim->value.u32].name;
+  if (strcmp(name, "define") != 0 && strcmp(name, "define-syntax") != 0) return false;
+
+  Node * var = pointer(prim->next);
+  if (var == NIL || var->next == 0) return false;
+
+  Node * value = pointer(var->next);
+  if (value->special || value->type == TYPE_INT || value->type == TYPE_STRING) return true;
+  if (value->type != TYPE_NODE) return false;
+
+  Node * head = pointer(value->value.u32);
+  return head->type == TYPE_PRIMITIVE && strcmp(primitives[head->value.u32].name, "lambda") == 0;
+}
+
+/**
+ * Parse, transform and eval the forms in a file, skipping the first 'skip'
+ * forms. If 'cache' is given, the transformed forms are added to it.
+ */
+static bool load_source(const char * path, int skip, Cache * cache)
+{
+  FILE * file = fopen(path, "r");
+  if (file == NULL) return false;
+  push_infile(file);
+
+  Node * node;
+  while ((node = parse()) != NULL)
+  {
+    if (skip > 0)
+    {
+      skip--;
+      continue;
+    }
+
+    Node * env_before = context->environment;
+    Node * macros_before = context->macros;
+
+    node = transform(node, &context->environment, context->environment);
+    // In case of compilation error:
+    if (node == NULL)
+    {
+      if (cache != NULL) cache->ok = false;
+      continue;
+    }
+
+    size_t start = cache == NULL ? 0 : cache->forms.len;
+    if (cache != NULL && cache->ok) cache->ok = cache_form(cache, FORM_EVAL, node, env_before, macros_before);
+
+    if (!node->special) eval(node, context->environment);
+
+    // Prefer the definition as evaluated, if possible
+    if (cache != NULL && cache->ok && is_pure_definition(node))
+    {
+      size_t end = cache->forms.len;
+      if (cache_form(cache, FORM_DEFINED, NIL, env_before, macros_before))
+      {
+        memmove(cache->forms.data + start, cache->forms.data + end, cache->forms.len - end);
+        cache->forms.len -= end - start;
+        cache->num_forms--;
+      }
+      else cache->forms.len = end;
+    }
+  }
+
+  pop_infile();
+  fclose(file);
+  return true;
+}
+
+// Reads from a loaded cache file, with bounds checking
+typedef struct CacheReader {
+  uint8_t * data;
+  size_t pos;
+  size_t len;
+} CacheReader;
+
+static void * take(CacheReader * in, size_t len)
+{
+  if (in->len - in->pos < len) return NULL;
+  in->pos += len;
+  return in->data + in->pos - len;
+}
+
+// A form being relocated
+typedef struct Relocation {
+  Node ** nodes;
+  uint32_t num_nodes;
+  uint32_t * strings;
+  uint32_t num_strings;
+  Node * env; // the environment including the form's definitions
+} Relocation;
+
+// Returns the node index for a reference, or -1 if invalid
+static int64_t reloc(uint32_t ref, Relocation * r)
+{
+  if (ref < FIXED_REFS) return ref;
+  if (ref == ENV_REF) return index(r->env);
+  if (ref - FIRST_REF >= r->num_nodes) return -1;
+  return index(r->nodes[ref - FIRST_REF]);
+}
+
+static bool relocate(CachedNode * cached, Node * node, Relocation * r)
+{
+  int64_t next = reloc(cached->next, r);
+  if (next < 0) return false;
+
+  node->type = cached->type;
+  node->element = (cached->flags & CACHED_ELEMENT) != 0;
+  node->special = (cached->flags & CACHED_SPECIAL) != 0;
+  node->next = next;
+
+  int64_t value = cached->value;
+  switch (node->type)
+  {
+    case TYPE_ID:
+    case TYPE_STRING:
+      if (cached->value >= r->num_strings) return false;
+      value = r->strings[cached->value];
+      break;
+    case TYPE_PRIMITIVE:
+      if (cached->value >= r->num_strings) return false;
+      value = find_primitive(strval(pointer(r->strings[cached->value])));
+      break;
+    case TYPE_NODE:
+    case TYPE_FUNC:
+      value = reloc(cached->value, r);
+      break;
+    case TYPE_ARG:
+    case TYPE_VAR:
+      if (cached->flags & CACHED_EXTERNAL)
+      {
+        if (cached->value >= r->num_strings) return false;
+        Node name;
+        name.value.u32 = r->strings[cached->value];
+        Node * entry = lookup_internal(context->environment, &name);
+        if (entry == NIL) entry = lookup_internal(context->macros, &name);
+        if (entry == NIL) return false;
+        value = entry->value.u32;
+      }
+      else value = reloc(cached->value, r);
+      break;
+    default:
+      break;
+  }
+  if (value < 0) return false;
+
+  node->value.u32 = value;
+  return true;
+}
+
+/**
+ * Load from the cache file if it is up to date.
+ * Returns false if not, without having loaded anything.
+ */
+static bool load_cache(const char * path, const char * cache_path, struct stat * st)
+{
+  FILE * file = fopen(cache_path, "rb");
+  if (file == NULL) return false;
+
+  struct stat cache_st;
+  fstat(fileno(file), &cache_st);
+  CacheReader in = { malloc(cache_st.st_size), 0, cache_st.st_size };
+  bool complete = fread(in.data, 1, in.len, file) == in.len;
+  fclose(file);
+
+  CacheHeader * header = take(&in, sizeof(CacheHeader));
+  char * cached_path = header == NULL ? NULL : take(&in, header->path_len);
+  if (!complete || cached_path == NULL
+    || memcmp(header->magic, CACHE_MAGIC, 4) != 0
+    || header->format != CACHE_FORMAT
+    || strncmp(header->version, UNPAIR_VERSION, sizeof(header->version)) != 0
+    || header->mtime_sec != st->st_mtim.tv_sec
+    || header->mtime_nsec != st->st_mtim.tv_nsec
+    || header->size != st->st_size
+    || header->path_len != strlen(path)
+    || memcmp(cached_path, path, header->path_len) != 0)
+  {
+    free(in.data);
+    return false;
+  }
+
+  uint32_t * strings = malloc(sizeof(uint32_t) * header->num_strings);
+  for (uint32_t i=0; i<header->num_strings; i++)
+  {
+    uint32_t * len = take(&in, sizeof(uint32_t));
+    char * chars = len == NULL ? NULL : take(&in, *len);
+    if (chars == NULL)
+    {
+      free(strings);
+      free(in.data);
+      return false;
+    }
+    strings[i] = index(unique_chars(chars, *len));
+  }
+
+  uint32_t form_num;
+  for (form_num = 0; form_num < header->num_forms; form_num++)
+  {
+    FormHeader * form = take(&in, sizeof(FormHeader));
+    CachedNode * cached = form == NULL ? NULL : take(&in, sizeof(CachedNode) * form->num_nodes);
+    if (cached == NULL || form->num_env_defs + form->num_macro_defs > form->num_nodes) break;
+
+    Node ** nodes = malloc(sizeof(Node *) * form->num_nodes);
+    for (uint32_t i=0; i<form->num_nodes; i++)
+      nodes[i] = new_node(TYPE_INT, 0);
+
+    // Chain in the definitions in their original order
+    Node * env = context->environment;
+    Node * macro_env = context->macros;
+    for (int64_t i=(int64_t) form->num_env_defs - 1; i>=0; i--)
+      env = chain(TYPE_NODE, index(nodes[i]), env);
+    for (int64_t i=(int64_t) form->num_env_defs + form->num_macro_defs - 1; i>=form->num_env_defs; i--)
+      macro_env = chain(TYPE_NODE, index(nodes[i]), macro_env);
+
+    Relocation r = { nodes, form->num_nodes, strings, header->num_strings, env };
+    bool ok = form->kind == FORM_EVAL || form->kind == FORM_DEFINED;
+    for (uint32_t i=0; ok && i<form->num_nodes; i++)
+      ok = relocate(&cached[i], nodes[i], &r);
+    int64_t root = form->kind == FORM_EVAL ? reloc(form->root, &r) : 0;
+    free(nodes);
+
+    if (!ok || root < 0)
+    {
+      // E.g. a variable defined elsewhere has gone;
+      // the nodes allocated so far are left to GC
+      break;
+    }
+
+    context->environment = env;
+    context->macros = macro_env;
+
+    Node * node = pointer(root);
+    if (form->kind == FORM_EVAL && !node->special) eval(node, context->environment);
+  }
+
+  bool done = form_num == header->num_forms;
+  free(strings);
+  free(in.data);
+
+  // Carry on from source where the cache failed us
+  if (!done) load_source(path, form_num, NULL);
+  return true;
+}
+
+bool load_file(const char * path)
+{
+  struct stat st;
+  if (stat(path, &st) != 0) return false;
+
+  char cache_path[strlen(path) + 7];
+  sprintf(cache_path, "%s.cache", path);
+
+  bool use_cache = getenv("UNPAIR_NO_CACHE") == NULL;
+  if (use_cache && load_cache(path, cache_path, &st)) return true;
+
+  Cache cache = { {0}, {0}, {0}, 0, use_cache };
+  bool loaded = load_source(path, 0, &cache);
+  if (loaded && cache.ok) write_cache(&cache, path, cache_path, &st);
+
+  free(cache.forms.data);
+  map_free(&cache.strings);
+  map_free(&cache.env_nodes);
+  return loaded;
+}
+
+Node * load(Node * args, Node ** env)
+{
+  if (args->type != TYPE_STRING)
+  {
+    printf("Runtime error: load expects a file name string.\n");
+    return pointer_to(NIL);
+  }
+
+  char * path = string_chars(args);
+  if (!load_file(path))
+  {
+    printf("Runtime error: cannot load '%s'.\n", path);
+    return pointer_to(NIL);
+  }
+  return pointer_to(NIL+1);
+}
@@ -0,0 +1,27 @@
+#ifndef LOAD_H
+#define LOAD_H
+
+#include <stdbool.h>
+
+#include "node.h"
+
+#define UNPAIR_VERSION "1"
+
+/**
+ * Load (parse, transform and eval) all forms in a source file into the
+ * global environment.
+ *
+ * The transformed forms (and for definitions of lambdas and constants,
+ * their values) are cached in '<path>.cache', keyed by path, modification
+ * time, size and interpreter version; later loads relocate the cached forms
+ * into memory instead of parsing and transforming again.
+ * Set UNPAIR_NO_CACHE to bypass the cache.
+ *
+ * Returns false if the file could not be read.
+ */
+bool load_file(const char * path);
+
+// (load "file.lisp")
+Node * load(Node * args, Node ** env);
+
+#endif /* LOAD_H */
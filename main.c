@@ -15,6 +15,12 @@
 
 #include "gc.h"
 #include "primitive.h"
+#include "load.h"
+#include "pmap.h"
+#include "batch.h"
+#include "serve.h"
+#include "stats.h"
+#include "profile.h"
 
 // An attempt at lambda-calculus style boolean values.
 // They are at memory locations 0 (false, empty list, NIL) and 1 (true)
@@ -49,29 +55,17 @@ void make_boolean(Node * slot)
   slot->type = enclosed->type;
 }
 
-Node * nil;
-Node * truth;
-Node * environment;
-Node * macros;
-Node * unique_strings;
-
 void repl(FILE * file, bool show_results)
 {
   // REPL!
-  infile = file;
-  bool interactive = isatty(fileno(infile));
+  set_infile(file);
+  bool interactive = isatty(fileno(file));
 
   Node * node;
   do
   {
     // GC
-    int marked = 0;
-    marked += mark(nil);
-    marked += mark(truth);
-    marked += mark(environment);
-    marked += mark(macros);
-    marked += mark(unique_strings);
-    freelist = sweep();
+    collect_garbage();
 
     if (interactive) {
       printf("> ");
@@ -82,11 +76,11 @@ void repl(FILE * file, bool show_results)
     if (node == NULL) continue;
 
     // Compile
-    node = transform(node, &environment, environment);
+    node = transform(node, &context->environment, context->environment);
     // In case of compilation error:
     if (node == NULL) continue;
 
-    if (!node->special) node = eval(node, environment);
+    if (!node->special) node = eval(node, context->environment);
 
     if (show_results) print(node);
 
@@ -95,33 +89,61 @@ void repl(FILE * file, bool show_results)
 
 int main(int argc, char ** argv)
 {
+  // unpair --batch DIR [--jobs N] [--results FILE]
+  // unpair --serve SOCKET
+  // unpair --connect SOCKET < request
+  // unpair --alloc-profile
+  // unpair --profile FILE
+  // unpair --call-stats
+  const char * batch_dir = NULL;
+  const char * results = "batch-results.jsonl";
+  const char * serve = NULL;
+  int jobs = 0;
+  bool alloc_profile = false;
+  bool call_stats = false;
+  const char * profile = NULL;
+  for (int i=1; i<argc; i++)
+  {
+    if (strcmp(argv[i], "--alloc-profile") == 0) alloc_profile = true;
+    else if (strcmp(argv[i], "--call-stats") == 0) call_stats = true;
+    else if (i+1 == argc) break;
+    else if (strcmp(argv[i], "--batch") == 0) batch_dir = argv[++i];
+    else if (strcmp(argv[i], "--jobs") == 0) jobs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--results") == 0) results = argv[++i];
+    else if (strcmp(argv[i], "--serve") == 0) serve = argv[++i];
+    else if (strcmp(argv[i], "--profile") == 0) profile = argv[++i];
+    else if (strcmp(argv[i], "--connect") == 0) return run_client(argv[++i]); // no interpreter needed
+    else break;
+  }
+
   // Setup
-  init_node_memory();
-
-  // Make placeholders for false & true
-  nil = new_node(TYPE_NODE, 0); // must add this because index value zero is used as nil
-  nil->element = false;
-  truth = new_node(TYPE_INT, 1);
-  // ...and start using them!
-  environment = nil;
-  macros = nil;
-  unique_strings = nil;
-  // Fill placeholders (optional functionality; you can comment these out!)
-  make_boolean(nil);
-  make_boolean(truth);
-
-  FILE * lib = fopen("lib.lisp", "r");
-  repl(lib, false);
-  fclose(lib);
+  use_context(new_context());
+  init_primitives();
+
+  // Fill placeholders for false & true (optional functionality; you can comment these out!)
+  make_boolean(&memory[0]);
+  make_boolean(&memory[1]);
+
+  if (!load_file("lib.lisp")) printf("Cannot load lib.lisp\n");
+
+  if (batch_dir != NULL) return run_batch(batch_dir, jobs > 0 ? jobs : configured_threads(), results);
+  if (serve != NULL) return run_server(serve);
 
   if (isatty(fileno(stdin))) {
-    printf("\n     **** UNPAIR LISP v1 ****\n");
-    printf("\n %lu BYTE NODE SYSTEM %ld NODES USED\n", sizeof(Node), memsize);
+    printf("\n     **** UNPAIR LISP v%s ****\n", UNPAIR_VERSION);
+    printf("\n %lu BYTE NODE SYSTEM %ld NODES USED\n", sizeof(Node), context->memsize);
     printf("\nREADY.\n");
   }
 
+  // Profile the program, not the set-up
+  alloc_profiling = alloc_profile;
+  call_counting = call_stats;
+  if (profile != NULL) start_profile();
   repl(stdin, true);
 
   printf("\n"); // neatly exit on a clear line
+  if (profile != NULL && !write_profile(profile)) fprintf(stderr, "Cannot write %s\n", profile);
+  if (alloc_profile) print_alloc_profile(stderr);
+  if (call_stats) print_call_stats(stderr);
   return 0;
 }
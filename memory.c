@@ -3,10 +3,16 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #include "node.h"
 #include "memory.h"
 #include "print.h"
+#include "future.h"
+#include "stream.h"
+#include "stats.h"
+#include "region.h"
 
 //
 // MEMORY
@@ -16,18 +22,81 @@
  * We must do at least a bit of our own memory management
  * on nodes, so that we may also GC them.
  */
-Node * memory;
-Node * freelist;
+__thread Context * context;
+__thread Node * memory;
 
-uintptr_t memsize;
+Context * new_context()
+{
+  Context * ctx = calloc(1, sizeof(Context));
 
-#define chunksize 1024
+  // Node pointers are held all over the place, so memory must never move.
+  // As 'next' can't address beyond MAX_NODES anyway, just reserve all of
+  // that address space up front, and let the OS supply pages as we go.
+  ctx->memory = mmap(NULL, sizeof(Node) * MAX_NODES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ctx->memory == MAP_FAILED)
+  {
+    printf("Fatal: cannot reserve node memory\n");
+    exit(1);
+  }
+
+  // Make placeholders for false & true
+  Node * nil = init_node(&ctx->memory[0], TYPE_NODE, 0, false); // index value zero is used as nil
+  nil->element = false;
+  init_node(&ctx->memory[1], TYPE_INT, 1, false);
+  ctx->memsize = 2;
+
+  ctx->freelist = nil;
+  ctx->environment = nil;
+  ctx->macros = nil;
+  ctx->unique_strings = nil;
+  retire_buffers(ctx);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&ctx->heap_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return ctx;
+}
 
-void init_node_memory()
+void use_context(Context * ctx)
 {
-  memory = malloc(sizeof(Node) * chunksize);
-  memsize = 0;
-  freelist = NIL;
+  context = ctx;
+  memory = ctx->memory;
+}
+
+void free_context(Context * ctx)
+{
+  if (context == ctx)
+  {
+    context = NULL;
+    memory = NULL;
+  }
+  free_futures(ctx);
+  free_generators(ctx);
+  munmap(ctx->memory, sizeof(Node) * MAX_NODES);
+  pthread_mutex_destroy(&ctx->heap_lock);
+  free(ctx->string_index);
+  free(ctx);
+}
+
+static inline bool is_shared()
+{
+  return __atomic_load_n(&context->sharing, __ATOMIC_ACQUIRE) != 0;
+}
+
+// While other threads share the context, the unique strings are guarded.
+// The lock is recursive, as the string functions call one another.
+static inline bool lock_heap()
+{
+  if (!is_shared()) return false;
+  pthread_mutex_lock(&context->heap_lock);
+  return true;
+}
+
+static inline void unlock_heap(bool locked)
+{
+  if (locked) pthread_mutex_unlock(&context->heap_lock);
 }
 
 Node * init_node(Node * node, Type type, uint32_t value, bool array)
@@ -44,10 +113,10 @@ Node * init_node(Node * node, Type type, uint32_t value, bool array)
 }
 
 /**
- * Resize a (free) node into something smaller,
- * and chain in the newly created remainder node.
+ * Resize a (free) node into something smaller, where it is, and return
+ * the newly created remainder node, on its own.
  */
-int resize(Node * node, int oldsize, int newsize)
+Node * resize(Node * node, int oldsize, int newsize)
 {
   // Say oldsize = 3, newsize = 2:
   int node2size = oldsize - newsize;
@@ -71,11 +140,112 @@ int resize(Node * node, int oldsize, int newsize)
   }
   else node2->array = false;
 
+  node2->next = 0;
+  return node2;
+}
+
+/**
+ * While the context is shared, every thread allocates from a buffer of
+ * its own: a run of free nodes taken off the free list under the heap
+ * lock, or else a chunk of nodes that it carved from the end of memory
+ * with an atomic bump of 'memsize'. So threads do not wait on one
+ * another, save for the odd refill.
+ *
+ * Chunks are cleared up front, so that whatever a thread leaves unused
+ * reads as free nodes to the GC. As the GC then hands them out, it
+ * retires all buffers by starting a new epoch.
+ */
+typedef struct Buffer {
+  Context * context;
+  uint64_t epoch;
+  uintptr_t next;
+  uintptr_t end;
+} Buffer;
+
+static __thread Buffer buffer;
+static uint64_t epochs;
+
+#define BUFFER_NODES 512
+// Larger blocks are carved directly
+#define MAX_BUFFERED (BUFFER_NODES / 8)
+
+void retire_buffers(Context * ctx)
+{
+  ctx->epoch = __atomic_add_fetch(&epochs, 1, __ATOMIC_RELAXED);
+}
+
+static void out_of_memory()
+{
+  printf("Fatal: out of node memory (memsize=%ld)\n", context->memsize);
+  exit(1);
+}
+
+static Node * carve(uint32_t n)
+{
+  uintptr_t start = __atomic_fetch_add(&context->memsize, n, __ATOMIC_RELAXED);
+  if (start + n > MAX_NODES) out_of_memory();
+  return &memory[start];
+}
 
-  node2->next = node->next;
-  node->next = index(node2);
+/**
+ * Take the run of adjacent free blocks at the head of the free list,
+ * of up to about BUFFER_NODES nodes. As the GC merges adjacent garbage
+ * into single blocks, that of an earlier run of 'pmap' comes out in long
+ * runs.
+ */
+static uintptr_t take_free_run(Node ** start)
+{
+  pthread_mutex_lock(&context->heap_lock);
 
-  return newsize;
+  Node * low = context->freelist;
+  uintptr_t size = 0;
+  if (low != NIL && node_size(low) > BUFFER_NODES)
+  {
+    // Take no more than a buffer's worth
+    low = resize(low, node_size(low), node_size(low) - BUFFER_NODES);
+    size = BUFFER_NODES;
+  }
+  else if (low != NIL)
+  {
+    uintptr_t high = index(low) + node_size(low);
+    while (true)
+    {
+      Node * below = pointer(low->next);
+      if (below == NIL || index(below) + node_size(below) != index(low)) break;
+      if (high - index(below) > BUFFER_NODES) break;
+      low = below;
+    }
+    context->freelist = pointer(low->next);
+    size = high - index(low);
+  }
+
+  pthread_mutex_unlock(&context->heap_lock);
+  *start = low;
+  return size;
+}
+
+static Node * allocate_buffered(uint32_t n)
+{
+  if (n > MAX_BUFFERED) return carve(n);
+
+  if (buffer.context != context || buffer.epoch != context->epoch || buffer.end - buffer.next < n)
+  {
+    Node * chunk;
+    uintptr_t size = take_free_run(&chunk);
+    if (size > 0) memset(chunk, 0, sizeof(Node) * size);
+    if (size < n)
+    {
+      // What little there was, is garbage to the GC again
+      chunk = carve(BUFFER_NODES);
+      size = BUFFER_NODES;
+      memset(chunk, 0, sizeof(Node) * size);
+    }
+    buffer = (Buffer) { context, context->epoch, index(chunk), index(chunk) + size };
+  }
+
+  Node * node = &memory[buffer.next];
+  buffer.next += n;
+  return node;
 }
 
 /**
@@ -83,15 +253,65 @@ int resize(Node * node, int oldsize, int newsize)
  */
 Node * allocate_node()
 {
-  if(memsize%chunksize == 0)
+  return allocate_nodes(1);
+}
+
+/**
+ * Allocate 'n' consecutive un-initialized nodes at end of memory.
+ */
+Node * allocate_nodes(uint32_t n)
+{
+  if (is_shared()) return allocate_buffered(n);
+
+  if(n > MAX_NODES - context->memsize) out_of_memory();
+  Node * node = &memory[context->memsize];
+  context->memsize += n;
+  return node;
+}
+
+static inline void count_nodes(uint32_t n)
+{
+  if (is_shared()) __atomic_fetch_add(&context->nodes_allocated, n, __ATOMIC_RELAXED);
+  else context->nodes_allocated += n;
+  if (alloc_profiling) count_allocation(n);
+}
+
+// Free blocks that best_fit looks at, short of an exact fit
+#define MAX_FIT_SEARCH 64
+
+/**
+ * Take n adjacent nodes from the smallest free block that holds them,
+ * among the first few on the free list. As the GC merges runs of garbage
+ * into single blocks, the head of the list is usually large enough. A
+ * larger block gives up its last n nodes, and keeps its place on the list.
+ */
+static Node * best_fit(uint32_t n)
+{
+  if (is_shared() || open_regions > 0) return NULL;
+
+  Node * before = NIL, * best_before = NIL, * best = NULL;
+  uintptr_t best_size = 0;
+  Node * block = context->freelist;
+  for (int i=0; i<MAX_FIT_SEARCH && block != NIL; i++)
   {
-    Node * mem_old = memory;
-    memory = realloc(memory, sizeof(Node) * (memsize+chunksize));
-    if (mem_old != memory) printf("WARN: memory moved (memsize=%ld). This invalidates all pointers, which we presently can't handle!\n", memsize);
+    uintptr_t size = node_size(block);
+    if (size >= n && (best == NULL || size < best_size))
+    {
+      best = block;
+      best_before = before;
+      best_size = size;
+      if (size == n) break;
+    }
+    before = block;
+    block = pointer(block->next);
   }
-  Node * node = &memory[memsize];
-  memsize++;
-  return node;
+  if (best == NULL) return NULL;
+
+  if (best_size > n) return resize(best, best_size, best_size - n);
+
+  if (best_before != NIL) best_before->next = best->next;
+  else context->freelist = pointer(best->next);
+  return best;
 }
 
 /**
@@ -103,42 +323,32 @@ Node * new_node(Type type, uint32_t value)
   // Uncomment to temporarily disable memory reclamation.
   //return init_node(allocate_node(), type, value);
 
-  Node * before = NIL;
-  Node * reclaimable = freelist;
-  // Be lazy and preserve free array entries for re-use as arrays
-  while (reclaimable != NIL && reclaimable->array)
-  {
-    before = reclaimable;
-    reclaimable = pointer(reclaimable->next);
-  }
-
-  //return init_node(allocate_node(), type, value);
+  count_nodes(1);
+  if (is_shared()) return init_node(allocate_node(), type, value, false);
+  // Keep all that is made in a region past its mark
+  if (open_regions > 0) return init_node(allocate_node(), type, value, false);
 
-  Node * result;
-  if (reclaimable != NIL)
-  {
-    //printf("Reclaiming %ld %d\n", index(reclaimable), reclaimable->next);
-    if(before != NIL) before->next = reclaimable->next; // unlink item from freelist
-    else freelist = pointer(freelist->next); // at start of freelist; move one up
-    result = reclaimable;
-  }
-  else result = allocate_node();
+  // Any free block will do; take it off the end of the first one
+  Node * result = context->freelist;
+  if (result == NIL) result = allocate_node();
+  else if (result->array) result = resize(result, node_size(result), node_size(result) - 1);
+  else context->freelist = pointer(result->next);
 
   return init_node(result, type, value, false);
 }
 
 /**
- * Return a stretchable node at end of memory.
- * Allocates the node space required to host the amount of bytes
- * marked by 'value'.
+ * Return a stretchable node, from a free block if one fits, or else at
+ * end of memory. Allocates the node space required to host the amount
+ * of bytes marked by 'value'.
  */
 Node * new_array_node(Type type, uint32_t value)
 {
-  Node * result = init_node(allocate_node(), type, value, true);
-  // Allocate any overflow nodes
-  for (int i=0; i< num_value_nodes(result); i++)
-    allocate_node();
-  return result;
+  uint32_t n = 1 + (value + 7) / sizeof(Node); // including any overflow nodes
+  count_nodes(n);
+  Node * result = best_fit(n);
+  if (result == NULL) result = allocate_nodes(n);
+  return init_node(result, type, value, true);
 }
 
 // Try to move the last created note into an existing slot.
@@ -149,42 +359,22 @@ Node * retrofit (Node * node)
   // Uncomment to temporarily disable retrofitting.
   //return node;
 
-  Node * available = freelist;
-  Node * before = NIL;
-
-  int size_required = 1;
-  if(node->array) size_required += num_value_nodes(node);
-
-  if ((node-memory) + size_required != memsize) printf("Strange! %ld %ld\n", (node-memory)+size_required, memsize);
-  recurse:
-
-  if (available == NIL) return node;
-
-  int size_available = 1;
-  if(available->array) size_available += num_value_nodes(available);
-
-  if (size_available > size_required)
-    size_available = resize(available, size_available, size_required);
-
-  if (size_available == size_required)
-  {
-    //printf("Retrofitting; size=%d\n", size_required);print(node);
-    if (before != NIL) before->next = available->next; // unchain result from freelist
-    else  freelist = pointer(freelist->next); // at start of freelist; just move it one up
+  // Other threads may allocate past the node, and use the free list
+  if (is_shared()) return node;
+  // A region should keep its nodes past its mark
+  if (open_regions > 0) return node;
 
-    Node * result = available;
-    memcpy(result, node, sizeof(Node) * size_required);
-    memsize -= size_required; // yay, successfully reduced memsize using GC!
+  uint32_t size = node_size(node);
 
-    return result;
-  }
+  // Not at the end, if it was recycled from the free list already
+  if ((node-memory) + size != context->memsize) return node;
 
-  // else
-  //printf("(%d != %d)", size_available, size_required);
-  before = available;
-  available = pointer(available->next);
+  Node * result = best_fit(size);
+  if (result == NULL) return node;
 
-  goto recurse;
+  memcpy(result, node, sizeof(Node) * size);
+  context->memsize -= size; // yay, successfully reduced memsize using GC!
+  return result;
 }
 
 /**
@@ -197,14 +387,14 @@ Node * copy(Node * node, int n_recurse)
 {
   if (node == NULL) return NULL;
 
-  // Since 'new_node' presently reclaims single nodes only,
-  // just allocate space for copying arrays at end.
-  // Though sub-optimal as a final solution,
-  // we can for now try to retrofit the result.
+  // Copies that these make on their own behalf are theirs
+  bool owned = alloc_site == SITE_TEMPLATE || alloc_site == SITE_ELEMENT || alloc_site == SITE_EVAL_AND_CHAIN;
+  begin_alloc_site(owned ? alloc_site : SITE_COPY);
+
+  // Arrays take the best fitting free block there is, if any
   Node * result = node->array ? new_array_node(node->type, node->value.u32) : new_node(node->type, node->value.u32);
 
-  int num_nodes = 1;
-  if (node->array) num_nodes += num_value_nodes(node);
+  int num_nodes = node_size(node);
   memcpy(result, node, sizeof(Node) * num_nodes);
 
   if (n_recurse != 0 && node->next != 0)
@@ -212,9 +402,8 @@ Node * copy(Node * node, int n_recurse)
   else
     result->next = 0; // TODO this is unexpected behaviour in some cases
 
-  // Only try retrofit if we know the result is at top of memory!
-  if (node->array) return retrofit(result);
-  else return result;
+  end_alloc_site();
+  return result;
 }
 
 /**
@@ -225,9 +414,11 @@ Node * element(Node * node)
 {
   if (!node->element)
   {
+    begin_alloc_site(SITE_ELEMENT);
     node = copy(node, 0);
     node->element = true;
     node->next = 0;
+    end_alloc_site();
   }
   return node;
 }
@@ -310,23 +501,106 @@ Node * make_char_array_node(char * val)
   return node;
 }
 
+/**
+ * The hash index over 'unique_strings' lets interning skip walking the
+ * whole list. It holds node indices; 0 (= NIL) marks an empty slot.
+ * As unique strings are never freed or moved, the index stays valid.
+ */
+uint32_t hash_chars(const char * chars, size_t len)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (size_t i=0; i<len; i++) h = (h ^ (uint8_t) chars[i]) * 16777619u;
+  return h;
+}
+
+static void insert_string(Node * node)
+{
+  uint32_t i = hash_chars(strval(node), node->value.u32 - 1) & (context->string_index_size - 1);
+  while (context->string_index[i] != 0) i = (i + 1) & (context->string_index_size - 1);
+  context->string_index[i] = index(node);
+  context->num_strings++;
+}
+
+// Add a node just chained into 'unique_strings' to the index
+static void index_string(Node * node)
+{
+  if ((context->num_strings + 1) * 2 <= context->string_index_size)
+  {
+    insert_string(node);
+    return;
+  }
+
+  // Grow, and re-index all (which includes 'node')
+  free(context->string_index);
+  context->string_index_size = context->string_index_size == 0 ? 1024 : context->string_index_size * 2;
+  context->string_index = calloc(context->string_index_size, sizeof(uint32_t));
+  context->num_strings = 0;
+  for (Node * where = context->unique_strings; where != NIL; where = &memory[where->next])
+    insert_string(where);
+}
+
+// Find an existing unique string; or NIL if not found
+static Node * find_string(const char * chars, size_t len)
+{
+  if (context->string_index_size == 0) return NIL;
+
+  uint32_t i = hash_chars(chars, len) & (context->string_index_size - 1);
+  while (context->string_index[i] != 0)
+  {
+    Node * where = &memory[context->string_index[i]];
+    if(where->value.u32 == len + 1 && memcmp(strval(where), chars, len) == 0) return where;
+    i = (i + 1) & (context->string_index_size - 1);
+  }
+  return NIL;
+}
+
 Node * unique_string(Node * val)
 {
-  Node * where = unique_strings;
-  while (where != NIL)
+  bool locked = lock_heap();
+  bool at_top = !is_shared() && index(val) + node_size(val) == context->memsize;
+
+  Node * where = find_string(strval(val), strlen(strval(val)));
+  if (where != NIL)
   {
-    if(strcmp(strval(val), strval(where)) == 0)
-    {
-      // Assume just parsed 'val'; so may remove
-      memsize -= num_value_nodes(val)+1;
-      return where;
-    }
-    where = &memory[where->next];
+    // Assume just parsed 'val'; so may remove
+    if (at_top) context->memsize -= node_size(val);
+    unlock_heap(locked);
+    return where;
   }
 
   // Not found: use given node;
   // Call 'retrofit' now that we know we can afford it
-  val->next = index(unique_strings);
-  unique_strings = retrofit(val);
-  return unique_strings;
+  val->next = index(context->unique_strings);
+  Node * result = at_top ? retrofit(val) : val;
+  context->unique_strings = result;
+  index_string(result);
+  unlock_heap(locked);
+  return result;
+}
+
+/**
+ * Return the item in 'unique_strings' that holds the given characters,
+ * only making a new char array node if there is none yet.
+ */
+Node * unique_chars(const char * chars, size_t len)
+{
+  bool locked = lock_heap();
+  Node * where = find_string(chars, len);
+  if (where != NIL)
+  {
+    unlock_heap(locked);
+    return where;
+  }
+
+  Node * node = new_array_node(TYPE_CHAR, len+1);
+  memcpy(strval(node), chars, len);
+  strval(node)[len] = '\0';
+  node->element = false;
+
+  node->next = index(context->unique_strings);
+  context->unique_strings = node;
+  index_string(node);
+  unlock_heap(locked);
+  return node;
 }
@@ -1,25 +1,113 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
 #include "node.h"
 
-extern Node * memory;
-extern uintptr_t memsize;
+// What a garbage collection did, in nodes; see (gc-stats)
+typedef struct Collection {
+  bool young;
+  uint64_t mark_ns;
+  uint64_t sweep_ns;
+  uintptr_t marked;
+  uintptr_t freed;         // newly on the free list
+  uintptr_t used_before;   // in the heap but not on the free list
+  uintptr_t used_after;
+  uintptr_t memsize;
+  uintptr_t free_blocks;   // on the free list after
+  uint32_t fragmentation;  // percent of the free nodes not in the largest block
+} Collection;
 
-extern Node * freelist;
+/**
+ * All state of one interpreter. Every thread runs the interpreter
+ * of its present context, so that independent interpreters may run
+ * side by side, one per thread.
+ */
+typedef struct Context {
+  Node * memory;
+  uintptr_t memsize;
+  Node * freelist;
+
+  Node * environment;
+  Node * macros;
+  Node * unique_strings;
+
+  // Hash index over 'unique_strings'
+  uint32_t * string_index;
+  uint32_t string_index_size;
+  uint32_t num_strings;
+
+  // Number of other threads presently running in this context, e.g. for
+  // 'pmap'; while there are any, threads allocate from their own buffers,
+  // and the unique strings are guarded by the heap lock
+  int sharing;
+  pthread_mutex_t heap_lock;
+
+  // Allocation buffers taken in an earlier epoch are void
+  uint64_t epoch;
+
+  // Created with the first future, see future.c
+  struct Futures * futures;
+
+  // Generators that may still be resumed, see stream.c
+  struct Generator * generators;
+
+  // Running totals, e.g. for benchmarks; free to reset
+  uint64_t nodes_allocated;   // by new_node and new_array_node
+  uintptr_t peak_memsize;     // as seen by the GC
+  uint64_t collections;
+  uint64_t young_collections;
+  uint64_t lambda_calls;
+  uint64_t primitive_calls;
+  uint64_t mark_ns;
+  uint64_t sweep_ns;
+  uint64_t max_pause_ns;
+  Collection last_collection;
+  uint64_t region_resets;     // see region.h
+  uint64_t region_freed;
+} Context;
+
+extern __thread Context * context;
+
+// The present context's memory, kept at hand
+extern __thread Node * memory;
 
-extern Node * macros;
-extern Node * unique_strings;
+/**
+ * Make a new interpreter, with its own node memory holding
+ * just nil and true. Does not switch to it.
+ */
+Context * new_context();
 
+/**
+ * Run the present thread's interpreter in the given context.
+ */
+void use_context(Context * ctx);
+
+void free_context(Context * ctx);
 
-void init_node_memory();
 Node * copy(Node * node, int n_recurse);
 
+/**
+ * Void all threads' allocation buffers for the context, e.g. as the GC
+ * may hand out their unused nodes.
+ */
+void retire_buffers(Context * ctx);
+
 /**
  * Allocate un-initialized node space at end of memory.
  */
 Node * allocate_node();
 
+/**
+ * Allocate a block of consecutive un-initialized nodes at end of memory.
+ */
+Node * allocate_nodes(uint32_t n);
+
+Node * init_node(Node * node, Type type, uint32_t value, bool array);
+
 /**
  * Initialize a fixed-sized node, either from
  * reclaimed memory or fully new.
@@ -48,12 +136,16 @@ Node * element(Node * node);
 //
 // 'env' functions put here
 //
+Node * lookup_internal(Node * env, Node * name);
 Node * lookup(Node * env, Node * name);
 Node * dereference(Node * env, Node * name, Type type);
 Node * find_macro(Node * env, Node * name);
 
 
 
+// The most nodes that a 24-bit 'next' can address
+#define MAX_NODES (1 << 24)
+
 // NIL == &memory[0]
 #define NIL memory
 
@@ -62,7 +154,16 @@ Node * find_macro(Node * env, Node * name);
 
 #define num_value_nodes(node) ((node->value.u32+7) / 8)
 
+// Nodes taken up by a node, including any overflow nodes of an array
+static inline uintptr_t node_size(Node * node)
+{
+  return node->array ? 1 + num_value_nodes(node) : 1;
+}
+
 Node * make_char_array_node(char * val);
 Node * unique_string(Node * val);
+Node * unique_chars(const char * chars, size_t len);
+// FNV-1a, as used to index the unique strings
+uint32_t hash_chars(const char * chars, size_t len);
 
 #endif /* MEMORY_H */
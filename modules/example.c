@@ -0,0 +1,40 @@
+/**
+ * Example native module. Build with 'make modules/example.so', then:
+ *
+ *   (load-native "./modules/example.so")
+ *   (sum-squares 1 2 3)  ;; yields 14
+ *   (unless (< 1 2) (print "never printed"))
+ */
+#include <stdbool.h>
+
+#include "../node.h"
+#include "../memory.h"
+#include "../eval.h"
+#include "../transform.h"
+#include "../primitive.h"
+
+static Node * sum_squares(Node * args, Node ** env)
+{
+  Node * result = new_node(TYPE_INT, 0);
+  while (args != NIL)
+  {
+    result->value.i32 += args->value.i32 * args->value.i32;
+    args = pointer(args->next);
+  }
+  return result;
+}
+
+// Special primitives receive their args as code
+static Node * unless(Node * test, Node ** env)
+{
+  Node * body = pointer(test->next);
+  test = eval(transform_elem(test, env, *env), *env);
+  if (test->value.u32 != 0) return pointer_to(NIL);
+  return eval(transform_elem(body, env, *env), *env);
+}
+
+void unpair_module_init()
+{
+  register_primitive("sum-squares", -1, false, sum_squares);
+  register_primitive("unless", 2, true, unless);
+}
@@ -13,7 +13,12 @@ char * types[] = {
   "func",
   "arg",
   "var",
-  "primitive"
+  "primitive",
+  "hash",
+  "table",
+  "future",
+  "promise",
+  "generator"
 };
 
 int length(Node * list)
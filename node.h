@@ -13,9 +13,16 @@ typedef enum Type {
   TYPE_FUNC,     // = closure (transformed lambda)
   TYPE_ARG,      // references a per-instance variable (function argument or local 'define')
   TYPE_VAR,      // references the FULL (name val) entry for pre-dereferenced variables.
-  TYPE_PRIMITIVE //
+  TYPE_PRIMITIVE, //
+  TYPE_HASH,     // hash table handle; points to the (array) hash header, see hash.h
+  TYPE_TABLE,    // array of hash table slots
+  TYPE_FUTURE,   // holds the number of a future's task, see future.h
+  TYPE_PROMISE,  // promise handle; points to the (array) promise box, see stream.h
+  TYPE_GENERATOR // generator handle; points to the (array) generator box, see stream.h
 } Type;
 
+#define NUM_TYPES (TYPE_GENERATOR + 1)
+
 extern char * types[];
 
 typedef struct Node {
@@ -3,24 +3,141 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memory.h"
 #include "parse.h"
 #include "print.h"
+#include "stats.h"
+#include "text.h"
 
-int buffer = -2;
+/**
+ * The reader works over a single contiguous buffer: regular files are
+ * memory mapped as a whole, anything else (pipes, the console) is read
+ * in large chunks. Whitespace and tokens are scanned in bulk, and labels,
+ * numbers and strings are converted straight from the buffer, instead of
+ * first being copied char by char into a char array node.
+ */
+typedef struct Reader {
+  int fd;
+  char * data;    // either the mapped file or 'buffer'
+  size_t pos;
+  size_t len;
+  bool mapped;
+  char * buffer;
+  size_t size;    // of 'buffer'
+} Reader;
+
+static __thread Reader reader = { -1, NULL, 0, 0, false, NULL, 0 };
+
+#define READ_CHUNK (64 * 1024)
+
+void set_infile(FILE * file)
+{
+  if (reader.mapped) munmap(reader.data, reader.len);
+
+  reader.fd = fileno(file);
+  reader.data = reader.buffer;
+  reader.pos = 0;
+  reader.len = 0;
+  reader.mapped = false;
+
+  struct stat st;
+  off_t offset = lseek(reader.fd, 0, SEEK_CUR);
+  if (fstat(reader.fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset)
+  {
+    void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader.fd, 0);
+    if (data != MAP_FAILED)
+    {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      reader.data = data;
+      reader.len = st.st_size;
+      reader.pos = offset;
+      reader.mapped = true;
+    }
+  }
+}
+
+void set_instring(const char * chars, size_t len)
+{
+  if (reader.mapped) munmap(reader.data, reader.len);
+
+  // As there is no file, the reader never refills (and so never writes) 'data'
+  reader.fd = -1;
+  reader.data = (char *) chars;
+  reader.pos = 0;
+  reader.len = len;
+  reader.mapped = false;
+}
+
+// Readers suspended by push_infile
+static __thread Reader suspended[MAX_NESTED_INFILES];
+static __thread int num_suspended;
 
-FILE * infile;
-int read_char()
+void push_infile(FILE * file)
 {
-  if (buffer > -2)
-  { int result = buffer; buffer = -2; return result; }
-  return fgetc(infile);
+  if (num_suspended == MAX_NESTED_INFILES)
+  {
+    printf("Fatal: too many nested input files\n");
+    exit(1);
+  }
+
+  suspended[num_suspended++] = reader;
+  reader = (Reader) { -1, NULL, 0, 0, false, NULL, 0 };
+  set_infile(file);
 }
 
-void unread(int ch)
+void pop_infile()
 {
-  buffer = ch;
+  if (reader.mapped) munmap(reader.data, reader.len);
+  free(reader.buffer);
+  reader = suspended[--num_suspended];
+}
+
+/**
+ * Read more input, keeping whatever is in the buffer from 'keep' onwards
+ * (at the start of the buffer). Returns false on end of file.
+ */
+static bool refill(size_t keep)
+{
+  if (reader.mapped || reader.fd < 0) return false;
+
+  size_t kept = reader.len - keep;
+  memmove(reader.buffer, reader.buffer + keep, kept);
+  reader.pos -= keep;
+  reader.len = kept;
+
+  if (reader.size - kept < READ_CHUNK)
+  {
+    reader.size = kept + READ_CHUNK;
+    reader.buffer = realloc(reader.buffer, reader.size);
+  }
+  reader.data = reader.buffer;
+
+  ssize_t n;
+  do n = read(reader.fd, reader.buffer + kept, reader.size - kept);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0) return false;
+  reader.len += n;
+  return true;
+}
+
+static inline int read_char()
+{
+  if (reader.pos == reader.len && !refill(reader.pos)) return -1;
+  return (unsigned char) reader.data[reader.pos++];
+}
+
+static inline void unread(int ch)
+{
+  if (ch != -1) reader.pos--;
 }
 
 static inline bool is_whitespace_char(int ch)
@@ -28,12 +145,91 @@ static inline bool is_whitespace_char(int ch)
   return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
 }
 
+static inline bool is_label_end(int ch)
+{
+  return ch == 0 || ch == ')' || ch == '.' || is_whitespace_char(ch);
+}
+
+#ifdef __SSE2__
+#define match(v, ch) _mm_cmpeq_epi8(v, _mm_set1_epi8(ch))
+
+static inline __m128i match_whitespace(__m128i v)
+{
+  return _mm_or_si128(_mm_or_si128(match(v, ' '), match(v, '\n')), _mm_or_si128(match(v, '\t'), match(v, '\r')));
+}
+#endif
+
+// Return the first non-whitespace char in [p, end), or end
+static const char * skip_whitespace(const char * p, const char * end)
+{
+#ifdef __SSE2__
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    int mask = _mm_movemask_epi8(match_whitespace(v)) ^ 0xFFFF;
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+#endif
+  while (p < end && is_whitespace_char(*p)) p++;
+  return p;
+}
+
+// Return the first char in [p, end) that ends a label, or end
+static const char * find_label_end(const char * p, const char * end)
+{
+#ifdef __SSE2__
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i delimiters = _mm_or_si128(match_whitespace(v),
+      _mm_or_si128(match(v, ')'), _mm_or_si128(match(v, '.'), match(v, 0))));
+    int mask = _mm_movemask_epi8(delimiters);
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+#endif
+  while (p < end && !is_label_end(*p)) p++;
+  return p;
+}
+
+// Return the first quote, backslash or zero in [p, end), or end
+static const char * find_string_end(const char * p, const char * end)
+{
+#ifdef __SSE2__
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(match(v, '\"'), _mm_or_si128(match(v, '\\'), match(v, 0))));
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+#endif
+  while (p < end && *p != '\"' && *p != '\\' && *p != 0) p++;
+  return p;
+}
+
 int read_non_whitespace_char()
 {
-  int ch = read_char();
-  while (ch != -1 && is_whitespace_char(ch))
-    ch = read_char();
-  return ch;
+  while (true)
+  {
+    const char * p = skip_whitespace(reader.data + reader.pos, reader.data + reader.len);
+    reader.pos = p - reader.data;
+    if (reader.pos < reader.len) return (unsigned char) reader.data[reader.pos++];
+    if (!refill(reader.pos)) return -1;
+  }
+}
+
+static void skip_line()
+{
+  while (true)
+  {
+    char * p = memchr(reader.data + reader.pos, '\n', reader.len - reader.pos);
+    if (p != NULL)
+    {
+      reader.pos = p - reader.data + 1;
+      return;
+    }
+    reader.pos = reader.len;
+    if (!refill(reader.pos)) return;
+  }
 }
 
 Node * parse_value(int ch);
@@ -42,6 +238,11 @@ Node * parse_nodes()
 {
   int ch = read_non_whitespace_char();
   if (ch == ')') return NIL;
+  if (ch == -1)
+  {
+    printf("Parse error: unexpected end of file in list\n");
+    return NIL;
+  }
 
   // else
   Node * val = parse_value(ch);
@@ -80,132 +281,121 @@ char * escapes = "nrtf";
 char * replacements = "\n\r\t\f";
 int escapes_length = 4;
 
+// Collects string literal contents, which may need unescaping
+static __thread char * scratch;
+static __thread size_t scratch_size;
+
+static void add_chars(size_t * idx, const char * chars, size_t len)
+{
+  if (*idx + len > scratch_size)
+  {
+    scratch_size = (*idx + len) * 2;
+    scratch = realloc(scratch, scratch_size);
+  }
+  memcpy(scratch + *idx, chars, len);
+  *idx += len;
+}
+
 // assumes opening quote is already parsed
 Node * parse_string()
 {
-  Node * result = new_array_node(TYPE_CHAR, 0);
-
-  int idx = 0;
-
-  char * value_node = NULL;
-  int chars_per_node = sizeof(Node);
+  size_t idx = 0;
 
-  int ch = read_char();
-  while
-  (
-    ch != -1 && ch != 0 && ch != '\"'
-  )
+  while (true)
   {
+    const char * start = reader.data + reader.pos;
+    const char * end = find_string_end(start, reader.data + reader.len);
+    add_chars(&idx, start, end - start);
+    reader.pos = end - reader.data;
+
+    int ch = read_char();
+    if (ch == -1 || ch == 0 || ch == '\"') break;
     if (ch == '\\')
     {
       ch = read_char();
+      if (ch == -1) break;
       for (int i=0; i<escapes_length; i++)
         if (escapes[i] == ch) { ch = replacements[i]; break; }
-    }
-
-    if (idx % sizeof(Node) == 0) value_node = (char *) allocate_node();
-
-    value_node[idx % chars_per_node] = ch;
-    idx++;
 
-    ch = read_char();
+      char c = ch;
+      add_chars(&idx, &c, 1);
+    }
+    // else: end of buffer was reached and refilled; go on scanning
+    else unread(ch);
   }
 
-  if (idx % sizeof(Node) == 0) value_node = (char *) allocate_node();
-  value_node[idx % chars_per_node] = '\0';
-  idx++;
-  result->value.u32 = idx; // set size
-  result->array = true;
-
-  // Now add pointer to String result
-  result = unique_string(result);
-  return new_node(TYPE_STRING, index(result));
+  // Strings are not interned, as labels are
+  return new_string(scratch, idx);
 }
 
-Node * parse_label(int ch)
+/**
+ * Scan the label that starts at the present position, leaving the
+ * position at its end. As the buffer may be refilled on the way,
+ * the label's start is returned, and its length in 'len'.
+ */
+static const char * scan_label(size_t * len)
 {
-  if (ch == -1) return NULL;
-  Node * result = new_array_node(TYPE_CHAR, 0);
-
-  int idx = 0;
-
-  char * value_node = NULL;
-  int chars_per_node = sizeof(Node);
-
-  while
-  (
-    ch != -1 && ch != 0 && ch != ')' && ch != '.'
-    && !is_whitespace_char(ch)
-  )
-  {
-    if (idx % chars_per_node == 0) value_node = (char *) allocate_node();
-
-    value_node[idx % chars_per_node] = ch;
-    idx++;
-
-    ch = read_char();
-  }
-
-  if (idx == 0)
+  size_t start = reader.pos;
+  while (true)
   {
-    printf("Parse error: expected label; got '%c'.\n", ch);
-    return &memory[0];
+    const char * end = find_label_end(reader.data + reader.pos, reader.data + reader.len);
+    reader.pos = end - reader.data;
+    if (reader.pos < reader.len || !refill(start)) break;
+    start = 0;
   }
-  // else
-  unread(ch);
-  if (idx % sizeof(Node) == 0) value_node = (char *) allocate_node();
-  value_node[idx % chars_per_node] = '\0';
-  idx++;
-  result->value.u32 = idx; // set size
-
-  // Further processing is done by parse_label_or_number
-  // (depending on what it parses at)
-  return result;
+  *len = reader.pos - start;
+  return reader.data + start;
 }
 
-Node * parse_label_or_number (int c, int radix)
+/**
+ * Parse a number directly from the characters of a label.
+ * Returns false if the label is not a number.
+ */
+static bool parse_number(const char * str, size_t len, int radix, Node ** result)
 {
-  Node * node = parse_label(c);
-  if (node == NULL) return NULL;
-
-  char * str = strval(node);
-
-  intptr_t result = 0;
+  intptr_t value = 0;
   int sign = 1;
 
-  int i=0;
-  if (str[i] == '-' && str[i+1] != 0)
+  size_t i=0;
+  if (len > 1 && str[i] == '-')
   {
     sign = -1;
     i++;
   }
-  while (str[i] != 0)
+  for (; i<len; i++)
   {
-    int intval = str[i++] - '0'; // presently only supporting radices up to 10
+    int intval = str[i] - '0'; // presently only supporting radices up to 10
+    if (intval < 0 || intval >= radix) return false;
+    value = (value * radix) + intval;
+  }
+  value *= sign;
 
-    if (intval < 0 || intval >= radix)
-    {
-      // Give up trying to parse label as int;
-      // Return label as pointer to char array
-      node = unique_string(node);
-      return new_node(TYPE_ID, index(node));
-    }
+  *result = new_node(TYPE_INT, 0);
+  if (value > INT32_MAX) (*result)->value.u32 = value;
+  else (*result)->value.i32 = value;
+  return true;
+}
 
-    result = (result * radix) + intval;
-  }
-  result *= sign;
+Node * parse_label_or_number (int ch, int radix)
+{
+  if (ch == -1) return NULL;
 
-  // Made it up to here; we have a number!
-  // Replace character-array node value with numeric value.
-  // Delete any nodes that were used to hold the string value.
-  memsize -= num_value_nodes(node);
+  unread(ch);
+  size_t len;
+  const char * str = scan_label(&len);
 
-  node->type = TYPE_INT;
-  node->array = false;
-  if (result > INT32_MAX) node->value.u32 = result;
-  else node->value.i32 = result;
+  if (len == 0)
+  {
+    reader.pos++; // skip the offending char
+    printf("Parse error: expected label; got '%c'.\n", ch);
+    return &memory[0];
+  }
+
+  Node * result;
+  if (parse_number(str, len, radix, &result)) return result;
 
-  return retrofit(node);
+  // Not a number; return label as pointer to char array
+  return new_node(TYPE_ID, index(unique_chars(str, len)));
 }
 
 /**
@@ -215,7 +405,7 @@ Node * parse_label_or_number (int c, int radix)
  */
 Node * parse_quote()
 {
-  Node * quote = new_node(TYPE_ID, index(unique_string(make_char_array_node("quote"))));
+  Node * quote = new_node(TYPE_ID, index(unique_chars("quote", 5)));
   quote->element = false;
 
   Node * val = parse();
@@ -227,10 +417,7 @@ Node * parse_quote()
 Node * parse_value(int ch)
 {
   while (ch == ';') {
-    // skip line
-    do ch = read_char();
-    while (ch != -1 && ch != '\n');
-
+    skip_line();
     ch = read_non_whitespace_char();
   }
 
@@ -242,5 +429,8 @@ Node * parse_value(int ch)
 
 Node * parse()
 {
-    return parse_value(read_non_whitespace_char());
+    begin_alloc_site(SITE_PARSER);
+    Node * result = parse_value(read_non_whitespace_char());
+    end_alloc_site();
+    return result;
 }
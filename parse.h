@@ -1,11 +1,19 @@
 #ifndef PARSE_H
 #define PARSE_H
 
+#include <stdio.h>
+
 #include "node.h"
 
-// First set the (open) file
-extern FILE * infile;
+// First set the (open) file, or the characters to parse
+void set_infile(FILE * file);
+void set_instring(const char * chars, size_t len);
 // Then call parse
 Node * parse();
 
+// Temporarily read from another file, e.g. for 'load'
+#define MAX_NESTED_INFILES 16
+void push_infile(FILE * file);
+void pop_infile();
+
 #endif /* PARSE_H */
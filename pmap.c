@@ -0,0 +1,200 @@
+/**
+ * Data-parallel 'map' over a fixed pool of worker threads.
+ *
+ * (pmap f list) applies f to every item, like 'map' does, but lets the
+ * pool's workers join in: they claim chunks of the items until all are
+ * done, running in the caller's context. The results are then chained
+ * into a list in the original order.
+ *
+ * While workers share the context, allocation takes the context's heap
+ * lock (see memory.c). GC only runs between top-level forms, so never
+ * during a 'pmap'. As the heap is shared, f should be free of side
+ * effects; the pool serves one 'pmap' at a time, and a 'pmap' nested
+ * within another runs on the calling thread only.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "node.h"
+#include "memory.h"
+#include "eval.h"
+#include "pmap.h"
+
+// Items per chunk are chosen so that every thread gets this many chunks
+#define CHUNKS_PER_THREAD 4
+
+typedef struct Job {
+  Context * context;
+  Node * func;
+  Node * env;
+  Node ** items;
+  Node ** results;
+  uint32_t count;
+  uint32_t chunk;
+  uint32_t claimed; // items handed out so far
+  int helpers;      // workers that may still join
+  int active;       // threads working on the job
+} Job;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_posted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_finished = PTHREAD_COND_INITIALIZER;
+static Job * current_job;
+static uint64_t num_jobs;
+
+// Taken for the duration of a job, so that only one runs at a time
+static pthread_mutex_t serving = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t pool_started = PTHREAD_ONCE_INIT;
+static int num_workers;
+static int max_threads;
+
+static __thread bool in_pmap;
+
+static void run_job(Job * job)
+{
+  Context * own = context;
+  bool nested = in_pmap;
+  use_context(job->context);
+  in_pmap = true;
+
+  while (true)
+  {
+    uint32_t start = __atomic_fetch_add(&job->claimed, job->chunk, __ATOMIC_RELAXED);
+    if (start >= job->count) break;
+    uint32_t end = start + job->chunk < job->count ? start + job->chunk : job->count;
+
+    for (uint32_t i=start; i<end; i++)
+    {
+      Node * arg = copy(job->items[i], 0);
+      arg->element = false;
+      job->results[i] = apply_values(job->func, arg, job->env);
+    }
+  }
+
+  in_pmap = nested;
+  if (own != NULL) use_context(own);
+}
+
+static void * worker(void * unused)
+{
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool_lock);
+  while (true)
+  {
+    while (num_jobs == seen) pthread_cond_wait(&job_posted, &pool_lock);
+    seen = num_jobs;
+
+    Job * job = current_job;
+    if (job == NULL || job->helpers == 0) continue;
+    job->helpers--;
+    job->active++;
+
+    pthread_mutex_unlock(&pool_lock);
+    run_job(job);
+    pthread_mutex_lock(&pool_lock);
+
+    if (--job->active == 0) pthread_cond_signal(&job_finished);
+  }
+  return NULL;
+}
+
+int configured_threads()
+{
+  const char * threads = getenv("UNPAIR_THREADS");
+  int num = threads != NULL ? atoi(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+  return num < 1 ? 1 : num;
+}
+
+static void start_pool()
+{
+  num_workers = configured_threads() - 1;
+
+  for (int i=0; i<num_workers; i++)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker, NULL) != 0)
+    {
+      num_workers = i;
+      break;
+    }
+    pthread_detach(thread);
+  }
+}
+
+int pmap_workers()
+{
+  pthread_once(&pool_started, start_pool);
+  return num_workers;
+}
+
+void pmap_set_threads(int threads)
+{
+  max_threads = threads;
+}
+
+Node * pmap(Node * args, Node ** env)
+{
+  Node * func = args;
+  Node * list = pointer(func->next);
+
+  uint32_t count = list->type == TYPE_NODE ? length(pointer(list->value.u32)) : 0;
+  if (count == 0) return pointer_to(NIL);
+
+  Job job = { context, func, *env, malloc(sizeof(Node *) * count), malloc(sizeof(Node *) * count), count, 1, 0, 0, 1 };
+  Node * item = pointer(list->value.u32);
+  for (uint32_t i=0; i<count; i++, item = pointer(item->next))
+    job.items[i] = item;
+
+  int helpers = in_pmap ? 0 : pmap_workers();
+  if (max_threads > 0 && helpers > max_threads - 1) helpers = max_threads - 1;
+  job.chunk = count / ((helpers + 1) * CHUNKS_PER_THREAD);
+  if (job.chunk == 0) job.chunk = 1;
+
+  if (helpers == 0) run_job(&job);
+  else
+  {
+    pthread_mutex_lock(&serving);
+    __atomic_add_fetch(&context->sharing, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&pool_lock);
+    job.helpers = helpers;
+    current_job = &job;
+    num_jobs++;
+    pthread_cond_broadcast(&job_posted);
+    pthread_mutex_unlock(&pool_lock);
+
+    run_job(&job);
+
+    // All items are claimed by now; wait for the workers' last chunks
+    pthread_mutex_lock(&pool_lock);
+    job.active--;
+    while (job.active > 0) pthread_cond_wait(&job_finished, &pool_lock);
+    current_job = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    __atomic_sub_fetch(&context->sharing, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&serving);
+  }
+
+  // Chain the results in order
+  Node * head = NIL;
+  Node * tail = NIL;
+  for (uint32_t i=0; i<count; i++)
+  {
+    Node * result = job.results[i] == NIL ? pointer_to(NIL) : copy(job.results[i], 0);
+    result->element = false;
+    if (head == NIL) head = result;
+    else tail->next = index(result);
+    tail = result;
+  }
+
+  free(job.items);
+  free(job.results);
+  return pointer_to(head);
+}
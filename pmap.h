@@ -0,0 +1,26 @@
+#ifndef PMAP_H
+#define PMAP_H
+
+#include "node.h"
+
+/**
+ * Number of threads to do parallel work with, counting the calling
+ * thread: the number of CPUs, unless UNPAIR_THREADS says otherwise.
+ */
+int configured_threads();
+
+/**
+ * Number of worker threads for 'pmap', besides the calling thread.
+ */
+int pmap_workers();
+
+/**
+ * Limit the threads that take part in a 'pmap' (including the caller),
+ * e.g. to measure scaling; 0 = no limit.
+ */
+void pmap_set_threads(int threads);
+
+// (pmap f list)
+Node * pmap(Node * args, Node ** env);
+
+#endif /* PMAP_H */
@@ -1,6 +1,10 @@
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <dlfcn.h>
+#include <pthread.h>
 
 #include "node.h"
 #include "memory.h"
@@ -10,6 +14,16 @@
 #include "transform.h"
 #include "eval.h"
 #include "print.h"
+#include "list.h"
+#include "hash.h"
+#include "load.h"
+#include "serialize.h"
+#include "pmap.h"
+#include "future.h"
+#include "stream.h"
+#include "stats.h"
+#include "text.h"
+#include "region.h"
 
 // For cases with literal values, we could invent shorthand bytecode:
 // push int val +1
@@ -50,7 +64,7 @@ Node * times(Node * args, Node ** env)
   return result;
 }
 
-Node * div(Node * args, Node ** env)
+Node * divide(Node * args, Node ** env)
 {
   Node * result = new_node(TYPE_INT, args->value.i32);
   args = pointer(args->next);
@@ -71,6 +85,7 @@ Node * eq (Node * lhs, Node ** env)
   if (lhs == NIL || lhs->next == 0) return pointer_to(NIL);
   Node * rhs = pointer(lhs->next);
   if (lhs->type != rhs->type) return pointer_to(NIL);
+  if (lhs->type == TYPE_STRING) return strings_equal(lhs, rhs) ? pointer_to(NIL+1) : pointer_to(NIL);
   if (lhs->value.u32 != rhs->value.u32) return pointer_to(NIL);
   return pointer_to(NIL+1); // aka 'true'
 }
@@ -80,7 +95,7 @@ Node * lt (Node * lhs, Node ** env)
   if (lhs == NIL || lhs->next == 0) return pointer_to(NIL);
   Node * rhs = &memory[lhs->next];
   if (lhs->type != rhs->type) return pointer_to(NIL);
-  return (lhs->value.i32 < rhs->value.i32) ? pointer_to(NIL+1) : (NIL);
+  return (lhs->value.i32 < rhs->value.i32) ? pointer_to(NIL+1) : pointer_to(NIL);
 }
 
 Node * gt (Node * lhs, Node ** env)
@@ -104,16 +119,21 @@ Node * cdr (Node * val, Node ** env)
   if (list == NIL) return pointer_to(NIL);
 
   Node * result = pointer(list->next);
-  if(result->element && (result != NIL)) return result; // deconstruct Pair
+  if(result->element && (result != NIL)) return copy(result, 0); // deconstruct Pair; the caller may chain the result, so copy
   else return pointer_to(pointer(list->next));
 }
 
-// Make (copy) a node with car value of arg1,
+// Make a node with car value of arg1,
 // and cdr value of arg2.
 // This requires a bit of translation in our case:
 // (cons a b)    => (a . b) -> arg1.next = element(arg2)
 // (cons a (b))  => (a b)   -> arg1.next = arg2.value
 // (cons a ())   => (a)     -> arg1.next = arg2.value
+//
+// The arg nodes are the caller's to chain (see eval_and_chain), so
+// arg1 is chained in as it is, sharing the list of arg2, rather than
+// copied. Their values are not ours to change, as an arg may be the
+// very node that a variable holds.
 
 Node * cons (Node * car, Node ** env)
 {
@@ -127,21 +147,26 @@ Node * cons (Node * car, Node ** env)
     Node * cdrlist = pointer(cdr->value.u32);
     if (!cdrlist->element) // then it's a singleton pointer
     {
-      car = copy(car, 0);
-      cdr = pointer(cdr->value.u32);
-      //cdr->element = false;
-      car->next = index(cdr);
+      car->next = index(cdrlist);
       return new_node(TYPE_NODE, index(car));
     }
   }
   // so, if not a node, or if a singleton:
-  // Pretend to be a pair
-  car = copy(car, 1);
-  cdr = pointer(car->next);
+  // Pretend to be a pair. Only the cdr is copied, as a variable
+  // holding it as an element would hand it out without copying.
+  cdr = copy(cdr, 0);
   cdr->element = true;
+  cdr->next = 0;
+  car->next = index(cdr);
   return new_node(TYPE_NODE, index(car));
 }
 
+// (list a b ...): the evaluated args are a list already
+Node * list (Node * args, Node ** env)
+{
+  return pointer_to(args);
+}
+
 // As per the rules for (no) recursiveness,
 // We can't simply put 'env' in 'env' (and expect it to print);
 // so instead supply a simple primitive.
@@ -166,6 +191,7 @@ Node * iff (Node *test, Node ** env)
   // which is what we want anyway.
   Node * thenn = pointer(test->next);
   Node * elsse = pointer(thenn->next);
+  if (call_counting) count_branch(test->value.u32 != 0);
   if(test->value.u32 == 0) return eval(elsse, *env);
   else return eval(thenn, *env);
 }
@@ -175,8 +201,12 @@ Node * setvar(Node * expr, Node ** env)
 
   Node * var = pointer(expr->value.u32);
   Node * val = element(pointer(expr->next)); //eval(pointer(expr->next), *env);
+  // Store a non-element, so that every read takes its own copy
+  // that it may chain, instead of chaining the stored value itself
+  // (which would not do when many threads read it, as in 'pmap').
+  val->element = false;
   var->next = index(val);
-  return val;
+  return element(val);
 }
 
 // Returns the changed environment
@@ -230,6 +260,10 @@ Node * enclose(Node * lambda, Node ** env)
                    chain(TYPE_NODE, index(argnames), // really only needed to know where remainder args go at runtime
                    body)));
 
+  // Only at top level are all outside variables globals; see region.h
+  if (*env == context->environment && lambda->type == TYPE_NODE && is_local_body(argnames, body))
+    closure->special = true;
+
   // We should return a (single) element
   return new_node(TYPE_FUNC, index(closure));
 }
@@ -240,7 +274,13 @@ Node * print_string(Node * expr, Node ** env)
   {
     if (expr->type == TYPE_INT)
       printf("%d", expr->value.i32);
-    else if (expr->type == TYPE_STRING || expr->type == TYPE_ID)
+    else if (expr->type == TYPE_STRING)
+    {
+      uint32_t len;
+      const char * chars = string_data(expr, &len);
+      fwrite(chars, 1, len, stdout);
+    }
+    else if (expr->type == TYPE_ID)
       printf("%s", strval(pointer(expr->value.u32)));
 
     expr = pointer(expr->next);
@@ -263,39 +303,202 @@ Node * apply_cb(Node * expr, Node ** env)
   return eval(transform(expr, env, *env), *env);
 }
 
-#define NUM_PRIMITIVES 20
-
-char * primitives[NUM_PRIMITIVES] =
+Node * load_native(Node * args, Node ** env)
 {
-  // Integer arithmetic primitives
-  "+", "-", "*", "/", "%", "=", "<", ">",
-  // Utility
-  "print",
-  // List primitives
-  "car", "cdr", "cons",
-  // Reflection primitives
-  "eval", "env", "element?",
-  // Special form primitives:
-  "lambda", "if", "define", "define-syntax", "set!"
-};
+  if (args->type != TYPE_STRING)
+  {
+    printf("Runtime error: load-native expects a file name string.\n");
+    return pointer_to(NIL);
+  }
 
-PrimitiveCb jmptable[NUM_PRIMITIVES] =
+  char * path = string_chars(args);
+  void * module = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+  if (module == NULL)
+  {
+    printf("Runtime error: %s\n", dlerror());
+    return pointer_to(NIL);
+  }
+
+  void (* init)() = (void (*)()) dlsym(module, NATIVE_MODULE_INIT);
+  if (init == NULL)
+  {
+    printf("Runtime error: '%s' has no %s().\n", path, NATIVE_MODULE_INIT);
+    return pointer_to(NIL);
+  }
+
+  // The module is never unloaded, as its callbacks remain registered
+  int before = num_primitives;
+  init();
+  return new_node(TYPE_INT, num_primitives - before);
+}
+
+#define VARARGS -1
+
+// Registered in this order by init_primitives
+static Primitive builtins[] =
 {
   // Integer arithmetic primitives
-  plus, minus, times, div, remain, eq, lt, gt,
+  { "+", VARARGS, false, plus },
+  { "-", VARARGS, false, minus },
+  { "*", VARARGS, false, times },
+  { "/", 2, false, divide },
+  { "%", 2, false, remain },
+  { "=", VARARGS, false, eq },
+  { "<", VARARGS, false, lt },
+  { ">", VARARGS, false, gt },
   // Utility
-  print_string,
+  { "print", VARARGS, false, print_string },
+  { "write-to-string", 1, false, write_to_string },
+  { "load", 1, false, load },
+  { "load-native", 1, false, load_native },
+  { "serialize", 1, false, serialize },
+  { "deserialize", 1, false, deserialize },
+  { "serialize-to-file", 2, false, serialize_to_file },
+  { "deserialize-file", 1, false, deserialize_file },
   // List primitives
-  car, cdr, cons,
+  { "car", 1, false, car },
+  { "cdr", 1, false, cdr },
+  { "cons", 2, false, cons },
+  { "list", VARARGS, false, list },
+  // List library primitives
+  { "map", VARARGS, false, list_map },
+  { "for-each", VARARGS, false, list_for_each },
+  { "filter", 2, false, list_filter },
+  { "fold-left", 3, false, list_fold_left },
+  { "fold-right", 3, false, list_fold_right },
+  { "reverse", 1, false, list_reverse },
+  { "append", VARARGS, false, list_append },
+  { "length", 1, false, list_length },
+  { "list-ref", 2, false, list_ref },
+  { "assoc", 2, false, list_assoc },
+  { "sort", 2, false, list_sort },
+  { "apply", VARARGS, false, list_apply },
+  { "pmap", 2, false, pmap },
+  { "touch", 1, false, touch },
+  // Stream primitives
+  { "force", 1, false, force },
+  { "stream-cdr", 1, false, stream_cdr },
+  { "stream-map", 2, false, stream_map },
+  { "stream-filter", 2, false, stream_filter },
+  { "stream-take", 2, false, stream_take },
+  { "stream->list", 1, false, stream_to_list },
+  { "stream-for-each", 2, false, stream_for_each },
+  { "stream-fold", 3, false, stream_fold },
+  { "make-generator", 1, false, make_generator },
+  { "yield", 1, false, yield },
+  // String primitives
+  { "string-length", 1, false, string_length },
+  { "substring", VARARGS, false, substring },
+  { "string-append", VARARGS, false, string_append },
+  { "string=?", 2, false, string_equals },
+  // Hash table primitives
+  { "make-hash-table", VARARGS, false, make_hash_table },
+  { "hash-ref", VARARGS, false, hash_ref },
+  { "hash-set!", 3, false, hash_set },
+  { "hash-remove!", 2, false, hash_remove },
+  { "hash-count", 1, false, hash_count },
+  { "hash-for-each", 2, false, hash_for_each },
+  { "hash->list", 1, false, hash_to_list },
   // Reflection primitives
-  eval_cb, env, is_element,
+  { "eval", VARARGS, false, eval_cb },
+  { "env", VARARGS, false, env },
+  { "element?", 1, false, is_element },
+  { "heap-stats", 0, false, heap_stats },
+  { "gc-stats", 0, false, gc_stats },
+  { "call-stats", 0, false, call_stats },
   // Special form primitives - notice anything?
-  enclose, iff, setvar, setvar, setvar
+  // (These are recognized by name in transform.c)
+  { "lambda", VARARGS, true, enclose },
+  { "if", VARARGS, true, iff },
+  { "future", 1, true, future },
+  { "delay", 1, true, delay },
+  { "time", 1, true, time_eval },
+  { "define", VARARGS, true, setvar },
+  { "define-syntax", VARARGS, true, setvar },
+  { "set!", VARARGS, true, setvar }
 };
 
-int find_primitive(char * name)
+/**
+ * The primitives are shared by all interpreters in the process, and may
+ * be looked up from any thread while a native module registers more.
+ * So the tables never move, and registering is serialized by a lock.
+ */
+Primitive primitives[MAX_PRIMITIVES];
+int num_primitives;
+
+static pthread_mutex_t registering = PTHREAD_MUTEX_INITIALIZER;
+
+// Name lookup: open addressing over indices into 'primitives' + 1; 0 = empty
+#define NAMES_CAPACITY (2 * MAX_PRIMITIVES)
+static int names[NAMES_CAPACITY];
+
+static uint32_t hash_name(const char * name)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  while (*name) h = (h ^ (uint8_t) *name++) * 16777619u;
+  return h;
+}
+
+// Returns the 'names' slot that holds or should hold 'name'
+static int * name_slot(const char * name)
+{
+  uint32_t i = hash_name(name) & (NAMES_CAPACITY - 1);
+  int num;
+  while ((num = __atomic_load_n(&names[i], __ATOMIC_ACQUIRE)) != 0 && strcmp(primitives[num - 1].name, name) != 0)
+    i = (i + 1) & (NAMES_CAPACITY - 1);
+  return &names[i];
+}
+
+int register_primitive(const char * name, int arity, bool special, PrimitiveCb cb)
+{
+  pthread_mutex_lock(&registering);
+
+  int * slot = name_slot(name);
+  int num = *slot - 1;
+  if (num == -1)
+  {
+    if (num_primitives == MAX_PRIMITIVES)
+    {
+      printf("Fatal: too many primitives\n");
+      exit(1);
+    }
+    num = num_primitives;
+    primitives[num].name = strdup(name);
+  }
+  // else: re-registering replaces the existing primitive,
+  // including its uses in already transformed code.
+  local_primitives[num] = false;
+
+  primitives[num].arity = arity;
+  primitives[num].special = special;
+  primitives[num].cb = cb;
+
+  if (*slot == 0)
+  {
+    // Publish only once complete
+    __atomic_store_n(&num_primitives, num + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(slot, num + 1, __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&registering);
+  return num;
+}
+
+static void register_builtins()
+{
+  for (int i=0; i<sizeof(builtins) / sizeof(Primitive); i++)
+    register_primitive(builtins[i].name, builtins[i].arity, builtins[i].special, builtins[i].cb);
+  find_local_primitives();
+}
+
+void init_primitives()
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, register_builtins);
+}
+
+int find_primitive(const char * name)
 {
-  for (int i=0; i< NUM_PRIMITIVES; i++) if (strcmp(primitives[i], name) == 0) return i;
-  printf("not found: %s\n", name);
-  return -1;
+  return __atomic_load_n(name_slot(name), __ATOMIC_ACQUIRE) - 1;
 }
@@ -1,10 +1,42 @@
+#include <stdbool.h>
+
 typedef Node * (* PrimitiveCb) (Node * args, Node ** env);
 
-extern char * primitives[];
-extern PrimitiveCb jmptable[];
+typedef struct Primitive {
+  const char * name;
+  int arity;     // number of args, or -1 for any
+  bool special;  // if set, args are passed as (unevaluated) code
+  PrimitiveCb cb;
+} Primitive;
+
+#define MAX_PRIMITIVES 1024
+
+extern Primitive primitives[MAX_PRIMITIVES];
+extern int num_primitives;
+
+/**
+ * Register the builtin primitives, once per process.
+ */
+void init_primitives();
 
-int find_primitive(char * name);
+/**
+ * Add a primitive, or replace the one by the same name.
+ * Returns its number, which is what TYPE_PRIMITIVE nodes hold.
+ */
+int register_primitive(const char * name, int arity, bool special, PrimitiveCb cb);
+
+/**
+ * Return the primitive's number, or -1 if not found.
+ */
+int find_primitive(const char * name);
+
+/**
+ * Native modules loaded by (load-native "file.so") must export this
+ * function, which registers the module's primitives:
+ *
+ *   void unpair_module_init() { register_primitive("foo", 1, false, foo); }
+ */
+#define NATIVE_MODULE_INIT "unpair_module_init"
 
 // exposed primitives
 Node * enclose(Node * lambda, Node ** env);
-
@@ -7,70 +7,189 @@
 #include "print.h"
 #include "memory.h"
 #include "primitive.h"
+#include "hash.h"
+#include "text.h"
 
-void print_node(Node * node)
+// Make room for 'len' more chars
+static char * reserve(Output * out, size_t len)
 {
-  switch(node->type)
+  if (out->file != NULL && out->len + len > OUTPUT_CHUNK) output_flush(out);
+  if (out->len + len > out->size)
   {
-    case TYPE_INT: printf("%d", node->value.i32);
-      break;
-    case TYPE_CHAR:
-      if(node->array)
+    out->size = out->len + len > OUTPUT_CHUNK ? (out->len + len) * 2 : OUTPUT_CHUNK;
+    out->data = realloc(out->data, out->size);
+  }
+  return out->data + out->len;
+}
+
+void output_chars(Output * out, const char * chars, size_t len)
+{
+  memcpy(reserve(out, len), chars, len);
+  out->len += len;
+}
+
+static inline void output_char(Output * out, char ch)
+{
+  *reserve(out, 1) = ch;
+  out->len++;
+}
+
+static void output_str(Output * out, const char * str)
+{
+  output_chars(out, str, strlen(str));
+}
+
+// The chars of a (char array) node, without the terminating zero
+static void output_array(Output * out, Node * chars)
+{
+  output_chars(out, strval(chars), chars->value.u32 - 1);
+}
+
+static void output_int(Output * out, int32_t value)
+{
+  char digits[12];
+  int pos = sizeof(digits);
+  uint32_t u = value < 0 ? -(uint32_t) value : (uint32_t) value;
+  do digits[--pos] = '0' + u % 10;
+  while ((u /= 10) != 0);
+  if (value < 0) digits[--pos] = '-';
+  output_chars(out, digits + pos, sizeof(digits) - pos);
+}
+
+void output_flush(Output * out)
+{
+  if (out->file != NULL && out->len > 0) fwrite(out->data, 1, out->len, out->file);
+  out->len = 0;
+}
+
+// The lists we are in the middle of writing
+static __thread Node ** stack;
+static __thread size_t stack_size;
+
+void write_node(Output * out, Node * node)
+{
+  size_t depth = 0;
+
+  while (true)
+  {
+    Node * list = NULL; // set if we are to descend into a list
+    switch(node->type)
+    {
+      case TYPE_INT:
+        output_int(out, node->value.i32);
+        break;
+      case TYPE_CHAR:
+        if(node->array)
+        {
+          output_char(out, '[');
+          output_array(out, node);
+          output_char(out, ']');
+        }
+        else
+        {
+          char buf[8];
+          output_chars(out, buf, sprintf(buf, "'%uc'", (unsigned char) node->value.u32));
+        }
+        break;
+      case TYPE_STRING:
       {
-        printf("[%s]", strval(node));
+        uint32_t len;
+        const char * chars = string_data(node, &len);
+        output_char(out, '\"');
+        output_chars(out, chars, len);
+        output_char(out, '\"');
+        break;
       }
-      else
-        printf("'%uc'", (unsigned char) node->value.u32);
-      break;
-    case TYPE_STRING:
-      printf("\"%s\"", strval(&memory[node->value.u32]));
-      break;
-    case TYPE_ID:
-      printf("%s", strval(&memory[node->value.u32]));
-      break;
-    case TYPE_NODE:
-      if (node->value.u32 == 0) printf("nil");
-      else if (node->value.u32 == 1) printf("#t");
-      else
+      case TYPE_ID:
+        output_array(out, &memory[node->value.u32]);
+        break;
+      case TYPE_NODE:
+        if (node->value.u32 == 0) output_str(out, "nil");
+        else if (node->value.u32 == 1) output_str(out, "#t");
+        else
+        {
+          output_char(out, '(');
+          list = &memory[node->value.u32];
+        }
+        break;
+      case TYPE_FUNC:
+        output_str(out, "(lambda ");
+        list = &memory[ memory [ memory[node->value.u32].next ].next ];
+        break;
+      case TYPE_ARG:
+      case TYPE_VAR:
+        output_array(out, &memory[memory[node->value.u32].value.u32]);
+        break;
+      case TYPE_PRIMITIVE:
+        output_str(out, primitives[node->value.u32].name);
+        break;
+      case TYPE_HASH:
+        output_str(out, "<hash-table ");
+        output_int(out, hash_header(&memory[node->value.u32])->count);
+        output_char(out, '>');
+        break;
+      case TYPE_TABLE:
+        output_str(out, "<table>");
+        break;
+      case TYPE_FUTURE:
+        output_str(out, "<future>");
+        break;
+      case TYPE_PROMISE:
+        output_str(out, "<promise>");
+        break;
+      case TYPE_GENERATOR:
+        output_str(out, "<generator>");
+        break;
+    }
+
+    if (list != NULL)
+    {
+      // Come back to this node when done with the list
+      if (depth == stack_size)
       {
-        printf("(");
-        if (node->value.u32 != 0) print_node(&memory[node->value.u32]);
-        printf(")");
+        stack_size = stack_size == 0 ? 64 : stack_size * 2;
+        stack = realloc(stack, stack_size * sizeof(Node *));
       }
-      break;
-    case TYPE_FUNC:
-      printf("(lambda ");
-      print_node(&memory[ memory [ memory[node->value.u32].next ].next ] );
-      printf(")");
-      break;
-    case TYPE_ARG:
-    //  printf("arg:%s", strval(&memory[memory[node->value.u32].value.u32]));
-    //  break;
-    case TYPE_VAR:
-      printf("%s", strval(&memory[memory[node->value.u32].value.u32]));
-      break;
-    case TYPE_PRIMITIVE:
-      printf("%s", primitives[node->value.u32]);
-      break;
-  }
+      stack[depth++] = node;
+      node = list;
+      continue;
+    }
+
+    // Move on to the next node, closing the lists that end here
+    while (node->next == 0)
+    {
+      if (depth == 0) return;
+      node = stack[--depth];
+      output_char(out, ')');
+    }
 
-  if (node->next != 0)
-  {
     if (memory[node->next].element)
-      printf(" . ");
-    else printf(" ");
+      output_str(out, " . ");
+    else output_char(out, ' ');
 
-    print_node(&memory[node->next]);
+    node = &memory[node->next];
   }
 }
 
+static __thread Output console = { NULL, 0, 0, NULL };
+
 // Really is 'print element'
 void print(Node * node)
 {
   if (node == NULL) return; // happens when EOF
 
-  //if (node->type == TYPE_NODE) printf("{");
-  print_node(node);
-  //if (node->type == TYPE_NODE) printf("}");
-  printf("\n");
+  console.file = stdout;
+  write_node(&console, node);
+  output_char(&console, '\n');
+  output_flush(&console);
+}
+
+Node * write_to_string(Node * args, Node ** env)
+{
+  static __thread Output out = { NULL, 0, 0, NULL };
+  out.len = 0;
+
+  write_node(&out, args);
+
+  return new_string(out.data, out.len);
 }
@@ -1,8 +1,35 @@
 #ifndef PRINT_H
 #define PRINT_H
 
+#include <stdio.h>
+#include <stddef.h>
+
 #include "node.h"
 
+/**
+ * Growable output buffer. If 'file' is set, the buffer is flushed to it
+ * whenever it fills up by OUTPUT_CHUNK; otherwise it just keeps growing.
+ */
+typedef struct Output {
+  char * data;
+  size_t len;
+  size_t size;
+  FILE * file;
+} Output;
+
+#define OUTPUT_CHUNK (64 * 1024)
+
+void output_chars(Output * out, const char * chars, size_t len);
+void output_flush(Output * out);
+
+/**
+ * Write a node (and the nodes chained after it) in print notation.
+ */
+void write_node(Output * out, Node * node);
+
 void print(Node * node);
 
+// (write-to-string x)
+Node * write_to_string(Node * args, Node ** env);
+
 #endif /* PRINT_H */
@@ -0,0 +1,194 @@
+/**
+ * Sampling profiler; see profile.h.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "node.h"
+#include "memory.h"
+#include "primitive.h"
+#include "stats.h"
+#include "profile.h"
+
+#define INTERVAL_US 1000
+#define MAX_DEPTH (64 * 1024)      // frames kept; deeper ones are counted, not seen
+#define PENDING_SIZE (128 * 1024)  // words of samples waiting to be resolved
+
+bool profiling;
+
+// The Lisp call stack of this thread, and the samples taken of it: each
+// a depth followed by that many frames. Written outside of the signal
+// handler only with SIGPROF blocked, or before the depth is raised.
+static __thread uint32_t * frames;
+static __thread volatile uint32_t depth;
+static __thread uint32_t * volatile pending;
+static __thread volatile uint32_t pending_size;
+
+static uint64_t dropped; // for want of room
+
+// Every distinct stack sampled, as a tree of calls
+typedef struct Call {
+  uint32_t function; // as numbered by function_of, or a PRIMITIVE_FRAME
+  uint32_t parent;
+  uint32_t children; // the first of them
+  uint32_t sibling;  // the next child of the parent
+  uint64_t samples;  // taken with exactly this stack
+} Call;
+
+static Call * calls; // calls[0] is the empty stack
+static uint32_t num_calls;
+static uint32_t calls_size;
+static pthread_mutex_t calls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void sample(int signal)
+{
+  if (pending == NULL) return; // a thread that ran no functions so far
+
+  uint32_t n = depth < MAX_DEPTH ? depth : MAX_DEPTH;
+  if (pending_size + 1 + n > PENDING_SIZE)
+  {
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  pending[pending_size] = n;
+  memcpy(&pending[pending_size + 1], frames, sizeof(uint32_t) * n);
+  pending_size += 1 + n;
+}
+
+static void allocate_stack()
+{
+  frames = malloc(sizeof(uint32_t) * MAX_DEPTH);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  pending = malloc(sizeof(uint32_t) * PENDING_SIZE);
+}
+
+// The call of 'function' from 'parent'
+static uint32_t find_call(uint32_t parent, uint32_t function)
+{
+  for (uint32_t c=calls[parent].children; c != 0; c = calls[c].sibling)
+    if (calls[c].function == function) return c;
+
+  if (num_calls == calls_size)
+  {
+    calls_size *= 2;
+    calls = realloc(calls, sizeof(Call) * calls_size);
+  }
+  calls[num_calls] = (Call) { function, parent, 0, calls[parent].children, 0 };
+  calls[parent].children = num_calls;
+  return num_calls++;
+}
+
+// Add this thread's samples to the tree. While the bodies on the stack
+// run, they cannot be collected, so their names are still known.
+static void resolve_samples()
+{
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+  pthread_mutex_lock(&context->heap_lock); // for function_of
+  pthread_mutex_lock(&calls_lock);
+
+  for (uint32_t i=0; i<pending_size; )
+  {
+    uint32_t n = pending[i++];
+    uint32_t call = 0;
+    for (uint32_t end = i + n; i < end; i++)
+    {
+      uint32_t frame = pending[i];
+      call = find_call(call, frame & PRIMITIVE_FRAME(0) ? frame : function_of(frame));
+    }
+    calls[call].samples++;
+  }
+  pending_size = 0;
+
+  pthread_mutex_unlock(&calls_lock);
+  pthread_mutex_unlock(&context->heap_lock);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+uint32_t push_frame(uint32_t frame)
+{
+  if (pending == NULL) allocate_stack();
+  if (pending_size > 0) resolve_samples();
+
+  uint32_t outer = depth;
+  if (outer < MAX_DEPTH) frames[outer] = frame;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  depth = outer + 1;
+  return outer;
+}
+
+void pop_frame(uint32_t outer)
+{
+  if (pending_size > 0) resolve_samples();
+  // Rather than one down, as generators switch stacks halfway
+  depth = outer;
+}
+
+void start_profile()
+{
+  calls_size = 1024;
+  calls = malloc(sizeof(Call) * calls_size);
+  calls[0] = (Call) { 0 };
+  num_calls = 1;
+  if (pending == NULL) allocate_stack();
+
+  struct sigaction action = { 0 };
+  action.sa_handler = sample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+
+  profiling = true;
+  struct itimerval timer = { { 0, INTERVAL_US }, { 0, INTERVAL_US } };
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// A frame of a folded stack, which must not hold the separator
+static void write_frame(FILE * out, uint32_t function)
+{
+  const char * label = function & PRIMITIVE_FRAME(0)
+    ? primitives[function & ~PRIMITIVE_FRAME(0)].name
+    : function_label(function);
+  for (const char * c = label; *c != '\0'; c++)
+    fputc(*c == ';' || *c == '\n' ? ' ' : *c, out);
+}
+
+bool write_profile(const char * path)
+{
+  struct itimerval off = { { 0, 0 }, { 0, 0 } };
+  setitimer(ITIMER_PROF, &off, NULL);
+  profiling = false;
+  if (pending_size > 0) resolve_samples();
+
+  FILE * out = fopen(path, "w");
+  if (out == NULL) return false;
+
+  if (calls[0].samples > 0) fprintf(out, "(top level) %lu\n", (unsigned long) calls[0].samples);
+
+  uint32_t * stack = malloc(sizeof(uint32_t) * num_calls);
+  for (uint32_t c=1; c<num_calls; c++)
+  {
+    if (calls[c].samples == 0) continue;
+
+    uint32_t n = 0;
+    for (uint32_t call = c; call != 0; call = calls[call].parent) stack[n++] = call;
+    while (n-- > 0)
+    {
+      write_frame(out, calls[stack[n]].function);
+      fputc(n > 0 ? ';' : ' ', out);
+    }
+    fprintf(out, "%lu\n", (unsigned long) calls[c].samples);
+  }
+  free(stack);
+
+  if (dropped > 0) fprintf(stderr, "Profile: %lu samples dropped for want of room\n", (unsigned long) dropped);
+  return fclose(out) == 0;
+}
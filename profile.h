@@ -0,0 +1,43 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Sampling profiler for Lisp functions (see --profile).
+ *
+ * While 'profiling' is on, run_lambda and call_primitive keep a Lisp
+ * call stack per thread: lambda bodies, and primitives numbered as
+ * PRIMITIVE_FRAME. A SIGPROF timer samples the stack of whichever
+ * thread it interrupts, every millisecond of CPU time or at the kernel's
+ * tick rate, whichever is less often. The samples are resolved to
+ * function names outside of the signal handler, the next time that the
+ * thread enters or leaves a function.
+ *
+ * The profile is written as folded stacks, one line per distinct stack
+ * with the number of samples taken in it:
+ *
+ *   outer;inner;innermost 42
+ *
+ * as read by flamegraph.pl, speedscope and the like. Samples outside of
+ * any function, e.g. while parsing or collecting garbage at top level,
+ * are counted as "(top level)".
+ */
+extern bool profiling;
+
+#define PRIMITIVE_FRAME(num) ((num) | 0x80000000)
+
+// Push a frame; returns the depth to pop back to
+uint32_t push_frame(uint32_t frame);
+void pop_frame(uint32_t depth);
+
+void start_profile();
+
+/**
+ * Stop sampling and write the folded stacks; returns false if the file
+ * could not be written.
+ */
+bool write_profile(const char * path);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,134 @@
+/**
+ * Regions for the temporaries of lambda calls; see region.h.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "node.h"
+#include "memory.h"
+#include "gc.h"
+#include "primitive.h"
+#include "region.h"
+
+__thread uint32_t open_regions;
+__thread uint64_t region_escapes;
+
+bool local_primitives[MAX_PRIMITIVES];
+
+static const char * local_names[] = {
+  "+", "-", "*", "/", "%", "=", "<", ">",
+  "car", "cdr", "cons", "list", "length", "list-ref",
+  "string-length", "string=?", "if"
+};
+
+void find_local_primitives()
+{
+  for (int i=0; i<sizeof(local_names) / sizeof(local_names[0]); i++)
+  {
+    int num = find_primitive(local_names[i]);
+    if (num >= 0) local_primitives[num] = true;
+  }
+}
+
+static bool is_local(Node * code)
+{
+  switch (code->type)
+  {
+    case TYPE_INT:
+    case TYPE_STRING:
+    case TYPE_ID:
+    case TYPE_ARG:
+    case TYPE_VAR:
+      return true;
+    case TYPE_PRIMITIVE:
+      return local_primitives[code->value.u32];
+    case TYPE_NODE:
+      // Expressions, and quoted data, which is just as well
+      for (Node * item = pointer(code->value.u32); item != NIL; item = pointer(item->next))
+        if (!is_local(item)) return false;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_local_body(Node * argnames, Node * body)
+{
+  for (Node * name = argnames; name != NIL; name = pointer(name->next))
+    if (name->element) return false; // (lambda (x . rest) ...)
+  return is_local(body);
+}
+
+static uint64_t collections()
+{
+  return context->collections + context->young_collections;
+}
+
+bool open_region(Region * region)
+{
+  if (__atomic_load_n(&context->sharing, __ATOMIC_ACQUIRE) != 0) return false;
+
+  *region = (Region) { context->memsize, region_escapes, collections() };
+  open_regions++;
+  return true;
+}
+
+static bool checking;
+static pthread_once_t checking_once = PTHREAD_ONCE_INIT;
+
+static void init_checking()
+{
+  checking = getenv("UNPAIR_REGION_CHECK") != NULL;
+}
+
+// Whether the node index is in [from, to)
+#define within(at, from, to) ((at) >= (from) && (at) < (to))
+
+static void check_region(Region * region)
+{
+  uintptr_t end = context->memsize;
+  for (uintptr_t i=0; i<region->mark; )
+  {
+    Node * node = &memory[i];
+    bool value = !node->array && is_pointer(node->type) && within(node->value.u32, region->mark, end);
+    if (value || within(node->next, region->mark, end))
+    {
+      fprintf(stderr, "Region error: node %lu (%s) points to %u, in the region [%u, %lu) being reset\n",
+        (unsigned long) i, types[node->type], value ? node->value.u32 : node->next, region->mark, (unsigned long) end);
+      abort();
+    }
+    i += node_size(node);
+  }
+}
+
+Node * close_region(Region * region, Node * result)
+{
+  if (region->escapes != region_escapes) return result;
+  open_regions--;
+
+  if (collections() != region->collections) return result;
+  if (__atomic_load_n(&context->sharing, __ATOMIC_ACQUIRE) != 0) return result;
+  if (context->memsize <= region->mark) return result;
+
+  // Keep the region if the result is in it, and so is what it points to
+  bool made_here = index(result) >= region->mark;
+  if (made_here && result->array) return result;
+  if (made_here && is_pointer(result->type) && result->value.u32 >= region->mark) return result;
+
+  pthread_once(&checking_once, init_checking);
+  if (checking) check_region(region);
+
+  Node kept = *result;
+  context->region_resets++;
+  context->region_freed += context->memsize - region->mark;
+  context->memsize = region->mark;
+  if (!made_here) return result;
+
+  result = new_node(kept.type, kept.value.u32);
+  result->element = kept.element;
+  result->special = kept.special;
+  return result;
+}
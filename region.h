@@ -0,0 +1,75 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "node.h"
+
+/**
+ * Regions for the temporaries of lambda calls.
+ *
+ * When a lambda is made at top level, enclose checks whether anything its
+ * body makes can escape a call. Its body may only read the lambda's own
+ * args (not a rest list) and globals, and only call functions, 'if' and
+ * the "local" primitives: those that neither keep nor change what they
+ * are given, other than by chaining the arg nodes that they own, such as
+ * arithmetic and cons. If so, the lambda is marked as local.
+ *
+ * run_lambda evaluates the args of a local lambda as usual, and then opens
+ * a region: it notes memsize, and makes its env and everything else past
+ * that mark. On return, if the result points to nothing in the region,
+ * memsize is reset to the mark and the result copied to there.
+ *
+ * What functions a body calls is only known at run time: a call to any
+ * other lambda or primitive counts as an escape from all open regions,
+ * which are then left to the GC, as is one that a GC ran in. While a
+ * region is open, allocation passes by the free list, so that the nodes
+ * below the mark are all older than the region.
+ *
+ * Set UNPAIR_REGION_CHECK to check every reset: if any node below the
+ * mark then points into the region after all, that is reported and the
+ * process aborted. This is a debugging aid only: each check scans all
+ * of memory below the mark, so that a program making many calls on a
+ * large heap slows down by orders of magnitude. It is meant for small
+ * scripts, such as those that 'make test' runs.
+ */
+typedef struct Region {
+  uint32_t mark;        // memsize when opened
+  uint64_t escapes;     // region_escapes when opened
+  uint64_t collections; // when opened
+} Region;
+
+// Regions opened since the last escape, on this thread
+extern __thread uint32_t open_regions;
+extern __thread uint64_t region_escapes;
+
+extern bool local_primitives[]; // by primitive number
+
+/**
+ * Mark the builtin primitives that are local; see above.
+ */
+void find_local_primitives();
+
+/**
+ * Whether nothing that a lambda body makes can escape, other than through
+ * its result, or the functions it calls.
+ */
+bool is_local_body(Node * argnames, Node * body);
+
+static inline void escape_regions()
+{
+  region_escapes++;
+  open_regions = 0;
+}
+
+// Returns false if no region could be opened, e.g. while sharing
+bool open_region(Region * region);
+
+/**
+ * Reset the region if nothing escaped it; returns the result, copied out
+ * of the region if it was reset.
+ */
+Node * close_region(Region * region, Node * result);
+
+#endif /* REGION_H */
@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "node.h"
+#include "memory.h"
+#include "primitive.h"
+#include "print.h"
+#include "idmap.h"
+#include "text.h"
+#include "serialize.h"
+
+// Node tag bits, above the type
+#define TAG_TYPE 0x0F
+#define TAG_ELEMENT 0x10
+#define TAG_SPECIAL 0x20
+#define TAG_NEXT 0x40         // a 'next' reference follows the value
+#define TAG_NEXT_FOLLOWS 0x80 // 'next' is the node numbered right after this one
+
+// References below this are nil and true
+#define FIRST_REF 2
+
+static void put_varint(Output * out, uint32_t value)
+{
+  char bytes[5];
+  int len = 0;
+  while (value >= 0x80)
+  {
+    bytes[len++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  bytes[len++] = value;
+  output_chars(out, bytes, len);
+}
+
+static uint32_t ref(IdMap * nodes, uint32_t idx)
+{
+  return idx < FIRST_REF ? idx : map_find(nodes, idx) + FIRST_REF;
+}
+
+// The char array holding a primitive's name
+static uint32_t primitive_name(Node * node)
+{
+  const char * name = primitives[node->value.u32].name;
+  return index(unique_chars(name, strlen(name)));
+}
+
+/**
+ * Write the encoding of a value. Returns false (having written nothing)
+ * if it holds anything that can't be serialized, such as closures.
+ */
+static bool encode(Output * out, Node * value)
+{
+  IdMap nodes = {0};
+  IdMap strings = {0};
+  bool ok = true;
+
+  map_add(&nodes, index(value));
+  for (uint32_t i=0; i<nodes.count; i++)
+  {
+    Node * node = pointer(nodes.order[i]);
+    switch (node->type)
+    {
+      case TYPE_INT:
+        break;
+      case TYPE_CHAR:
+        if (node->array) ok = false;
+        break;
+      case TYPE_STRING:
+        map_add(&strings, index(string_array(node)));
+        break;
+      case TYPE_ID:
+        map_add(&strings, node->value.u32);
+        break;
+      case TYPE_PRIMITIVE:
+        map_add(&strings, primitive_name(node));
+        break;
+      case TYPE_NODE:
+        if (node->value.u32 >= FIRST_REF) map_add(&nodes, node->value.u32);
+        break;
+      default:
+        ok = false;
+    }
+    if (!ok)
+    {
+      printf("Runtime error: cannot serialize a %s.\n", types[node->type]);
+      break;
+    }
+
+    // The value itself may be chained into an argument list
+    if (i > 0 && node->next >= FIRST_REF) map_add(&nodes, node->next);
+  }
+
+  if (ok)
+  {
+    output_chars(out, SERIALIZE_MAGIC, 4);
+    put_varint(out, SERIALIZE_FORMAT);
+
+    put_varint(out, strings.count);
+    for (uint32_t i=0; i<strings.count; i++)
+    {
+      Node * chars = pointer(strings.order[i]);
+      put_varint(out, chars->value.u32 - 1);
+      output_chars(out, strval(chars), chars->value.u32 - 1);
+    }
+
+    put_varint(out, nodes.count);
+    for (uint32_t i=0; i<nodes.count; i++)
+    {
+      Node * node = pointer(nodes.order[i]);
+      uint32_t next = i == 0 ? 0 : ref(&nodes, node->next);
+
+      uint8_t tag = node->type;
+      if (node->element || i == 0) tag |= TAG_ELEMENT;
+      if (node->special) tag |= TAG_SPECIAL;
+      if (next == i + 1 + FIRST_REF) tag |= TAG_NEXT_FOLLOWS;
+      else if (next != 0) tag |= TAG_NEXT;
+      output_chars(out, (char *) &tag, 1);
+
+      switch (node->type)
+      {
+        case TYPE_INT:
+          put_varint(out, ((uint32_t) node->value.i32 << 1) ^ (uint32_t) (node->value.i32 >> 31));
+          break;
+        case TYPE_STRING:
+          put_varint(out, map_find(&strings, index(string_array(node))));
+          break;
+        case TYPE_ID:
+          put_varint(out, map_find(&strings, node->value.u32));
+          break;
+        case TYPE_PRIMITIVE:
+          put_varint(out, map_find(&strings, primitive_name(node)));
+          break;
+        case TYPE_NODE:
+          put_varint(out, ref(&nodes, node->value.u32));
+          break;
+        default:
+          put_varint(out, node->value.u32);
+      }
+      if (tag & TAG_NEXT) put_varint(out, next);
+    }
+  }
+
+  map_free(&nodes);
+  map_free(&strings);
+  return ok;
+}
+
+// Reads encoded data, with bounds checking
+typedef struct Input {
+  const uint8_t * data;
+  size_t pos;
+  size_t len;
+  bool ok;
+} Input;
+
+static uint32_t get_varint(Input * in)
+{
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    if (in->pos == in->len) break;
+    uint8_t byte = in->data[in->pos++];
+    value |= (uint32_t) (byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+  in->ok = false;
+  return 0;
+}
+
+static const char * get_chars(Input * in, uint32_t len)
+{
+  if (in->len - in->pos < len)
+  {
+    in->ok = false;
+    return NULL;
+  }
+  in->pos += len;
+  return (const char *) in->data + in->pos - len;
+}
+
+/**
+ * Decode a value in a single pass, its nodes allocated in one block.
+ * Returns NULL if the data is not valid.
+ */
+static Node * decode(const uint8_t * data, size_t len)
+{
+  Input in = { data, 0, len, true };
+
+  const char * magic = get_chars(&in, 4);
+  if (magic == NULL || memcmp(magic, SERIALIZE_MAGIC, 4) != 0 || get_varint(&in) != SERIALIZE_FORMAT) return NULL;
+
+  uint32_t num_strings = get_varint(&in);
+  if (!in.ok || num_strings > len) return NULL;
+  uint32_t * strings = malloc(sizeof(uint32_t) * num_strings);
+  for (uint32_t i=0; in.ok && i<num_strings; i++)
+  {
+    uint32_t str_len = get_varint(&in);
+    const char * chars = get_chars(&in, str_len);
+    if (chars != NULL) strings[i] = index(unique_chars(chars, str_len));
+  }
+
+  // Every node takes at least two bytes
+  uint32_t num_nodes = get_varint(&in);
+  if (!in.ok || num_nodes == 0 || num_nodes > (len - in.pos) / 2)
+  {
+    free(strings);
+    return NULL;
+  }
+
+  Node * nodes = allocate_nodes(num_nodes);
+  uint32_t base = index(nodes) - FIRST_REF;
+  uint32_t limit = num_nodes + FIRST_REF;
+
+  uint32_t i;
+  for (i=0; i<num_nodes; i++)
+  {
+    if (in.pos == in.len) break;
+    uint8_t tag = in.data[in.pos++];
+    uint32_t value = get_varint(&in);
+    uint32_t next = tag & TAG_NEXT_FOLLOWS ? i + 1 + FIRST_REF : tag & TAG_NEXT ? get_varint(&in) : 0;
+    if (!in.ok || next >= limit) break;
+
+    Node * node = init_node(&nodes[i], tag & TAG_TYPE, value, false);
+    node->element = (tag & TAG_ELEMENT) != 0;
+    node->special = (tag & TAG_SPECIAL) != 0;
+    if (next != 0) node->next = base + next;
+
+    bool valid = true;
+    switch (node->type)
+    {
+      case TYPE_INT:
+        node->value.u32 = (value >> 1) ^ -(value & 1);
+        break;
+      case TYPE_CHAR:
+        break;
+      case TYPE_STRING:
+      case TYPE_ID:
+        valid = value < num_strings;
+        if (valid) node->value.u32 = strings[value];
+        break;
+      case TYPE_PRIMITIVE:
+        valid = value < num_strings;
+        if (valid) node->value.i32 = find_primitive(strval(pointer(strings[value])));
+        valid = valid && node->value.i32 >= 0;
+        break;
+      case TYPE_NODE:
+        valid = value < limit;
+        if (value >= FIRST_REF) node->value.u32 = base + value;
+        break;
+      default:
+        valid = false;
+    }
+    if (!valid) break;
+  }
+  free(strings);
+
+  if (i < num_nodes)
+  {
+    // Leave a clean block for GC
+    for (uint32_t j=0; j<num_nodes; j++) init_node(&nodes[j], TYPE_INT, 0, false);
+    return NULL;
+  }
+  return nodes;
+}
+
+static Node * decoded(Node * value)
+{
+  if (value != NULL) return value;
+  printf("Runtime error: invalid serialized data.\n");
+  return pointer_to(NIL);
+}
+
+Node * serialize(Node * args, Node ** env)
+{
+  static __thread Output out = { NULL, 0, 0, NULL };
+  out.len = 0;
+
+  if (!encode(&out, args)) return pointer_to(NIL);
+  return new_string(out.data, out.len);
+}
+
+Node * deserialize(Node * args, Node ** env)
+{
+  if (args->type != TYPE_STRING)
+  {
+    printf("Runtime error: deserialize expects a string.\n");
+    return pointer_to(NIL);
+  }
+
+  uint32_t len;
+  const char * bytes = string_data(args, &len);
+  return decoded(decode((const uint8_t *) bytes, len));
+}
+
+Node * serialize_to_file(Node * args, Node ** env)
+{
+  Node * path = pointer(args->next);
+  if (path->type != TYPE_STRING)
+  {
+    printf("Runtime error: serialize-to-file expects a file name string.\n");
+    return pointer_to(NIL);
+  }
+
+  FILE * file = fopen(string_chars(path), "wb");
+  if (file == NULL)
+  {
+    printf("Runtime error: cannot write '%s'.\n", string_chars(path));
+    return pointer_to(NIL);
+  }
+
+  Output out = { NULL, 0, 0, file };
+  bool ok = encode(&out, args);
+  output_flush(&out);
+  free(out.data);
+  if (fclose(file) != 0) ok = false;
+  return pointer_to(ok ? NIL+1 : NIL);
+}
+
+Node * deserialize_file(Node * args, Node ** env)
+{
+  if (args->type != TYPE_STRING)
+  {
+    printf("Runtime error: deserialize-file expects a file name string.\n");
+    return pointer_to(NIL);
+  }
+
+  const char * path = string_chars(args);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    if (fd >= 0) close(fd);
+    printf("Runtime error: cannot read '%s'.\n", path);
+    return pointer_to(NIL);
+  }
+
+  void * data = st.st_size == 0 ? MAP_FAILED : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return decoded(NULL);
+
+  Node * result = decode(data, st.st_size);
+  munmap(data, st.st_size);
+  return decoded(result);
+}
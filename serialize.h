@@ -0,0 +1,31 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include "node.h"
+
+/**
+ * Binary encoding of a value's node graph, for exchanging data between
+ * unpair processes without printing and parsing:
+ *
+ *   "UNPB" format
+ *   num_strings { length chars }
+ *   num_nodes { tag value [next] }
+ *
+ * All numbers are LEB128 varints. Strings and labels are emitted once, and
+ * referred to by number. Nodes are numbered in order of appearance, the
+ * value being node 0; references are 0 for nil, 1 for true and the node's
+ * number + 2 otherwise, so that shared substructure (and cycles) survive.
+ * The tag holds the node type and flags; ints are zigzag encoded.
+ */
+#define SERIALIZE_MAGIC "UNPB"
+#define SERIALIZE_FORMAT 1
+
+// (serialize x) and (deserialize bytes)
+Node * serialize(Node * args, Node ** env);
+Node * deserialize(Node * args, Node ** env);
+
+// (serialize-to-file x "file") and (deserialize-file "file")
+Node * serialize_to_file(Node * args, Node ** env);
+Node * deserialize_file(Node * args, Node ** env);
+
+#endif /* SERIALIZE_H */
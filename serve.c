@@ -0,0 +1,315 @@
+/**
+ * REPL server over a Unix domain socket; see serve.h.
+ *
+ * A single thread runs the interpreter and the epoll loop alike. What the
+ * interpreter prints goes to a capture file that stdout is redirected to,
+ * and is moved into the client's response after every request; status
+ * messages go to stderr.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "node.h"
+#include "memory.h"
+#include "parse.h"
+#include "transform.h"
+#include "eval.h"
+#include "print.h"
+#include "gc.h"
+#include "serve.h"
+
+#define MAX_EVENTS 64
+#define READ_CHUNK (64 * 1024)
+
+typedef struct Client {
+  int fd;
+  uint32_t events; // the ones we are polling for
+  Output in;       // received, but not yet evaluated
+  Output out;      // responses, not yet sent
+  size_t sent;     // of 'out'
+} Client;
+
+static bool make_address(const char * path, struct sockaddr_un * address)
+{
+  if (strlen(path) >= sizeof(address->sun_path))
+  {
+    fprintf(stderr, "Socket path too long: '%s'\n", path);
+    return false;
+  }
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  strcpy(address->sun_path, path);
+  return true;
+}
+
+// Move what the interpreter printed into 'out'
+static void take_output(Output * out)
+{
+  fflush(stdout);
+  off_t size = lseek(STDOUT_FILENO, 0, SEEK_END);
+  if (size > 0)
+  {
+    char * data = malloc(size);
+    ssize_t n = pread(STDOUT_FILENO, data, size, 0);
+    if (n > 0) output_chars(out, data, n);
+    free(data);
+  }
+  if (ftruncate(STDOUT_FILENO, 0) != 0) perror("Capture");
+  lseek(STDOUT_FILENO, 0, SEEK_SET);
+}
+
+// Evaluate one request, and append the framed response to 'out'
+static void evaluate(const char * chars, size_t len, Output * out)
+{
+  size_t start = out->len;
+  output_chars(out, "\0\0\0\0", 4); // length, filled in below
+
+  set_instring(chars, len);
+  Node * node;
+  while ((node = parse()) != NULL)
+  {
+    node = transform(node, &context->environment, context->environment);
+    if (node == NULL) continue;
+    if (!node->special) node = eval(node, context->environment);
+    print(node);
+    collect_garbage();
+  }
+  take_output(out);
+
+  uint32_t size = htonl(out->len - start - 4);
+  memcpy(out->data + start, &size, 4);
+}
+
+// Evaluate the complete requests received so far; false on a bad frame
+static bool handle_requests(Client * client)
+{
+  size_t pos = 0;
+  while (client->in.len - pos >= 4)
+  {
+    uint32_t len;
+    memcpy(&len, client->in.data + pos, 4);
+    len = ntohl(len);
+    if (len > MAX_REQUEST) return false;
+    if (client->in.len - pos - 4 < len) break;
+
+    evaluate(client->in.data + pos + 4, len, &client->out);
+    pos += 4 + len;
+  }
+
+  memmove(client->in.data, client->in.data + pos, client->in.len - pos);
+  client->in.len -= pos;
+  return true;
+}
+
+// Read what there is; false once the client is gone
+static bool receive(Client * client)
+{
+  while (true)
+  {
+    if (client->in.size - client->in.len < READ_CHUNK)
+    {
+      client->in.size = client->in.len + READ_CHUNK;
+      client->in.data = realloc(client->in.data, client->in.size);
+    }
+
+    ssize_t n = read(client->fd, client->in.data + client->in.len, client->in.size - client->in.len);
+    if (n > 0)
+    {
+      client->in.len += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+
+    // Answer what did come in, even if the client hung up after it
+    bool ok = handle_requests(client);
+    return ok && n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+}
+
+// Send what we can; false if the client is gone
+static bool send_pending(Client * client)
+{
+  while (client->sent < client->out.len)
+  {
+    ssize_t n = send(client->fd, client->out.data + client->sent, client->out.len - client->sent, MSG_NOSIGNAL);
+    if (n >= 0) client->sent += n;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+    else if (errno != EINTR) return false;
+  }
+
+  if (client->sent == client->out.len) client->sent = client->out.len = 0;
+  return true;
+}
+
+static void watch(int epoll, Client * client)
+{
+  uint32_t events = EPOLLIN | (client->out.len > 0 ? EPOLLOUT : 0);
+  if (events == client->events) return;
+
+  struct epoll_event event = { events, { .ptr = client } };
+  epoll_ctl(epoll, EPOLL_CTL_MOD, client->fd, &event);
+  client->events = events;
+}
+
+static void drop(int epoll, Client * client)
+{
+  epoll_ctl(epoll, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  free(client->in.data);
+  free(client->out.data);
+  free(client);
+}
+
+static void accept_clients(int epoll, int server)
+{
+  int fd;
+  while ((fd = accept(server, NULL, NULL)) >= 0)
+  {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    Client * client = calloc(1, sizeof(Client));
+    client->fd = fd;
+    client->events = EPOLLIN;
+
+    struct epoll_event event = { EPOLLIN, { .ptr = client } };
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+      perror("Server epoll");
+      close(fd);
+      free(client);
+    }
+  }
+}
+
+int run_server(const char * path)
+{
+  struct sockaddr_un address;
+  if (!make_address(path, &address)) return 1;
+
+  int server = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (server < 0 || bind(server, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(server, SOMAXCONN) != 0)
+  {
+    perror("Server socket");
+    return 1;
+  }
+
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = { EPOLLIN, { .ptr = NULL } };
+  epoll_ctl(epoll, EPOLL_CTL_ADD, server, &event);
+
+  // Start out with a tidy heap, and capture all that is printed from here on
+  collect_garbage();
+  fflush(stdout);
+  FILE * capture = tmpfile();
+  dup2(fileno(capture), STDOUT_FILENO);
+  fprintf(stderr, "Serving on %s\n", path);
+
+  struct epoll_event events[MAX_EVENTS];
+  while (true)
+  {
+    int n = epoll_wait(epoll, events, MAX_EVENTS, -1);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      perror("Server epoll");
+      break;
+    }
+
+    for (int i=0; i<n; i++)
+    {
+      Client * client = events[i].data.ptr;
+      if (client == NULL)
+      {
+        accept_clients(epoll, server);
+        continue;
+      }
+
+      bool ok = true;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ok = receive(client);
+      // Even a client that has hung up gets what it asked for, if it can
+      ok = send_pending(client) && ok;
+      if (ok) watch(epoll, client);
+      else drop(epoll, client);
+    }
+  }
+
+  close(epoll);
+  close(server);
+  unlink(path);
+  return 1;
+}
+
+static bool write_all(int fd, const char * data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool read_all(int fd, char * data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = read(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+int run_client(const char * path)
+{
+  // The request: all of stdin, after room for its length
+  Output request = { NULL, 0, 0, NULL };
+  output_chars(&request, "\0\0\0\0", 4);
+  char chunk[READ_CHUNK];
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) > 0)
+    output_chars(&request, chunk, n);
+
+  uint32_t len = htonl(request.len - 4);
+  memcpy(request.data, &len, 4);
+
+  struct sockaddr_un address;
+  if (!make_address(path, &address)) return 1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0)
+  {
+    perror("Cannot connect");
+    return 1;
+  }
+
+  bool ok = write_all(fd, request.data, request.len) && read_all(fd, (char *) &len, 4);
+  if (ok)
+  {
+    len = ntohl(len);
+    char * response = malloc(len > 0 ? len : 1);
+    ok = read_all(fd, response, len) && write_all(STDOUT_FILENO, response, len);
+    free(response);
+  }
+  if (!ok) fprintf(stderr, "Lost connection to %s\n", path);
+
+  close(fd);
+  free(request.data);
+  return ok ? 0 : 1;
+}
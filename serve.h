@@ -0,0 +1,27 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+/**
+ * REPL server: keep one warm interpreter (heap, macros, environment,
+ * lib.lisp loaded) and evaluate requests from any number of clients
+ * on a Unix domain socket, multiplexed with epoll.
+ *
+ * Requests and responses alike are framed as a 4-byte length in network
+ * byte order, followed by that many bytes. A request holds one or more
+ * forms; the response holds what evaluating them printed, including
+ * their results. Requests are evaluated one at a time, in the order in
+ * which they come in, and all clients share the one environment.
+ *
+ * Runs until killed. Returns the process exit status.
+ */
+int run_server(const char * path);
+
+/**
+ * Send stdin as a single request to the server at 'path', and write the
+ * response to stdout. Returns the process exit status.
+ */
+int run_client(const char * path);
+
+#define MAX_REQUEST (16 * 1024 * 1024)
+
+#endif /* SERVE_H */
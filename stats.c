@@ -0,0 +1,606 @@
+/**
+ * Heap census, GC statistics, timing, call counts and allocation profile;
+ * see stats.h.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "node.h"
+#include "memory.h"
+#include "print.h"
+#include "gc.h"
+#include "future.h"
+#include "idmap.h"
+#include "eval.h"
+#include "primitive.h"
+#include "stats.h"
+
+#define TOP_FUNCTIONS 20
+#define LABEL_SIZE 23
+#define BRANCH_LABEL_SIZE 48
+
+bool alloc_profiling;
+
+__thread AllocSite alloc_site;
+__thread uint32_t alloc_function;
+__thread uint32_t primitive_site;
+
+static const char * site_names[NUM_SITES] = {
+  "other", "parser", "transform", "eval_and_chain", "instantiate_template", "copy", "element", "primitive"
+};
+
+static uint64_t site_counts[NUM_SITES];
+
+// Nodes allocated per function, by name; or for anonymous lambdas, by code
+typedef struct Function {
+  char * label;
+  uint64_t count;
+  uint64_t calls; // when counting calls
+} Function;
+
+static Function * functions;
+static uint32_t num_functions;
+static uint32_t functions_size;
+
+// Which function each lambda body seen belongs to. The GC may free the
+// bodies and reuse their nodes, so this is forgotten after a collection.
+static IdMap bodies;
+static uint32_t * body_functions;
+static uint64_t collections_seen;
+
+static const char * function_name(uint32_t body);
+
+// The number of a new or existing function by the given label
+static uint32_t find_function(const char * label)
+{
+  for (uint32_t i=0; i<num_functions; i++)
+    if (strcmp(functions[i].label, label) == 0) return i;
+
+  if (num_functions == functions_size)
+  {
+    functions_size = functions_size == 0 ? 64 : functions_size * 2;
+    functions = realloc(functions, sizeof(Function) * functions_size);
+  }
+  functions[num_functions] = (Function) { strdup(label), 0, 0 };
+  return num_functions++;
+}
+
+// The function that runs the given body, by name or else by code
+static uint32_t label_function(uint32_t body)
+{
+  char label[LABEL_SIZE];
+  const char * name = body == 0 ? "(top level)" : function_name(body);
+  if (name != NULL) snprintf(label, sizeof(label), "%s", name);
+  else
+  {
+    // An anonymous lambda: show the start of its body
+    Output code = { NULL, 0, 0, NULL };
+    write_node(&code, pointer(body));
+    snprintf(label, sizeof(label), "%.*s", (int) code.len, code.data);
+    free(code.data);
+  }
+  return find_function(label);
+}
+
+static void forget_code();
+
+uint32_t function_of(uint32_t body)
+{
+  forget_code();
+
+  uint32_t seen = bodies.count;
+  uint32_t id = map_add(&bodies, body);
+  if (bodies.count > seen)
+  {
+    body_functions = realloc(body_functions, sizeof(uint32_t) * bodies.size);
+    body_functions[id] = label_function(body);
+  }
+  return body_functions[id];
+}
+
+const char * function_label(uint32_t function)
+{
+  return functions[function].label;
+}
+
+void count_allocation(uint32_t n)
+{
+  __atomic_fetch_add(&site_counts[alloc_site], n, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&context->heap_lock); // as other threads may allocate too
+  uint32_t function = function_of(alloc_function); // which may move 'functions'
+  functions[function].count += n;
+  pthread_mutex_unlock(&context->heap_lock);
+}
+
+//
+// Call counts
+//
+
+bool call_counting;
+
+static uint64_t primitive_calls[MAX_PRIMITIVES];
+
+// How often each 'if' took either branch, by function and code
+typedef struct Branch {
+  char * label;
+  uint64_t taken[2]; // else, then
+} Branch;
+
+static Branch * branches;
+static uint32_t num_branches;
+static uint32_t branches_size;
+
+// The 'if's seen, by their node in the code, and which branch they count
+// as. As the code may be freed, they too are forgotten after a collection.
+typedef struct IfSite {
+  uint32_t branch; // + 1; 0 = empty slot
+  uint32_t node;
+} IfSite;
+
+static IfSite * if_sites;
+static uint32_t if_sites_size;
+static uint32_t num_if_sites;
+
+// Forget the code seen before the last collection
+static void forget_code()
+{
+  uint64_t collections = context->collections + context->young_collections;
+  if (collections == collections_seen) return;
+
+  map_free(&bodies);
+  bodies = (IdMap) { 0 };
+  if (if_sites != NULL) memset(if_sites, 0, sizeof(IfSite) * if_sites_size);
+  num_if_sites = 0;
+  collections_seen = collections;
+}
+
+// Count the 'if's in the code before the given one that have the same
+// branches, as their labels would be the same too
+static bool count_same_ifs(Node * code, uint32_t node, uint32_t if_number, Output * branches, int * same)
+{
+  for (; code != NIL; code = pointer(code->next))
+  {
+    if (index(code) == node) return true;
+    if (code->type == TYPE_PRIMITIVE && code->value.u32 == if_number)
+    {
+      Output other = { NULL, 0, 0, NULL };
+      write_node(&other, pointer(pointer(code->next)->next));
+      if (other.len == branches->len && memcmp(other.data, branches->data, other.len) == 0) (*same)++;
+      free(other.data);
+    }
+    if (code->type == TYPE_NODE && !code->array && count_same_ifs(pointer(code->value.u32), node, if_number, branches, same))
+      return true;
+  }
+  return false;
+}
+
+static uint32_t find_branch(uint32_t node)
+{
+  // The label has the function that runs it and the code of its branches,
+  // (if _ then else), numbered if the function has more such 'if's
+  Node * thenn = pointer(pointer(memory[node].next)->next);
+  Output code = { NULL, 0, 0, NULL };
+  write_node(&code, thenn);
+  int same = 0;
+  if (alloc_function != 0 && !count_same_ifs(pointer(alloc_function), node, memory[node].value.u32, &code, &same)) same = 0;
+
+  const char * function = function_label(function_of(alloc_function));
+  char label[BRANCH_LABEL_SIZE];
+  if (same == 0) snprintf(label, sizeof(label), "%s: (if _ %.*s)", function, (int) code.len, code.data);
+  else snprintf(label, sizeof(label), "%s: #%d (if _ %.*s)", function, same + 1, (int) code.len, code.data);
+  free(code.data);
+
+  for (uint32_t i=0; i<num_branches; i++)
+    if (strcmp(branches[i].label, label) == 0) return i;
+
+  if (num_branches == branches_size)
+  {
+    branches_size = branches_size == 0 ? 64 : branches_size * 2;
+    branches = realloc(branches, sizeof(Branch) * branches_size);
+  }
+  branches[num_branches] = (Branch) { strdup(label), { 0, 0 } };
+  return num_branches++;
+}
+
+void count_lambda_call(uint32_t body)
+{
+  pthread_mutex_lock(&context->heap_lock);
+  uint32_t function = function_of(body);
+  functions[function].calls++;
+  pthread_mutex_unlock(&context->heap_lock);
+}
+
+void count_primitive_call(int num)
+{
+  __atomic_fetch_add(&primitive_calls[num], 1, __ATOMIC_RELAXED);
+}
+
+static IfSite * find_if_site(uint32_t node)
+{
+  uint32_t mask = if_sites_size - 1;
+  uint32_t i = node * 2654435761u & mask;
+  while (if_sites[i].branch != 0 && if_sites[i].node != node)
+    i = (i + 1) & mask;
+  return &if_sites[i];
+}
+
+void count_branch(bool taken)
+{
+  pthread_mutex_lock(&context->heap_lock);
+  forget_code();
+
+  if ((num_if_sites + 1) * 2 > if_sites_size)
+  {
+    IfSite * old = if_sites;
+    uint32_t old_size = if_sites_size;
+    if_sites_size = if_sites_size == 0 ? 256 : if_sites_size * 2;
+    if_sites = calloc(if_sites_size, sizeof(IfSite));
+    for (uint32_t i=0; i<old_size; i++)
+      if (old[i].branch != 0) *find_if_site(old[i].node) = old[i];
+    free(old);
+  }
+
+  IfSite * site = find_if_site(primitive_site);
+  if (site->branch == 0)
+  {
+    *site = (IfSite) { find_branch(primitive_site) + 1, primitive_site };
+    num_if_sites++;
+  }
+  branches[site->branch - 1].taken[taken]++;
+  pthread_mutex_unlock(&context->heap_lock);
+}
+
+// Compare by descending counts, for qsort
+#define COMPARE_DOWN(x, y) ((x) < (y) ? 1 : (x) > (y) ? -1 : 0)
+
+static int compare_counts(const void * a, const void * b)
+{
+  return COMPARE_DOWN(functions[*(const uint32_t *) a].count, functions[*(const uint32_t *) b].count);
+}
+
+static int compare_calls(const void * a, const void * b)
+{
+  return COMPARE_DOWN(functions[*(const uint32_t *) a].calls, functions[*(const uint32_t *) b].calls);
+}
+
+static int compare_primitive_calls(const void * a, const void * b)
+{
+  return COMPARE_DOWN(primitive_calls[*(const uint32_t *) a], primitive_calls[*(const uint32_t *) b]);
+}
+
+static uint64_t branch_total(uint32_t branch)
+{
+  return branches[branch].taken[0] + branches[branch].taken[1];
+}
+
+static int compare_branches(const void * a, const void * b)
+{
+  return COMPARE_DOWN(branch_total(*(const uint32_t *) a), branch_total(*(const uint32_t *) b));
+}
+
+// The numbers 0..n-1 in order. Sorting the numbers rather than the tables
+// keeps the tables in order, as the profiler uses them too.
+static uint32_t * sorted(uint32_t n, int (* compare)(const void *, const void *))
+{
+  uint32_t * order = malloc(sizeof(uint32_t) * (n + 1));
+  for (uint32_t i=0; i<n; i++) order[i] = i;
+  qsort(order, n, sizeof(uint32_t), compare);
+  return order;
+}
+
+//
+// Heap census
+//
+
+typedef struct Census {
+  uint32_t total[NUM_TYPES][2]; // [type][array], in nodes
+  uint32_t live[NUM_TYPES][2];
+  uint32_t free_blocks;
+  uint32_t free_nodes;
+  uint32_t largest_free;
+} Census;
+
+static void take_census(Census * census)
+{
+  memset(census, 0, sizeof(Census));
+
+  // Tell the free blocks apart, as they are unreachable just like garbage
+  uint8_t * free_map = calloc(context->memsize / 8 + 1, 1);
+  for (Node * free = context->freelist; free != NIL; free = pointer(free->next))
+  {
+    uint32_t size = node_size(free);
+    census->free_blocks++;
+    census->free_nodes += size;
+    if (size > census->largest_free) census->largest_free = size;
+    free_map[index(free) / 8] |= 1 << (index(free) % 8);
+  }
+
+  // Mark from the roots, as the GC does, but for the census only
+  finish_futures(context);
+  mark_to_count(&memory[0]);
+  mark_to_count(&memory[1]);
+  mark_to_count(context->environment);
+  mark_to_count(context->macros);
+  mark_to_count(context->unique_strings);
+
+  for (uintptr_t i=0; i<context->memsize; i += node_size(&memory[i]))
+  {
+    Node * node = &memory[i];
+    bool live = node->mark;
+    node->mark = false;
+    if (free_map[i / 8] & (1 << (i % 8))) continue;
+
+    census->total[node->type][node->array] += node_size(node);
+    if (live) census->live[node->type][node->array] += node_size(node);
+  }
+  free(free_map);
+}
+
+static uint32_t fragmentation(Census * census)
+{
+  if (census->free_nodes == 0) return 0;
+  return 100 - (uint64_t) census->largest_free * 100 / census->free_nodes;
+}
+
+// Chain (name values...) in front of 'rest'
+static Node * row(const char * name, uint32_t * values, int num_values, Node * rest)
+{
+  Node * items = NIL;
+  for (int i=num_values-1; i>=0; i--)
+    items = chain(TYPE_INT, values[i], items);
+  items = chain(TYPE_ID, index(unique_chars(name, strlen(name))), items);
+  return chain(TYPE_NODE, index(items), rest);
+}
+
+// (heap-stats)
+Node * heap_stats(Node * args, Node ** env)
+{
+  if (context->sharing != 0)
+  {
+    printf("Runtime error: heap-stats while other threads share the heap.\n");
+    return pointer_to(NIL);
+  }
+
+  Census census;
+  take_census(&census);
+
+  Node * rows = NIL;
+  for (int t=NUM_TYPES-1; t>=0; t--)
+  {
+    uint32_t counts[] = { census.total[t][0], census.live[t][0], census.total[t][1], census.live[t][1] };
+    if (counts[0] + counts[2] > 0) rows = row(types[t], counts, 4, rows);
+  }
+
+  uint32_t memsize = context->memsize, percent = fragmentation(&census);
+  rows = row("fragmentation", &percent, 1, rows);
+  rows = row("largest-free", &census.largest_free, 1, rows);
+  rows = row("free-nodes", &census.free_nodes, 1, rows);
+  rows = row("free-list", &census.free_blocks, 1, rows);
+  rows = row("memsize", &memsize, 1, rows);
+  return pointer_to(rows);
+}
+
+// (gc-stats)
+Node * gc_stats(Node * args, Node ** env)
+{
+  Collection * last = &context->last_collection;
+  uint32_t values[] = {
+    context->collections, context->young_collections,
+    context->mark_ns / 1000, context->sweep_ns / 1000, context->max_pause_ns / 1000,
+    context->region_resets, context->region_freed,
+    last->young, last->mark_ns / 1000, last->sweep_ns / 1000, last->marked, last->freed,
+    last->used_before, last->used_after, last->memsize, last->free_blocks, last->fragmentation
+  };
+  const char * names[] = {
+    "collections", "young-collections", "mark-us", "sweep-us", "max-pause-us",
+    "region-resets", "region-freed",
+    "last-young", "last-mark-us", "last-sweep-us", "last-marked", "last-freed",
+    "last-used-before", "last-used-after", "last-memsize", "last-free-list", "last-fragmentation"
+  };
+
+  Node * rows = NIL;
+  for (int i=sizeof(values) / sizeof(values[0]) - 1; i>=0; i--)
+    rows = row(names[i], &values[i], 1, rows);
+  return pointer_to(rows);
+}
+
+// Chain (name rows...) in front of 'rest'
+static Node * section(const char * name, Node * rows, Node * rest)
+{
+  Node * items = chain(TYPE_ID, index(unique_chars(name, strlen(name))), rows);
+  return chain(TYPE_NODE, index(items), rest);
+}
+
+// As a Lisp integer
+static uint32_t clamp(uint64_t count)
+{
+  return count > INT32_MAX ? INT32_MAX : count;
+}
+
+// (call-stats)
+Node * call_stats(Node * args, Node ** env)
+{
+  pthread_mutex_lock(&context->heap_lock);
+
+  Node * rows = NIL;
+  uint32_t * order = sorted(num_branches, compare_branches);
+  for (uint32_t i=num_branches; i-- > 0; )
+  {
+    Branch * b = &branches[order[i]];
+    uint32_t taken[] = { clamp(b->taken[1]), clamp(b->taken[0]) };
+    rows = row(b->label, taken, 2, rows);
+  }
+  free(order);
+  Node * result = section("branches", rows, NIL);
+
+  rows = NIL;
+  order = sorted(num_primitives, compare_primitive_calls);
+  for (int i=num_primitives; i-- > 0; )
+  {
+    uint32_t calls = clamp(primitive_calls[order[i]]);
+    if (calls > 0) rows = row(primitives[order[i]].name, &calls, 1, rows);
+  }
+  free(order);
+  result = section("primitives", rows, result);
+
+  rows = NIL;
+  order = sorted(num_functions, compare_calls);
+  for (uint32_t i=num_functions; i-- > 0; )
+  {
+    uint32_t calls = clamp(functions[order[i]].calls);
+    if (calls > 0) rows = row(functions[order[i]].label, &calls, 1, rows);
+  }
+  free(order);
+  result = section("lambdas", rows, result);
+
+  pthread_mutex_unlock(&context->heap_lock);
+  return pointer_to(result);
+}
+
+//
+// Timing
+//
+
+typedef struct Cost {
+  double wall;
+  double cpu;
+  uint64_t nodes_allocated;
+  uintptr_t peak_memsize;
+  uint64_t lambda_calls;
+  uint64_t primitive_calls;
+  uint64_t collections;
+  uint64_t young_collections;
+} Cost;
+
+static double seconds(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void measure_cost(Cost * cost)
+{
+  // The GC only keeps track of the peak when it runs
+  if (context->memsize > context->peak_memsize) context->peak_memsize = context->memsize;
+
+  *cost = (Cost) {
+    seconds(CLOCK_MONOTONIC), seconds(CLOCK_PROCESS_CPUTIME_ID),
+    context->nodes_allocated, context->peak_memsize, context->lambda_calls, context->primitive_calls,
+    context->collections, context->young_collections
+  };
+}
+
+// (time expr)
+Node * time_eval(Node * args, Node ** env)
+{
+  Cost before, after;
+  measure_cost(&before);
+  Node * result = eval(args, *env);
+  measure_cost(&after);
+
+  printf("Time: %.3f ms wall, %.3f ms CPU; %lu nodes allocated, peak memsize +%lu; "
+    "%lu lambda calls, %lu primitive calls; %lu collections, %lu young\n",
+    (after.wall - before.wall) * 1e3, (after.cpu - before.cpu) * 1e3,
+    (unsigned long) (after.nodes_allocated - before.nodes_allocated),
+    (unsigned long) (after.peak_memsize - before.peak_memsize),
+    (unsigned long) (after.lambda_calls - before.lambda_calls),
+    (unsigned long) (after.primitive_calls - before.primitive_calls),
+    (unsigned long) (after.collections - before.collections),
+    (unsigned long) (after.young_collections - before.young_collections));
+  return result;
+}
+
+//
+// Report
+//
+
+// The name that a lambda body was defined under, if any
+static const char * function_name(uint32_t body)
+{
+  for (Node * env = context->environment; env != NIL; env = pointer(env->next))
+  {
+    Node * var = pointer(env->value.u32);
+    Node * value = pointer(var->next);
+    if (var->next == 0 || value->type != TYPE_FUNC) continue;
+
+    Node * env_node = pointer(pointer(value->value.u32)->next);
+    if (memory[env_node->next].next == body) return strval(pointer(var->value.u32));
+  }
+  return NULL;
+}
+
+static double percent_of(uint64_t n, uint64_t total)
+{
+  return total == 0 ? 0 : n * 100.0 / total;
+}
+
+void print_alloc_profile(FILE * out)
+{
+  Census census;
+  take_census(&census);
+
+  fprintf(out, "\nHeap: %lu nodes; free list %u blocks, %u nodes, largest %u (%u%% fragmented)\n",
+    (unsigned long) context->memsize, census.free_blocks, census.free_nodes, census.largest_free, fragmentation(&census));
+  fprintf(out, "%-12s %10s %10s %10s %10s\n", "type", "singles", "live", "arrays", "live");
+  for (int t=0; t<NUM_TYPES; t++)
+    if (census.total[t][0] + census.total[t][1] > 0)
+      fprintf(out, "%-12s %10u %10u %10u %10u\n", types[t],
+        census.total[t][0], census.live[t][0], census.total[t][1], census.live[t][1]);
+
+  uint64_t total = 0;
+  for (int s=0; s<NUM_SITES; s++) total += site_counts[s];
+
+  fprintf(out, "\nNodes allocated: %lu\n", (unsigned long) total);
+  for (int s=0; s<NUM_SITES; s++)
+    if (site_counts[s] > 0)
+      fprintf(out, "  %-22s %12lu %6.1f%%\n", site_names[s], (unsigned long) site_counts[s], percent_of(site_counts[s], total));
+
+  uint32_t * order = sorted(num_functions, compare_counts);
+  for (uint32_t i=0; i<num_functions && i<TOP_FUNCTIONS; i++)
+  {
+    Function * f = &functions[order[i]];
+    if (f->count == 0) break;
+    if (i == 0) fprintf(out, "\nNodes allocated by function:\n");
+    fprintf(out, "  %-22s %12lu %6.1f%%\n", f->label, (unsigned long) f->count, percent_of(f->count, total));
+  }
+  free(order);
+}
+
+void print_call_stats(FILE * out)
+{
+  pthread_mutex_lock(&context->heap_lock);
+
+  uint32_t * order = sorted(num_functions, compare_calls);
+  for (uint32_t i=0; i<num_functions && functions[order[i]].calls > 0; i++)
+  {
+    if (i == 0) fprintf(out, "\nCalls by function:\n");
+    fprintf(out, "  %-22s %12lu\n", functions[order[i]].label, (unsigned long) functions[order[i]].calls);
+  }
+  free(order);
+
+  order = sorted(num_primitives, compare_primitive_calls);
+  for (int i=0; i<num_primitives && primitive_calls[order[i]] > 0; i++)
+  {
+    if (i == 0) fprintf(out, "\nCalls by primitive:\n");
+    fprintf(out, "  %-22s %12lu\n", primitives[order[i]].name, (unsigned long) primitive_calls[order[i]]);
+  }
+  free(order);
+
+  order = sorted(num_branches, compare_branches);
+  for (uint32_t i=0; i<num_branches; i++)
+  {
+    Branch * b = &branches[order[i]];
+    if (i == 0) fprintf(out, "\nBranches taken: %12s %12s\n", "then", "else");
+    fprintf(out, "  %-*s %12lu %12lu\n", BRANCH_LABEL_SIZE, b->label, (unsigned long) b->taken[1], (unsigned long) b->taken[0]);
+  }
+  free(order);
+
+  pthread_mutex_unlock(&context->heap_lock);
+}
@@ -0,0 +1,117 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "node.h"
+
+/**
+ * Heap census, GC statistics and allocation profile.
+ *
+ * (heap-stats) counts the nodes in the heap by type, as singles and as
+ * arrays (header and value nodes alike), in total and as far as they are
+ * reachable from the global roots (the environment, macros and unique
+ * strings) rather than only from the C stack; plus the free list. It
+ * returns
+ *
+ *   ((memsize n) (free-list blocks) (free-nodes n) (largest-free n)
+ *    (fragmentation percent) (type total live array-total array-live) ...)
+ *
+ * with a row for every type that there are any nodes of. Fragmentation
+ * is the share of the free nodes that are not in the largest free block.
+ *
+ * (gc-stats) returns what the garbage collector did so far: the number
+ * of full and young collections, the time spent marking and sweeping in
+ * microseconds and the longest pause; and of the last collection, whether
+ * it was young, its mark and sweep time, the nodes marked and freed, the
+ * nodes in use (not on the free list) before and after, the heap size,
+ * the blocks on the free list and their fragmentation, as
+ *
+ *   ((collections n) (young-collections n) (mark-us n) ... (last-young 0|1) ...)
+ *
+ * Setting UNPAIR_GC_TRACE in the environment logs the same for every
+ * collection, one line each: to stderr if it is 1, else to the named file.
+ *
+ * With 'alloc_profiling' on (see --alloc-profile), new_node and
+ * new_array_node count the nodes that they allocate by the site that
+ * they are called from, and by the Lisp function that is executing.
+ */
+typedef enum AllocSite {
+  SITE_OTHER,
+  SITE_PARSER,
+  SITE_TRANSFORM,
+  SITE_EVAL_AND_CHAIN,
+  SITE_TEMPLATE,  // instantiate_template
+  SITE_COPY,
+  SITE_ELEMENT,
+  SITE_PRIMITIVE,
+  NUM_SITES
+} AllocSite;
+
+extern bool alloc_profiling;
+
+// Where the present thread allocates, and the body of the lambda that it
+// runs (0 at top level)
+extern __thread AllocSite alloc_site;
+extern __thread uint32_t alloc_function;
+
+// Attribute what is allocated up to 'end_alloc_site' to 'site'
+#define begin_alloc_site(site) AllocSite outer_site = alloc_site; alloc_site = site
+#define end_alloc_site() alloc_site = outer_site
+
+void count_allocation(uint32_t n);
+
+/**
+ * The number of the function that runs a lambda body, and its label:
+ * the name it was defined under or else the start of its code. Bodies
+ * are only told apart until the next collection. Callers that may run
+ * alongside other threads hold the heap lock.
+ */
+uint32_t function_of(uint32_t body);
+const char * function_label(uint32_t function);
+
+Node * heap_stats(Node * args, Node ** env);
+Node * gc_stats(Node * args, Node ** env);
+
+/**
+ * With 'call_counting' on (see --call-stats), run_lambda counts the calls
+ * per function, labelled as by function_label; call_primitive the calls
+ * per primitive; and 'if' which branch it takes, labelled by the function
+ * that it is in and the code of its branches, and numbered when that
+ * function has several such 'if's. (call-stats) returns the
+ * counts so far, each list sorted by count, as
+ *
+ *   ((lambdas (name calls) ...) (primitives (name calls) ...)
+ *    (branches (label then-count else-count) ...))
+ *
+ * and print_call_stats prints them.
+ */
+extern bool call_counting;
+
+void count_lambda_call(uint32_t body);
+void count_primitive_call(int num);
+void count_branch(bool taken);
+
+// The code node of the primitive call that is about to run, as set by
+// run_primitive while counting calls, which tells 'if's apart
+extern __thread uint32_t primitive_site;
+
+Node * call_stats(Node * args, Node ** env);
+void print_call_stats(FILE * out);
+
+/**
+ * (time expr) evaluates expr and returns its value, after printing the
+ * wall and CPU time taken, the nodes allocated, how much the peak heap
+ * size grew, the lambdas and primitives called and the collections run.
+ * The CPU time is that of the process, so includes any other threads.
+ */
+Node * time_eval(Node * args, Node ** env);
+
+/**
+ * Print the heap census and the allocation profile.
+ */
+void print_alloc_profile(FILE * out);
+
+#endif /* STATS_H */
@@ -0,0 +1,440 @@
+/**
+ * Promises, lazy streams and generators; see stream.h.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "node.h"
+#include "memory.h"
+#include "eval.h"
+#include "gc.h"
+#include "primitive.h"
+#include "stream.h"
+
+// The first cell of a (TYPE_NODE) stream value
+#define cells(val) ((val)->type == TYPE_NODE ? pointer((val)->value.u32) : NIL)
+
+#define is_true(val) ((val) != NIL && (val)->value.u32 != 0)
+
+#define GENERATOR_STACK (8 * 1024 * 1024)
+
+// The generator that is presently running on this thread, if any
+static __thread Generator * running;
+
+// Numbers every time that a generator is resumed; 0 outside of generators
+static __thread uint64_t resumption;
+static __thread uint64_t resumptions;
+
+uint64_t current_resumption()
+{
+  return resumption;
+}
+
+// Make a chainable copy of a single value, for use as function argument
+static Node * arg(Node * value, Node * next)
+{
+  Node * result = copy(value, 0);
+  result->element = false;
+  result->special = false;
+  result->next = index(next);
+  return result;
+}
+
+// As 'arg', but to be passed on as is when evaluated as code
+static Node * data(Node * value, Node * next)
+{
+  Node * result = arg(value, next);
+  result->special = true;
+  return result;
+}
+
+// Code that calls the named primitive on the given args
+static Node * call(const char * name, Node * args)
+{
+  Node * prim = new_node(TYPE_PRIMITIVE, find_primitive(name));
+  prim->element = false;
+  prim->next = index(args);
+
+  Node * code = new_node(TYPE_NODE, index(prim));
+  code->element = false;
+  return code;
+}
+
+static Node * promise(Node * code, Node * env)
+{
+  Node * box = new_array_node(TYPE_PROMISE, sizeof(PromiseBox));
+  *promise_box(box) = (PromiseBox) { index(code), index(env), 0, false };
+  return new_node(TYPE_PROMISE, index(box));
+}
+
+// A stream cell (value . tail)
+static Node * cell(Node * value, Node * tail)
+{
+  Node * head = arg(value, NIL);
+  tail = copy(tail, 0);
+  tail->element = true;
+  head->next = index(tail);
+  return new_node(TYPE_NODE, index(head));
+}
+
+Node * delay(Node * args, Node ** env)
+{
+  return promise(args, *env);
+}
+
+Node * force(Node * args, Node ** env)
+{
+  if (args->type != TYPE_PROMISE) return element(args);
+
+  PromiseBox * box = promise_box(pointer(args->value.u32));
+  if (!box->forced)
+  {
+    Node * value = eval(pointer(box->code), pointer(box->env));
+    // Evaluating may have forced the promise already
+    if (!box->forced)
+    {
+      value = copy(value, 0);
+      value->element = false;
+      box->value = index(value);
+      box->forced = true;
+    }
+  }
+  return element(pointer(box->value));
+}
+
+static Node * resume(Generator * gen);
+
+// The rest of the stream after its first cell
+static Node * rest(Node * stream)
+{
+  Node * head = cells(stream);
+  if (head == NIL) return pointer_to(NIL);
+
+  Node * tail = pointer(head->next);
+  if (!tail->element || tail == NIL) return pointer_to(tail);
+
+  if (tail->type == TYPE_PROMISE) return force(tail, NULL);
+  if (tail->type == TYPE_GENERATOR)
+  {
+    Generator * gen = generator_of(pointer(tail->value.u32));
+    if (index(head) == gen->current) return resume(gen);
+    if (index(head) == gen->previous) return pointer_to(pointer(gen->current));
+    printf("Runtime error: generator streams can be walked only once.\n");
+    return pointer_to(NIL);
+  }
+  return copy(tail, 0);
+}
+
+// The first value of a non-empty stream
+static Node * first(Node * stream)
+{
+  return element(cells(stream));
+}
+
+Node * stream_cdr(Node * args, Node ** env)
+{
+  return rest(args);
+}
+
+// (stream-map f s)
+Node * stream_map(Node * args, Node ** env)
+{
+  Node * func = args;
+  Node * stream = pointer(func->next);
+  if (cells(stream) == NIL) return pointer_to(NIL);
+
+  Node * value = apply_values(func, arg(first(stream), NIL), *env);
+  Node * code = call("stream-map", data(func, call("stream-cdr", data(stream, NIL))));
+  return cell(value, promise(code, NIL));
+}
+
+// (stream-filter pred s)
+Node * stream_filter(Node * args, Node ** env)
+{
+  Node * pred = args;
+  Node * stream = pointer(pred->next);
+
+  while (cells(stream) != NIL)
+  {
+    Node * value = first(stream);
+    if (is_true(apply_values(pred, arg(value, NIL), *env)))
+    {
+      Node * code = call("stream-filter", data(pred, call("stream-cdr", data(stream, NIL))));
+      return cell(value, promise(code, NIL));
+    }
+    stream = rest(stream);
+  }
+  return pointer_to(NIL);
+}
+
+// (stream-take n s)
+Node * stream_take(Node * args, Node ** env)
+{
+  Node * stream = pointer(args->next);
+  if (args->value.i32 <= 0 || cells(stream) == NIL) return pointer_to(NIL);
+
+  Node * n = new_node(TYPE_INT, args->value.i32 - 1);
+  Node * code = call("stream-take", data(n, call("stream-cdr", data(stream, NIL))));
+  return cell(first(stream), promise(code, NIL));
+}
+
+// (stream->list s): the whole of a finite stream
+Node * stream_to_list(Node * args, Node ** env)
+{
+  Node * stream = args;
+  Node * list = pointer_to(NIL);
+  Node * tail = NIL;
+
+  Young young;
+  begin_young(&young);
+  Node * roots[] = { list, stream, *env };
+
+  while (cells(stream) != NIL)
+  {
+    Node * value = arg(first(stream), NIL);
+    if (tail == NIL) list->value.u32 = index(value);
+    else tail->next = index(value);
+    tail = value;
+    roots[1] = stream = rest(stream);
+    collect_young(&young, roots, 3);
+  }
+
+  end_young(&young);
+  return list;
+}
+
+// (stream-for-each f s)
+Node * stream_for_each(Node * args, Node ** env)
+{
+  Node * func = args;
+  Node * stream = pointer(func->next);
+
+  Young young;
+  begin_young(&young);
+  // Not the argument list itself, which holds on to the start of the stream
+  Node * roots[] = { arg(func, NIL), stream, *env };
+
+  while (cells(stream) != NIL)
+  {
+    apply_values(func, arg(first(stream), NIL), *env);
+    roots[1] = stream = rest(stream);
+    collect_young(&young, roots, 3);
+  }
+
+  end_young(&young);
+  return pointer_to(NIL);
+}
+
+// (stream-fold f init s) => (f (f (f init x1) x2) x3), like fold-left
+Node * stream_fold(Node * args, Node ** env)
+{
+  Node * func = args;
+  Node * acc = pointer(func->next);
+  Node * stream = pointer(acc->next);
+
+  Young young;
+  begin_young(&young);
+  // Not the argument list itself, which holds on to the start of the stream
+  Node * roots[] = { arg(func, NIL), arg(acc, NIL), stream, *env };
+
+  while (cells(stream) != NIL)
+  {
+    roots[1] = acc = apply_values(func, arg(acc, arg(first(stream), NIL)), *env);
+    roots[2] = stream = rest(stream);
+    collect_young(&young, roots, 4);
+  }
+
+  end_young(&young);
+  return element(acc);
+}
+
+//
+// Generators
+//
+
+static void generator_main()
+{
+  Generator * gen = running;
+  apply_values(gen->thunk, NIL, NIL);
+  gen->state = GENERATOR_DONE;
+  // Returns to the caller through uc_link
+}
+
+// Run the generator up to its next yield, and return the next cell
+static Node * resume(Generator * gen)
+{
+  if (gen->state == GENERATOR_DONE) return pointer_to(NIL);
+  if (gen->state == GENERATOR_RUNNING)
+  {
+    printf("Runtime error: generator is running already.\n");
+    return pointer_to(NIL);
+  }
+
+  Generator * resumer = running;
+  uint64_t resumer_resumption = resumption;
+  running = gen;
+  resumption = ++resumptions;
+  gen->state = GENERATOR_RUNNING;
+  swapcontext(&gen->caller, &gen->self);
+  running = resumer;
+  resumption = resumer_resumption;
+
+  if (gen->state == GENERATOR_DONE) return pointer_to(NIL);
+
+  Node * next = cell(gen->value, new_node(TYPE_GENERATOR, index(gen->box)));
+  gen->value = NULL;
+  gen->previous = gen->current;
+  gen->current = next->value.u32;
+  return next;
+}
+
+// (make-generator thunk)
+Node * make_generator(Node * args, Node ** env)
+{
+  char * stack = mmap(NULL, GENERATOR_STACK, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED)
+  {
+    printf("Runtime error: cannot allocate generator stack.\n");
+    return pointer_to(NIL);
+  }
+  mprotect(stack, getpagesize(), PROT_NONE); // guard page
+
+  Generator * gen = calloc(1, sizeof(Generator));
+  gen->stack = stack;
+  gen->state = GENERATOR_NEW;
+  gen->thunk = args;
+
+  getcontext(&gen->self);
+  gen->self.uc_stack.ss_sp = stack;
+  gen->self.uc_stack.ss_size = GENERATOR_STACK;
+  gen->self.uc_link = &gen->caller;
+  makecontext(&gen->self, generator_main, 0);
+
+  gen->box = new_array_node(TYPE_GENERATOR, sizeof(Generator *));
+  generator_of(gen->box) = gen;
+  pthread_mutex_lock(&context->heap_lock); // as in 'pmap', other threads may be at it too
+  gen->next = context->generators;
+  context->generators = gen;
+  pthread_mutex_unlock(&context->heap_lock);
+
+  // The first value is there straight away
+  return resume(gen);
+}
+
+// (yield x)
+Node * yield(Node * args, Node ** env)
+{
+  Generator * gen = running;
+  if (gen == NULL)
+  {
+    printf("Runtime error: yield outside of a generator.\n");
+    return pointer_to(NIL);
+  }
+
+  char here;
+  gen->sp = &here;
+  gen->value = args;
+  gen->state = GENERATOR_SUSPENDED;
+  swapcontext(&gen->self, &gen->caller);
+
+  return pointer_to(NIL);
+}
+
+//
+// Garbage collection
+//
+
+int mark_promise(Node * box)
+{
+  PromiseBox * promise = promise_box(box);
+  // Once forced, the code is of no more use
+  if (promise->forced)
+  {
+    if (!only_counting()) promise->code = promise->env = 0;
+    mark_later(pointer(promise->value));
+    return 0;
+  }
+  return mark(pointer(promise->code)) + mark(pointer(promise->env));
+}
+
+int mark_generator(Node * box)
+{
+  Generator * gen = generator_of(box);
+  int marked = mark(gen->thunk);
+  if (gen->value != NULL) marked += mark(gen->value);
+  if (gen->current != 0) marked += mark(pointer(gen->current));
+  if (gen->previous != 0) marked += mark(pointer(gen->previous));
+  return marked;
+}
+
+int mark_generator_stacks(bool all)
+{
+  int marked = 0;
+  bool scanned;
+  do
+  {
+    scanned = false;
+    for (Generator * gen = context->generators; gen != NULL; gen = gen->next)
+    {
+      if (gen->scanned) continue;
+
+      // Running generators are on the C stack, which the GC does not see
+      if (gen->state == GENERATOR_RUNNING)
+      {
+        marked += mark(gen->box) + mark_generator(gen->box);
+        gen->scanned = scanned = true;
+      }
+      else if (gen->state == GENERATOR_SUSPENDED && (all || gen->box->mark))
+      {
+        // Leave some room for the red zone and yield's own locals
+        void ** from = (void **) (((uintptr_t) gen->sp - 512) & ~(uintptr_t) 7);
+        if ((char *) from < gen->stack) from = (void **) gen->stack;
+        marked += mark_words(from, (void **) (gen->stack + GENERATOR_STACK));
+        marked += mark_words((void **) &gen->self, (void **) (&gen->self + 1));
+        gen->scanned = scanned = true;
+      }
+    }
+  }
+  while (scanned && !all);
+  return marked;
+}
+
+static void free_generator(Generator * gen)
+{
+  munmap(gen->stack, GENERATOR_STACK);
+  free(gen);
+}
+
+void release_generators(Context * ctx)
+{
+  Generator ** link = &ctx->generators;
+  while (*link != NULL)
+  {
+    Generator * gen = *link;
+    gen->scanned = false;
+    if (gen->state != GENERATOR_RUNNING && !gen->box->mark)
+    {
+      *link = gen->next;
+      free_generator(gen);
+    }
+    else link = &gen->next;
+  }
+}
+
+void free_generators(Context * ctx)
+{
+  while (ctx->generators != NULL)
+  {
+    Generator * gen = ctx->generators;
+    ctx->generators = gen->next;
+    free_generator(gen);
+  }
+}
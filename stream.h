@@ -0,0 +1,101 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <ucontext.h>
+
+#include "node.h"
+#include "memory.h"
+
+/**
+ * Promises, streams and generators.
+ *
+ * (delay expr) makes a promise of expr's value; (force p) evaluates expr
+ * the first time, and returns the memoized value after that.
+ * Like hash tables, a promise is a TYPE_PROMISE node that points to an
+ * array node of the same type, holding a PromiseBox. Copies of the
+ * handle share the box.
+ *
+ * A stream is a pair whose cdr is a promise of the rest of the stream,
+ * as made by (stream-cons a b), or an ordinary list. The stream
+ * functions walk them without materializing them in the heap.
+ * stream-for-each and stream-fold collect the garbage that they make
+ * as they go along (see collect_young in gc.h), so that a stream may
+ * be consumed in constant memory, as long as only the walk holds on to
+ * its start. A promise is evaluated once: a stream that a variable still
+ * refers to keeps all of it that was walked.
+ *
+ * (make-generator thunk) runs thunk as a coroutine on a stack of its own,
+ * returning the stream of values that it passes to (yield x). Such a
+ * stream can be walked once only: it is produced as it is consumed.
+ */
+typedef struct PromiseBox {
+  uint32_t code;   // node index of the expression, until forced
+  uint32_t env;    // node index of its environment, until forced
+  uint32_t value;  // node index of the value, once forced
+  uint32_t forced;
+} PromiseBox;
+
+#define promise_box(node) ((PromiseBox *) ((node) + 1))
+
+typedef enum GeneratorState { GENERATOR_NEW, GENERATOR_RUNNING, GENERATOR_SUSPENDED, GENERATOR_DONE } GeneratorState;
+
+typedef struct Generator {
+  ucontext_t self;
+  ucontext_t caller;
+  char * stack;
+  void * sp;               // the top of its stack at the last yield
+  GeneratorState state;
+  Node * thunk;
+  Node * value;            // the last value yielded
+  uint32_t current;        // the last cell produced, and the one before that
+  uint32_t previous;
+  Node * box;
+  bool scanned;            // by the GC
+  struct Generator * next; // in the context's list
+} Generator;
+
+#define generator_of(box) (*(Generator **) ((box) + 1))
+
+// (delay expr): special, gets expr as (transformed) code
+Node * delay(Node * args, Node ** env);
+Node * force(Node * args, Node ** env);
+
+Node * stream_cdr(Node * args, Node ** env);
+Node * stream_map(Node * args, Node ** env);
+Node * stream_filter(Node * args, Node ** env);
+Node * stream_take(Node * args, Node ** env);
+Node * stream_to_list(Node * args, Node ** env);
+Node * stream_for_each(Node * args, Node ** env);
+Node * stream_fold(Node * args, Node ** env);
+
+Node * make_generator(Node * args, Node ** env);
+Node * yield(Node * args, Node ** env);
+
+/**
+ * For the GC: mark what a promise box or a generator box holds on to.
+ */
+int mark_promise(Node * box);
+int mark_generator(Node * box);
+
+/**
+ * For the GC: mark what the suspended generators' stacks point to.
+ * If 'all' is false, only generators whose box is marked (repeatedly,
+ * as stacks may lead to further generators).
+ */
+int mark_generator_stacks(bool all);
+
+/**
+ * For the GC: free the generators whose box was not marked.
+ */
+void release_generators(Context * ctx);
+
+void free_generators(Context * ctx);
+
+/**
+ * For the GC: which run of a generator the thread is in, as the C stack
+ * below it changes from one run to the next; 0 outside of generators.
+ */
+uint64_t current_resumption();
+
+#endif /* STREAM_H */
@@ -0,0 +1,43 @@
+;; cons and list chain their own arg nodes; the args they are given must
+;; come out unchanged
+
+'"The same arg twice"
+(define (twice a) (list a a))
+(twice 1)
+(twice '(1 2))
+(define (thrice a) (cons a (list a a)))
+(thrice 1)
+(thrice '(1 2))
+((lambda (a b) (list a b a (cons b a))) 1 2)
+
+'"Consing a global onto different lists"
+(define x 5)
+(cons x '())
+(cons x '(1 2))
+(cons x (cons x '()))
+x
+(define xs '(1 2))
+(cons 0 xs)
+(cons xs xs)
+xs
+
+'"apply leaves its list alone"
+(define v '(1 (2 3)))
+(apply cons v)
+(apply list v)
+(apply cons v)
+v
+(define w (list 4 '()))
+(apply cons w)
+w
+
+'"Dotted pairs"
+(define p (cons 1 2))
+p
+(car p)
+(cdr p)
+(cons 0 p)
+(cdr (cons 'a 'b))
+(cdr (cons '(1 2) 3))
+(cons (cdr p) (cdr p))
+p
@@ -0,0 +1,28 @@
+;; Promises run their code once, even when forced again across the young
+;; collections of a stream walk
+
+(define (integers-from n) (stream-cons n (integers-from (+ n 1))))
+(define h (make-hash-table))
+
+'"A promise from before the walk, forced during it"
+(hash-set! h 'n 0)
+(define p (delay (list (hash-set! h 'n (+ 1 (hash-ref h 'n))))))
+(stream-for-each (lambda (x) (force p)) (stream-take 200000 (integers-from 0)))
+(hash-ref h 'n)
+(force p)
+(hash-ref h 'n)
+
+'"A stream with side effects, walked twice from a global"
+(hash-set! h 'm 0)
+(define (counted n) (stream-cons (hash-set! h 'm (+ 1 (hash-ref h 'm))) (counted (+ n 1))))
+(define s (stream-take 60000 (counted 0)))
+(stream-fold + 0 s)
+(hash-ref h 'm)
+(stream-fold + 0 s)
+(hash-ref h 'm)
+
+'"The same, from a function argument"
+(hash-set! h 'm 0)
+(define (walk-twice t) (list (stream-fold + 0 t) (stream-fold + 0 t)))
+(walk-twice (stream-take 60000 (counted 0)))
+(hash-ref h 'm)
@@ -0,0 +1,51 @@
+;; Regions: local lambdas whose temporaries are reset on return. 'make
+;; test' runs this with UNPAIR_REGION_CHECK, which aborts if a reset would
+;; leave anything older pointing into the region.
+
+(define (resets) (cadr (assoc 'region-resets (gc-stats))))
+(define before (resets))
+
+'"A returned arg"
+(define (id x) x)
+(define (second a b) b)
+(id 5)
+(id '(1 2 3))
+(second '(1 2) (list 3 4))
+(list (id 1) (id 2) (second 3 4))
+
+'"cons onto a global list"
+(define g '(1 2))
+(define (push-g x) (cons x g))
+(push-g 0)
+(push-g (+ 1 2))
+(define (push-twice x) (cons x (cons (* x 10) g)))
+(push-twice 7)
+g
+
+'"A result that points into the region"
+(define (incs a b) (list (+ a 1) (+ b 1)))
+(incs 1 2)
+(define (nest n) (if (= n 0) '() (list n (nest (- n 1)))))
+(nest 4)
+(car (cdr (incs 5 6)))
+
+'"An escape via a lambda that is not local"
+(define kept '())
+(define (remember x) (car (set! kept (cons x kept))))
+(define (twice-remembered x) (+ 1 (car (remember (list (* x 2) x)))))
+(twice-remembered 3)
+(define (via-map xs) (map (lambda (x) (* x x)) xs))
+(via-map '(1 2 3))
+(remember (incs 7 8))
+kept
+
+'"apply passing a pair's tail"
+(define (snd a b) b)
+(define (both a b) (list a b))
+(apply snd (cons 1 2))
+(apply both (cons 1 2))
+(apply both (cons '(1) '(2 3)))
+(apply incs (list 10 20))
+
+'"Regions were reset"
+(> (resets) before)
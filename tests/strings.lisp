@@ -0,0 +1,67 @@
+;; Strings: slices, ropes, and strings as hash keys and in comparisons
+
+'"Slices of slices"
+(define s "the quick brown fox jumps over the lazy dog")
+(define a (substring s 4 39))
+(define b (substring a 6 31))
+(define c (substring b 4 22))
+(list (string-length a) (string-length b) (string-length c))
+(substring c 3 5)
+(substring c 0 (string-length c))
+(string=? c (substring s 14 32))
+
+'"Ropes deep on the left and on the right"
+(define part "0123456789abcdef")
+(define (grow-left acc n) (if (= n 0) acc (grow-left (string-append acc part) (- n 1))))
+(define (grow-right acc n) (if (= n 0) acc (grow-right (string-append part acc) (- n 1))))
+;; Kept in globals without printing them, which would flatten them, so
+;; that they go through a collection as ropes
+(define left '())
+(define right '())
+(length (list (set! left (grow-left "" 200)) (set! right (grow-right "" 200))))
+(list (string-length left) (string-length right))
+(substring left 1590 1610)
+(substring right 8 24)
+(string=? left right)
+(= (grow-left "" 3) (grow-right "" 3))
+(string-append (grow-left "" 2) "-" (grow-right "" 2))
+(substring (string-append left "-" right) 3195 3206)
+
+'"Out of range"
+(substring "hello" 2 9)
+(substring "hello" 3 2)
+(substring "hello" -1)
+(substring a 10 36)
+(substring left 3199 3201)
+(substring "hello" 5)
+(string=? "hello" 5)
+
+'"String keys made in different ways share an entry"
+(define h (make-hash-table))
+(hash-set! h "quick brown fox jumps" 1)
+(hash-ref h (substring s 4 25))
+(hash-ref h (string-append "quick brown" " fox jumps"))
+(hash-set! h (string-append "quick brown fox" " jumps") 2)
+(hash-set! h (substring "lazy dog" 0 4) 3)
+(hash-ref h "lazy")
+(hash-ref h "quick brown fox jumps")
+(hash-count h)
+(hash-remove! h (string-append "la" "zy"))
+(hash-ref h "lazy" 'gone)
+
+'"String keys keep their entries as the table grows"
+(define (add-keys n) (if (= n 0) 0 (car (list n (hash-set! h (write-to-string (list 'key n)) n) (add-keys (- n 1))))))
+(add-keys 100)
+(hash-count h)
+(hash-ref h (string-append "(key" " 42)"))
+(hash-ref h (substring "((key 7))" 1 8))
+(hash-ref h (substring s 4 25))
+
+'"Equal strings in different arrays"
+(= "fox" (substring s 16 19))
+(string=? "fox" (substring s 16 19))
+(= (substring s 4 25) (string-append "quick brown " "fox jumps"))
+(string=? (substring s 4 25) (string-append "quick brown " "fox jumps"))
+(= (substring s 4 25) (substring s 5 26))
+(string=? "abc" "abd")
+(= "" (substring s 3 3))
@@ -0,0 +1,244 @@
+/**
+ * Strings: char arrays, slices and ropes; see text.h.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "node.h"
+#include "memory.h"
+#include "gc.h"
+#include "region.h"
+#include "text.h"
+
+// Strings shorter than this (16 chars) are copied rather than sliced or
+// joined, as a box would take more room than their chars
+#define MIN_SHARED sizeof(StringBox)
+
+// What a string node points to: a box, or else a char array
+#define is_box(target) ((target)->type == TYPE_STRING)
+
+static Node * new_chars(uint32_t length)
+{
+  Node * chars = new_array_node(TYPE_CHAR, length + 1);
+  chars->element = false;
+  strval(chars)[length] = '\0';
+  return chars;
+}
+
+Node * new_string(const char * chars, uint32_t length)
+{
+  Node * array = new_chars(length);
+  memcpy(strval(array), chars, length);
+  return new_node(TYPE_STRING, index(array));
+}
+
+// The box's 'next' is its 'chars' as well, so that mark follows it by
+// iteration: ropes made by appending in a loop are deep on that side
+static Node * new_box(StringBox box)
+{
+  Node * node = new_array_node(TYPE_STRING, sizeof(StringBox));
+  *string_box(node) = box;
+  node->next = box.chars;
+  return node;
+}
+
+static uint32_t target_length(Node * target)
+{
+  return is_box(target) ? string_box(target)->length : target->value.u32 - 1;
+}
+
+// Copy the chars of what a string points to into 'out'
+static void copy_chars(Node * target, char * out)
+{
+  // Appending in a loop makes ropes as deep as they are long; so keep
+  // a stack of the parts still to do, rather than recurse
+  uint32_t size = 64, n = 0;
+  Node ** todo = malloc(sizeof(Node *) * size);
+  todo[n++] = target;
+
+  while (n > 0)
+  {
+    Node * part = todo[--n];
+    if (!is_box(part))
+    {
+      memcpy(out, strval(part), part->value.u32 - 1);
+      out += part->value.u32 - 1;
+      continue;
+    }
+
+    StringBox * box = string_box(part);
+    if (box->right == 0)
+    {
+      memcpy(out, strval(pointer(box->chars)) + box->offset, box->length);
+      out += box->length;
+      continue;
+    }
+
+    if (n + 2 > size)
+    {
+      size *= 2;
+      todo = realloc(todo, sizeof(Node *) * size);
+    }
+    todo[n++] = pointer(box->right);
+    todo[n++] = pointer(box->chars);
+  }
+  free(todo);
+}
+
+// Copy the chars of a box into a char array of its own, and make the box
+// a slice of all of that
+static void flatten(Node * target)
+{
+  // The box may be older than the chars made for it
+  escape_regions();
+
+  StringBox * box = string_box(target);
+  Node * chars = new_chars(box->length);
+  copy_chars(target, strval(chars));
+  *box = (StringBox) { box->length, index(chars), 0, 0 };
+  target->next = box->chars;
+}
+
+const char * string_data(Node * string, uint32_t * length)
+{
+  Node * target = pointer(string->value.u32);
+  if (!is_box(target))
+  {
+    *length = target->value.u32 - 1;
+    return strval(target);
+  }
+
+  StringBox * box = string_box(target);
+  if (box->right != 0) flatten(target);
+  *length = box->length;
+  return strval(pointer(box->chars)) + box->offset;
+}
+
+Node * string_array(Node * string)
+{
+  Node * target = pointer(string->value.u32);
+  if (!is_box(target)) return target;
+
+  StringBox * box = string_box(target);
+  if (box->right != 0 || box->offset != 0 || box->length != target_length(pointer(box->chars)))
+    flatten(target);
+  return pointer(box->chars);
+}
+
+bool strings_equal(Node * a, Node * b)
+{
+  if (a->value.u32 == b->value.u32) return true;
+  if (target_length(pointer(a->value.u32)) != target_length(pointer(b->value.u32))) return false;
+
+  uint32_t length;
+  const char * chars = string_data(a, &length);
+  return memcmp(chars, string_data(b, &length), length) == 0;
+}
+
+int mark_string(Node * box)
+{
+  // The chars, or left hand side, are marked as 'next'
+  if (string_box(box)->right == 0) return 0;
+  return mark(pointer(string_box(box)->right));
+}
+
+//
+// Primitives
+//
+
+static bool is_string(Node * value, const char * name)
+{
+  if (value->type == TYPE_STRING) return true;
+  printf("Runtime error: %s expects a string; got '%s'.\n", name, types[value->type]);
+  return false;
+}
+
+// (string-length s)
+Node * string_length(Node * args, Node ** env)
+{
+  if (!is_string(args, "string-length")) return pointer_to(NIL);
+  return new_node(TYPE_INT, target_length(pointer(args->value.u32)));
+}
+
+// (substring s start [end])
+Node * substring(Node * args, Node ** env)
+{
+  if (!is_string(args, "substring")) return pointer_to(NIL);
+  Node * target = pointer(args->value.u32);
+  uint32_t length = target_length(target);
+
+  Node * start = pointer(args->next);
+  Node * end = pointer(start->next);
+  int64_t from = start->type == TYPE_INT ? start->value.i32 : -1;
+  int64_t to = end == NIL ? length : end->type == TYPE_INT ? end->value.i32 : -1;
+  if (from < 0 || to < from || to > length)
+  {
+    printf("Runtime error: substring out of range of %u chars.\n", length);
+    return pointer_to(NIL);
+  }
+
+  uint32_t n = to - from;
+  if (n == length) return element(args);
+  if (n < MIN_SHARED)
+  {
+    const char * chars = string_data(args, &length);
+    return new_string(chars + from, n);
+  }
+
+  // Slice the char array itself, rather than a slice or rope
+  uint32_t chars = index(target), offset = from;
+  if (is_box(target))
+  {
+    StringBox * box = string_box(target);
+    if (box->right != 0) flatten(target);
+    chars = box->chars;
+    offset += box->offset;
+  }
+  return new_node(TYPE_STRING, index(new_box((StringBox) { n, chars, offset, 0 })));
+}
+
+// (string-append s ...)
+Node * string_append(Node * args, Node ** env)
+{
+  uint32_t total = 0;
+  for (Node * arg = args; arg != NIL; arg = pointer(arg->next))
+  {
+    if (!is_string(arg, "string-append")) return pointer_to(NIL);
+    total += target_length(pointer(arg->value.u32));
+  }
+
+  if (total < MIN_SHARED)
+  {
+    Node * chars = new_chars(total);
+    char * out = strval(chars);
+    for (Node * arg = args; arg != NIL; arg = pointer(arg->next))
+    {
+      uint32_t length;
+      const char * data = string_data(arg, &length);
+      memcpy(out, data, length);
+      out += length;
+    }
+    return new_node(TYPE_STRING, index(chars));
+  }
+
+  Node * joined = NULL;
+  for (Node * arg = args; arg != NIL; arg = pointer(arg->next))
+  {
+    Node * target = pointer(arg->value.u32);
+    if (target_length(target) == 0) continue;
+    if (joined == NULL) joined = target;
+    else joined = new_box((StringBox) { target_length(joined) + target_length(target), index(joined), 0, index(target) });
+  }
+  return new_node(TYPE_STRING, index(joined));
+}
+
+// (string=? a b)
+Node * string_equals(Node * args, Node ** env)
+{
+  Node * other = pointer(args->next);
+  if (!is_string(args, "string=?") || !is_string(other, "string=?")) return pointer_to(NIL);
+  return strings_equal(args, other) ? pointer_to(NIL+1) : pointer_to(NIL);
+}
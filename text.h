@@ -0,0 +1,68 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "node.h"
+
+/**
+ * Strings, as opposed to labels.
+ *
+ * Labels are unique: their char arrays are interned in 'unique_strings',
+ * so that they are told apart by index. Strings are not, so that one-off
+ * string data is neither hashed nor kept for good. A TYPE_STRING node
+ * points either to a char array of its own, or to a TYPE_STRING array
+ * node holding a StringBox, which is
+ *
+ * - a slice: 'length' chars from 'offset' on in another char array, as
+ *   made by (substring s start end) without copying; or
+ * - a rope: two strings one after the other, as made by (string-append),
+ *   which is only flattened into a char array when its chars are needed.
+ *   After that, the box is a slice of the whole of that array.
+ *
+ * Char arrays hold their length (in bytes, including a terminating zero)
+ * in their header, and boxes hold it too, so the length of any string is
+ * known at once. Copies of a string node share what it points to; as
+ * strings are never changed, that is as good as a copy.
+ */
+typedef struct StringBox {
+  uint32_t length;
+  uint32_t chars;  // slice: the char array; rope: the string on the left
+  uint32_t offset; // slice only
+  uint32_t right;  // rope: the string on the right; 0 for a slice
+} StringBox;
+
+#define string_box(node) ((StringBox *) ((node) + 1))
+
+/**
+ * A string of a copy of the given chars.
+ */
+Node * new_string(const char * chars, uint32_t length);
+
+/**
+ * The chars of a string, one after the other, but not zero-terminated:
+ * a rope is flattened first.
+ */
+const char * string_data(Node * string, uint32_t * length);
+
+/**
+ * The char array of just the chars of a string, zero-terminated: a rope
+ * or a slice is copied into one of its own first.
+ */
+Node * string_array(Node * string);
+
+#define string_chars(string) strval(string_array(string))
+
+bool strings_equal(Node * a, Node * b);
+
+// Mark what a box points to, other than through its 'next'
+int mark_string(Node * box);
+
+// String primitives
+Node * string_length(Node * args, Node ** env);
+Node * substring(Node * args, Node ** env);
+Node * string_append(Node * args, Node ** env);
+Node * string_equals(Node * args, Node ** env);
+
+#endif /* TEXT_H */
@@ -78,6 +78,7 @@
 
 #include "transform.h"
 #include "eval.h"
+#include "stats.h"
 // For unique_string and friends
 #include "parse.h"
 
@@ -113,6 +114,22 @@ Node * transform_if(Node ** constructing_env, Node * existing_env, Node * expr)
   return iff;
 }
 
+/**
+ * Transform the expression of (future expr), (delay expr) or (time expr) now,
+ * so that the primitive gets code that only has to be evaluated.
+ */
+Node * transform_deferred(const char * name, Node ** constructing_env, Node * existing_env, Node * expr)
+{
+  Node * deferred = new_node(TYPE_PRIMITIVE, find_primitive(name));
+  deferred->element = false;
+
+  Node * body = transform_elem(pointer(expr->next), constructing_env, existing_env);
+  body->special = true;
+
+  deferred->next = index(body);
+  return deferred;
+}
+
  // Lambda should be eval'ed at eval time; and its args should be regarded as plain data up to that point.
 Node * transform_lambda(Node * expr)
 {
@@ -200,13 +217,29 @@ Node * as_primitive(Node * label)
   else return new_node(TYPE_PRIMITIVE, num);
 }
 
-extern Node * macros;
+/**
+ * Special primitives (e.g. from native modules) get their args as plain code,
+ * which they may then transform and eval as they see fit.
+ */
+Node * transform_special(Node * expr, int num)
+{
+  Node * prim = new_node(TYPE_PRIMITIVE, num);
+  prim->element = false;
+  if (expr->next == 0) return prim;
+
+  Node * args = copy(pointer(expr->next), -1);
+  for (Node * arg = args; arg != NIL; arg = pointer(arg->next))
+    arg->special = true;
+
+  prim->next = index(args);
+  return prim;
+}
 
 Node * macrotransform(Node * expr, Node * env)
 {
-  if (macros == NIL) return expr;
+  if (context->macros == NIL) return expr;
 
-  Node * macro = find_macro(macros, expr);
+  Node * macro = find_macro(context->macros, expr);
 
   // Keep executing macros until final form is reached
   while (macro != NIL)
@@ -219,7 +252,7 @@ Node * macrotransform(Node * expr, Node * env)
     // and not the env presently under construction -
     // but shouldn't the macro be executed purely in the macros env?
     expr = pointer(run_lambda(env, macro, expr, false)->value.u32);
-    macro = find_macro(macros, expr);
+    macro = find_macro(context->macros, expr);
   }
   return expr;
 }
@@ -282,11 +315,14 @@ Node * transform_expr(Node * expr, Node ** constructing_env, Node * existing_env
   {
     char * chars = strval(pointer(expr->value.u32));
     if (strcmp("define", chars) == 0) return define_variable(constructing_env, existing_env, expr);
-    if (strcmp("define-syntax", chars) == 0) return define_variable(&macros, existing_env, expr);
+    if (strcmp("define-syntax", chars) == 0) return define_variable(&context->macros, existing_env, expr);
     if (strcmp("set!", chars) == 0) return transform_set(constructing_env, existing_env, expr);
     if (strcmp("lambda", chars) == 0) return transform_lambda(expr);
     if (strcmp("quote" , chars) == 0) return transform_quote(pointer(expr->next)); //element(pointer(expr->next)); // because after this step, raw labels and nodes are recognized as data
     if (strcmp("if", chars) == 0) return transform_if(constructing_env, existing_env, expr);
+    if (strcmp("future", chars) == 0 || strcmp("delay", chars) == 0 || strcmp("time", chars) == 0) return transform_deferred(chars, constructing_env, existing_env, expr);
+    int num = find_primitive(chars);
+    if (num >= 0 && primitives[num].special) return transform_special(expr, num);
     // else - find primitive or user defined function
     return transform_elements(expr, constructing_env, existing_env);
   }
@@ -296,6 +332,9 @@ Node * transform_expr(Node * expr, Node ** constructing_env, Node * existing_env
 
 Node * transform(Node * node, Node ** constructing_env, Node * existing_env)
 {
-    if (node->element) return transform_elem(node, constructing_env, existing_env);
-    else return transform_expr(node, constructing_env, existing_env);
+    begin_alloc_site(SITE_TRANSFORM);
+    Node * result = node->element ? transform_elem(node, constructing_env, existing_env)
+                                  : transform_expr(node, constructing_env, existing_env);
+    end_alloc_site();
+    return result;
 }
@@ -3,8 +3,6 @@
 
 #include "node.h"
 
-extern Node * macros;
-
 Node * transform(Node * expr, Node ** constructing_env, Node * existing_env);
 
 Node * transform_elements(Node * els, Node ** constructing_env, Node * existing_env);